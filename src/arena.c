@@ -0,0 +1,71 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Bump allocator for the option and pattern state built at startup.
+ * Memory comes zeroed from blocks of WK_ARENA_BLOCK bytes, a request
+ * larger than that gets a block of its own, and nothing is given back
+ * until wk_arena_free releases every block at once.  The strings of one
+ * option set end up next to each other, and the few blocks it takes are
+ * all the allocations a mask of -m costs before it is compiled.
+ */
+
+struct wk_ablock {
+    struct wk_ablock *next;
+    size_t size;
+    char data[] __attribute__((aligned(WK_CACHELINE)));
+};
+
+/* size zeroed bytes aligned to align, a power of two up to WK_CACHELINE */
+void *wk_arena_alloc(struct wk_arena *a, size_t size, size_t align) {
+    struct wk_ablock *b;
+    void *mem;
+    uintptr_t p;
+    size_t bsize;
+
+    p = ((uintptr_t)a->next + align - 1) & ~(uintptr_t)(align - 1);
+    if (a->next == NULL || p > (uintptr_t)a->end || size > (size_t)((uintptr_t)a->end - p)) {
+        bsize = size > WK_ARENA_BLOCK ? size : WK_ARENA_BLOCK;
+        if (posix_memalign(&mem, WK_CACHELINE, sizeof(*b) + bsize) != 0) {
+            fprintf(stderr,"arena: can't allocate memory\n");
+            return NULL;
+        }
+        b = memset(mem, 0, sizeof(*b) + bsize);
+        b->size = bsize;
+        b->next = a->blocks;
+        a->blocks = b;
+        p = (uintptr_t)b->data;
+        a->end = b->data + bsize;
+    }
+    a->next = (char *)(p + size);
+    return (void *)p;
+}
+
+/* room for a wide string of n characters and its terminator */
+wchar_t *wk_arena_wcs(struct wk_arena *a, size_t n) {
+    return wk_arena_alloc(a, (n + 1) * sizeof(wchar_t), sizeof(wchar_t));
+}
+
+void wk_arena_free(struct wk_arena *a) {
+    struct wk_ablock *b, *next;
+
+    for (b = a->blocks; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    memset(a, 0, sizeof(*a));
+}
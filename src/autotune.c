@@ -0,0 +1,277 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Autotuning (--autotune).  The first candidates of the real job are
+ * generated with every worker count and chunk size of a small grid, into
+ * the same kind of output as the job: a scratch file next to -o, with the
+ * same compression, or /dev/null for stdout.  The fastest setting is kept
+ * in the profile file of the cache directory, keyed by the shape of the
+ * job and the kind of output, and later runs of the same shape use it
+ * unless -j is given.
+ */
+
+#define WK_TUNE_NS          200000000ULL    /* aimed length of one trial */
+#define WK_TUNE_PROFILE     "autotune.profile"
+#define WK_TUNE_KEYMAX      256
+
+static const size_t wk_tune_chunks[] = { 256 << 10, 1 << 20, 4 << 20 };
+
+struct wk_tune_out {
+    const char *fpath;                  /* scratch file, NULL for /dev/null */
+    const char *compressalgo;
+    const struct wk_sink *tmpl;         /* filter and record format of the job */
+};
+
+static const char *wk_out_kind(const char *fpath);
+static int wk_profile_path(char *path, size_t size);
+static int wk_profile_load(const char *key, int *nthreads, size_t *chunkbytes, double *rate);
+static int wk_profile_save(const char *key, int nthreads, size_t chunkbytes, double rate);
+static int wk_trial(const struct wk_segment *seg, uint64_t count, const struct wk_tune_out *out,
+                    int nthreads, size_t chunkbytes, uint64_t *ns);
+static void wk_print_eta(uint64_t total, double rate);
+
+/* what the job writes to, part of the profile key */
+static const char *wk_out_kind(const char *fpath) {
+    struct stat st;
+
+    if (fpath != NULL)
+        return "file";
+    if (fstat(STDOUT_FILENO, &st) == -1)
+        return "none";
+    if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))
+        return "pipe";
+    if (S_ISCHR(st.st_mode))
+        return isatty(STDOUT_FILENO) ? "tty" : "null";
+    return "file";
+}
+
+static int wk_profile_path(char *path, size_t size) {
+    char dir[PATH_MAX];
+
+    if (wk_cache_dir(dir, sizeof(dir)) == -1)
+        return -1;
+    if ((size_t)snprintf(path, size, "%s/%s", dir, WK_TUNE_PROFILE) >= size) {
+        fprintf(stderr,"autotune: cache directory name too long: %s\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+/* lines of "key threads chunkbytes rate", 0 if key was found */
+static int wk_profile_load(const char *key, int *nthreads, size_t *chunkbytes, double *rate) {
+    char path[PATH_MAX], line[WK_TUNE_KEYMAX + 128], k[WK_TUNE_KEYMAX];
+    unsigned long cb;
+    double r;
+    FILE *fp;
+    int t, rc = -1;
+
+    if (wk_profile_path(path, sizeof(path)) == -1 || (fp = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%255s %d %lu %lf", k, &t, &cb, &r) == 4 && strcmp(k, key) == 0
+            && t >= 1 && t <= WK_MAXTHREADS && cb > 0) {
+            *nthreads = t;
+            *chunkbytes = cb;
+            *rate = r;
+            rc = 0;
+        }
+    }
+    (void)fclose(fp);
+    return rc;
+}
+
+static int wk_profile_save(const char *key, int nthreads, size_t chunkbytes, double rate) {
+    char path[PATH_MAX], tmp[PATH_MAX + 16], line[WK_TUNE_KEYMAX + 128], k[WK_TUNE_KEYMAX];
+    FILE *in, *out;
+
+    if (wk_profile_path(path, sizeof(path)) == -1)
+        return -1;
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+    if ((out = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr,"autotune: can't write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    /* keep the other shapes */
+    if ((in = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (sscanf(line, "%255s", k) == 1 && strcmp(k, key) != 0)
+                fputs(line, out);
+        }
+        (void)fclose(in);
+    }
+    fprintf(out, "%s %d %lu %.0f\n", key, nthreads, (unsigned long)chunkbytes, rate);
+    if (fclose(out) != 0 || rename(tmp, path) == -1) {
+        fprintf(stderr,"autotune: can't write %s: %s\n", path, strerror(errno));
+        (void)remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* time count candidates from the start of seg with one setting */
+static int wk_trial(const struct wk_segment *seg, uint64_t count, const struct wk_tune_out *out,
+                    int nthreads, size_t chunkbytes, uint64_t *ns) {
+    struct wk_segment s = *seg;
+    struct wk_sink sink;
+    uint64_t t0;
+    int rc;
+
+    s.count = count;
+    s.chunk = chunkbytes / seg->src->maxrec ? chunkbytes / seg->src->maxrec : 1;
+    s.done = NULL;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.filter = out->tmpl->filter;
+    sink.format = out->tmpl->format;
+    sink.width = out->tmpl->width;
+    if (out->fpath != NULL) {
+        if (wk_sink_open(&sink, out->fpath, out->fpath, out->compressalgo, 0) == -1)
+            return -1;
+    } else if ((sink.fd = open("/dev/null", O_WRONLY)) == -1) {
+        fprintf(stderr,"autotune: can't open /dev/null: %s\n", strerror(errno));
+        return -1;
+    }
+
+    t0 = wk_now_ns();
+    rc = wk_pool_run(&s, 1, &sink, nthreads, NULL);
+    if (out->fpath != NULL) {
+        if (wk_sink_close(&sink) == -1)
+            rc = -1;
+    } else {
+        (void)close(sink.fd);
+    }
+    *ns = wk_now_ns() - t0;
+    if (*ns == 0)
+        *ns = 1;
+    return rc;
+}
+
+static void wk_print_eta(uint64_t total, double rate) {
+    double secs = rate > 0 ? (double)total / rate : 0;
+    unsigned long long s = (unsigned long long)secs;
+
+    fprintf(stderr, "Projected runtime for %llu candidates: ", (unsigned long long)total);
+    if (s >= 86400)
+        fprintf(stderr, "%llud ", s / 86400);
+    fprintf(stderr, "%02llu:%02llu:%02llu (%.0f candidates/s)\n",
+            s / 3600 % 24, s / 60 % 60, s % 60, rate);
+}
+
+/*
+ * Use the profile of shape or, with calibrate, measure one.  Sets *nthreads
+ * and seg->chunk.  Returns 0 if a setting was applied, 1 if there is none
+ * for this shape, -1 on error.
+ */
+int wk_autotune(struct wk_segment *seg, const char *shape, const char *fpath,
+                const char *compressalgo, const struct wk_sink *tmpl,
+                int calibrate, long *nthreads) {
+    char key[WK_TUNE_KEYMAX], scratch[PATH_MAX];
+    struct wk_tune_out out;
+    uint64_t sample, ns, best_ns = 0;
+    size_t c, chunkbytes = 0, best_chunk = WK_CHUNKBYTES;
+    double rate = 0;
+    long ncpu, t, best_t = 1;
+    int saved;
+
+    if ((size_t)snprintf(key, sizeof(key), "%s:%s", shape, wk_out_kind(fpath)) >= sizeof(key)) {
+        fprintf(stderr,"autotune: job shape too long\n");
+        return -1;
+    }
+
+    if (!calibrate) {
+        if (wk_profile_load(key, &saved, &chunkbytes, &rate) == -1)
+            return 1;
+        *nthreads = saved;
+        seg->chunk = chunkbytes / seg->src->maxrec ? chunkbytes / seg->src->maxrec : 1;
+        fprintf(stderr, "Tuned profile: %ld threads, %lu KB chunks\n",
+                *nthreads, (unsigned long)(chunkbytes >> 10));
+        wk_print_eta(seg->count, rate);
+        return 0;
+    }
+
+    if (seg->count == 0) {
+        fprintf(stderr,"autotune: nothing to generate\n");
+        return -1;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.compressalgo = compressalgo;
+    out.tmpl = tmpl;
+    if (fpath != NULL) {
+        snprintf(scratch, sizeof(scratch), "%s.tune", fpath);
+        out.fpath = scratch;
+    }
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    if (ncpu > WK_MAXTHREADS)
+        ncpu = WK_MAXTHREADS;
+
+    /* grow the sample until one thread takes long enough to measure */
+    for (sample = 4096; ; sample *= 4) {
+        if (sample > seg->count)
+            sample = seg->count;
+        if (wk_trial(seg, sample, &out, 1, WK_CHUNKBYTES, &ns) == -1)
+            goto err;
+        if (ns >= WK_TUNE_NS / 8 || sample == seg->count)
+            break;
+    }
+    sample = (uint64_t)((double)sample * (double)WK_TUNE_NS / (double)ns);
+    if (sample > seg->count)
+        sample = seg->count;
+    if (sample == 0)
+        sample = 1;
+
+    fprintf(stderr, "Autotune: %llu candidates per trial\n", (unsigned long long)sample);
+    for (t = 1; ; t = t * 2 < ncpu ? t * 2 : ncpu) {
+        for (c = 0; c < sizeof(wk_tune_chunks) / sizeof(wk_tune_chunks[0]); c++) {
+            if (wk_trial(seg, sample, &out, (int)t, wk_tune_chunks[c], &ns) == -1)
+                goto err;
+            fprintf(stderr, "  %2ld threads, %5lu KB chunks: %.0f candidates/s\n", t,
+                    (unsigned long)(wk_tune_chunks[c] >> 10), (double)sample * 1e9 / (double)ns);
+            if (best_ns == 0 || ns < best_ns) {
+                best_ns = ns;
+                best_t = t;
+                best_chunk = wk_tune_chunks[c];
+            }
+        }
+        if (t == ncpu)
+            break;
+    }
+    if (out.fpath != NULL) {
+        snprintf(scratch + strlen(scratch), sizeof(scratch) - strlen(scratch), "%s",
+                 wk_compress_ext(compressalgo));
+        (void)remove(scratch);
+    }
+
+    rate = (double)sample * 1e9 / (double)best_ns;
+    fprintf(stderr, "Best: %ld threads, %lu KB chunks\n", best_t, (unsigned long)(best_chunk >> 10));
+    wk_print_eta(seg->count, rate);
+    *nthreads = best_t;
+    seg->chunk = best_chunk / seg->src->maxrec ? best_chunk / seg->src->maxrec : 1;
+    return wk_profile_save(key, (int)best_t, best_chunk, rate);
+
+err:
+    if (out.fpath != NULL) {
+        snprintf(scratch + strlen(scratch), sizeof(scratch) - strlen(scratch), "%s",
+                 wk_compress_ext(compressalgo));
+        (void)remove(scratch);
+    }
+    return -1;
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Character index of the charset registry.  Every character of any charset
+ * gets a dense id, and the id maps to its position in each charset and to
+ * the smallest duplicate limit of the charsets holding it.
+ *
+ * Characters of the BMP are found in a two level table whose pages are
+ * only allocated when one of their characters is used.  The few characters
+ * above it go to a hash and displace table: each bucket stores the seed
+ * that sends its characters to free slots, so a lookup is two hashes and
+ * one compare.
+ */
+
+#define WK_CIX_MAXSEED  (1U << 20)      /* seeds tried for a bucket before growing the table */
+
+static inline uint32_t wk_cix_hash(uint32_t c, uint32_t seed);
+static int wk_wchar_cmp(const void *a, const void *b);
+static int wk_bucket_cmp(const void *a, const void *b);
+static int wk_cix_place(struct wk_cindex *ix, const wchar_t *key, size_t n);
+
+static const size_t *wk_sort_bsize;
+
+static inline uint32_t wk_cix_hash(uint32_t c, uint32_t seed) {
+    uint32_t h = (c ^ seed) * 0x9e3779b1U;
+
+    h ^= h >> 15;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    return h;
+}
+
+static int wk_wchar_cmp(const void *a, const void *b) {
+    wchar_t x = *(const wchar_t *)a, y = *(const wchar_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* largest bucket first, they are the hardest to place */
+static int wk_bucket_cmp(const void *a, const void *b) {
+    size_t x = wk_sort_bsize[*(const uint32_t *)a], y = wk_sort_bsize[*(const uint32_t *)b];
+
+    return (x < y) - (x > y);
+}
+
+/* the n characters of key above the BMP get the ids nids..nids+n-1 */
+static int wk_cix_place(struct wk_cindex *ix, const wchar_t *key, size_t n) {
+    size_t *bsize = NULL, i, j, k;
+    uint32_t *order = NULL, *slot = NULL, b, seed;
+    int rc = -1;
+
+    for (ix->nbuckets = 1; ix->nbuckets < n / 2; ix->nbuckets *= 2)
+        ;
+    for (ix->nslots = 2; ix->nslots < 2 * n; ix->nslots *= 2)
+        ;
+
+retry:
+    free(ix->disp);
+    free(ix->key);
+    free(ix->sid);
+    free(bsize);
+    free(order);
+    ix->disp = calloc(ix->nbuckets, sizeof(uint32_t));
+    ix->key = calloc(ix->nslots, sizeof(wchar_t));
+    ix->sid = calloc(ix->nslots, sizeof(uint16_t));
+    bsize = calloc(ix->nbuckets, sizeof(size_t));
+    order = malloc(ix->nbuckets * sizeof(uint32_t));
+    if (slot == NULL)
+        slot = malloc(n * sizeof(uint32_t));
+    if (ix->disp == NULL || ix->key == NULL || ix->sid == NULL || bsize == NULL
+        || order == NULL || slot == NULL) {
+        fprintf(stderr,"cindex: can't allocate memory for the character index\n");
+        goto out;
+    }
+
+    for (i = 0; i < n; i++)
+        bsize[wk_cix_hash((uint32_t)key[i], 0) & (ix->nbuckets - 1)]++;
+    for (b = 0; b < ix->nbuckets; b++)
+        order[b] = b;
+    wk_sort_bsize = bsize;
+    qsort(order, ix->nbuckets, sizeof(uint32_t), wk_bucket_cmp);
+
+    for (b = 0; b < ix->nbuckets && bsize[order[b]] > 0; b++) {
+        for (seed = 1; seed < WK_CIX_MAXSEED; seed++) {
+            /* every character of the bucket to a free slot of its own */
+            for (i = 0, k = 0; i < n; i++) {
+                if ((wk_cix_hash((uint32_t)key[i], 0) & (ix->nbuckets - 1)) != order[b])
+                    continue;
+                slot[k] = wk_cix_hash((uint32_t)key[i], seed) & (uint32_t)(ix->nslots - 1);
+                if (ix->sid[slot[k]] != 0)
+                    break;
+                for (j = 0; j < k && slot[j] != slot[k]; j++)
+                    ;
+                if (j < k)
+                    break;
+                k++;
+            }
+            if (i == n)
+                break;
+        }
+        if (seed == WK_CIX_MAXSEED) {
+            ix->nslots *= 2;
+            goto retry;
+        }
+        ix->disp[order[b]] = seed;
+        for (i = 0, k = 0; i < n; i++) {
+            if ((wk_cix_hash((uint32_t)key[i], 0) & (ix->nbuckets - 1)) != order[b])
+                continue;
+            ix->key[slot[k]] = key[i];
+            ix->sid[slot[k]] = (uint16_t)(ix->nids + i + 1);
+            k++;
+        }
+    }
+    ix->nids += n;
+    rc = 0;
+
+out:
+    free(bsize);
+    free(order);
+    free(slot);
+    return rc;
+}
+
+/* index the WK_NCHARSETS entries of cs */
+int wk_cindex_build(struct wk_cindex *ix, const struct wk_charset *cs) {
+    wchar_t *astral = NULL;
+    size_t nchars = 0, nastral = 0, i, j, id;
+    unsigned long u;
+    int n;
+
+    memset(ix, 0, sizeof(*ix));
+    for (n = 0; n < WK_NCHARSETS; n++)
+        nchars += cs[n].cset != NULL ? cs[n].clen : 0;
+    if (nchars == 0)
+        return 0;
+
+    ix->pos = calloc(nchars, sizeof(*ix->pos));
+    ix->dlim = malloc(nchars * sizeof(size_t));
+    astral = malloc(nchars * sizeof(wchar_t));
+    if (ix->pos == NULL || ix->dlim == NULL || astral == NULL)
+        goto nomem;
+
+    for (n = 0; n < WK_NCHARSETS; n++) {
+        for (i = 0; cs[n].cset != NULL && i < cs[n].clen; i++) {
+            u = (unsigned long)cs[n].cset[i];
+            if (u >= 0x10000) {
+                astral[nastral++] = cs[n].cset[i];
+                continue;
+            }
+            if (ix->page[u >> 8] == NULL && (ix->page[u >> 8] = calloc(256, sizeof(uint16_t))) == NULL)
+                goto nomem;
+            if (ix->page[u >> 8][u & 255] == 0)
+                ix->page[u >> 8][u & 255] = (uint16_t)++ix->nids;
+        }
+    }
+
+    if (nastral > 0) {
+        qsort(astral, nastral, sizeof(wchar_t), wk_wchar_cmp);
+        for (i = 1, j = 1; i < nastral; i++) {
+            if (astral[i] != astral[j-1])
+                astral[j++] = astral[i];
+        }
+        if (wk_cix_place(ix, astral, j) == -1)
+            goto err;
+    }
+    free(astral);
+
+    for (id = 0; id < ix->nids; id++)
+        ix->dlim[id] = NPOS;
+    for (n = 0; n < WK_NCHARSETS; n++) {
+        for (i = 0; cs[n].cset != NULL && i < cs[n].clen; i++) {
+            id = wk_cindex_id(ix, cs[n].cset[i]);
+            if (ix->pos[id][n] == 0)
+                ix->pos[id][n] = (uint16_t)(i + 1);
+            if (cs[n].duplicates < ix->dlim[id])
+                ix->dlim[id] = cs[n].duplicates;
+        }
+    }
+    return 0;
+
+nomem:
+    fprintf(stderr,"cindex: can't allocate memory for the character index\n");
+err:
+    free(astral);
+    wk_cindex_free(ix);
+    return -1;
+}
+
+/* dense id of c, NPOS if no charset holds it */
+size_t wk_cindex_id(const struct wk_cindex *ix, wchar_t c) {
+    unsigned long u = (unsigned long)c;
+    const uint16_t *page;
+    uint32_t s;
+
+    if (u < 0x10000) {
+        page = ix->page[u >> 8];
+        return page != NULL && page[u & 255] != 0 ? (size_t)page[u & 255] - 1 : NPOS;
+    }
+    if (ix->nslots == 0 || u > UINT32_MAX)
+        return NPOS;
+    s = wk_cix_hash((uint32_t)u, ix->disp[wk_cix_hash((uint32_t)u, 0) & (ix->nbuckets - 1)])
+        & (uint32_t)(ix->nslots - 1);
+    return ix->key[s] == c && ix->sid[s] != 0 ? (size_t)ix->sid[s] - 1 : NPOS;
+}
+
+void wk_cindex_free(struct wk_cindex *ix) {
+    size_t p;
+
+    for (p = 0; p < WK_CIX_PAGES; p++)
+        free(ix->page[p]);
+    free(ix->disp);
+    free(ix->key);
+    free(ix->sid);
+    free(ix->pos);
+    free(ix->dlim);
+    memset(ix, 0, sizeof(*ix));
+}
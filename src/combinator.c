@@ -0,0 +1,135 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Combinator mode: the cartesian product of k word lists (-k), joined by
+ * an optional separator (-K).  Candidate indexes are mixed radix over the
+ * list sizes with the first list most significant, so index i is
+ *
+ *   lists[0][d0] sep lists[1][d1] sep ... lists[k-1][dk-1]
+ *
+ * A chunk is a run of consecutive indexes: the words of every list but the
+ * last are joined once into a prefix and the last list is streamed behind
+ * it, so the inner loop is two memcpys per candidate.
+ */
+
+struct wk_combinator {
+    const struct wk_words *lists;
+    size_t nlists;
+    const char *sep;
+    size_t seplen;
+};
+
+static size_t wk_comb_prefix(const struct wk_combinator *cb, const size_t *digit, char *out);
+static size_t wk_comb_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                           char *buf, size_t *nrec);
+
+/* join the current words of every list but the last, followed by the separator */
+static size_t wk_comb_prefix(const struct wk_combinator *cb, const size_t *digit, char *out) {
+    const struct wk_words *w;
+    size_t j, len = 0;
+
+    for (j = 0; j + 1 < cb->nlists; j++) {
+        w = &cb->lists[j];
+        memcpy(out + len, w->arena + w->off[digit[j]], w->len[digit[j]]);
+        len += w->len[digit[j]];
+        memcpy(out + len, cb->sep, cb->seplen);
+        len += cb->seplen;
+    }
+    return len;
+}
+
+static size_t wk_comb_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                           char *buf, size_t *nrec) {
+    const struct wk_combinator *cb = src->priv;
+    const struct wk_words *last = &cb->lists[cb->nlists - 1];
+    char prefix[WK_MAXLISTS * (MAXSTRING*WK_MBMAX + MAXSTRING)];
+    size_t digit[WK_MAXLISTS];
+    size_t j, r, end, plen, wlen;
+    uint64_t idx = first;
+    char *out = buf;
+
+    for (j = cb->nlists; j > 0; j--) {
+        digit[j-1] = (size_t)(idx % cb->lists[j-1].n);
+        idx /= cb->lists[j-1].n;
+    }
+
+    *nrec = 0;
+    while (n > 0) {
+        plen = wk_comb_prefix(cb, digit, prefix);
+        r = digit[cb->nlists - 1];
+        end = last->n - r < n ? last->n : r + (size_t)n;
+
+        for (; r < end; r++) {
+            wlen = last->len[r];
+            memcpy(out, prefix, plen);
+            memcpy(out + plen, last->arena + last->off[r], wlen);
+            out[plen + wlen] = wk_eol;
+            out += plen + wlen + 1;
+        }
+        n -= end - digit[cb->nlists - 1];
+        *nrec += end - digit[cb->nlists - 1];
+
+        /* carry into the outer lists */
+        digit[cb->nlists - 1] = 0;
+        for (j = cb->nlists - 1; j > 0; j--) {
+            if (++digit[j-1] < cb->lists[j-1].n)
+                break;
+            digit[j-1] = 0;
+        }
+    }
+    return (size_t)(out - buf);
+}
+
+int wk_combinator_source(const struct wk_words *lists, size_t nlists, const char *sep,
+                         struct wk_source *src) {
+    struct wk_combinator *cb;
+    uint64_t total = 1;
+    size_t j, maxrec = 1;
+
+    if (sep == NULL)
+        sep = "";
+    if (strlen(sep) > MAXSTRING) {
+        fprintf(stderr,"combinator: the separator is longer than %d bytes\n", MAXSTRING);
+        return -1;
+    }
+
+    for (j = 0; j < nlists; j++) {
+        if (total > UINT64_MAX / lists[j].n) {
+            fprintf(stderr,"combinator: the keyspace has more than 2^64 candidates\n");
+            return -1;
+        }
+        total *= lists[j].n;
+        maxrec += lists[j].maxlen + (j ? strlen(sep) : 0);
+    }
+
+    cb = calloc(1, sizeof(*cb));
+    if (cb == NULL) {
+        fprintf(stderr,"combinator: can't allocate memory\n");
+        return -1;
+    }
+    cb->lists = lists;
+    cb->nlists = nlists;
+    cb->sep = sep;
+    cb->seplen = strlen(sep);
+
+    src->total = total;
+    src->maxrec = maxrec;
+    src->fill = wk_comb_fill;
+    src->priv = cb;
+    return 0;
+}
@@ -0,0 +1,754 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Exclusion rules (--exclude rule, --exclude-file file).  A rule is a
+ * forbidden substring of characters, . for any character, [...] for a
+ * class with a-z ranges and a leading ^ to negate it, and \ to escape.
+ * A leading ^ anchors the rule to the start of the candidate and a
+ * trailing $ to its end.  Rule files hold one rule per line, empty lines
+ * and lines starting with # are skipped.
+ *
+ * The rules compile to one DFA.  Its alphabet is the characters the mask
+ * can produce, merged into classes of characters no rule element tells
+ * apart.  A state is the set of partial matches, the dead state 0 is
+ * entered once a rule matches.  The DFA reads a candidate from its
+ * slowest changing position to its fastest, right to left with -i (the
+ * rules are reversed to match), so the state of every prefix of the
+ * enumeration is known.
+ *
+ * Per length, cnt[i][s] is the number of kept candidates below a prefix
+ * of i positions that left the DFA in state s.  A choice whose count is 0
+ * is skipped together with every candidate below it, so excluded
+ * subtrees cost nothing.  The counts also give the filtered keyspace an
+ * exact size and every kept candidate an index, so -j, -x, -r and bfc
+ * serve work as for the plain mask.
+ */
+
+#define WK_XMAXSTATES   (1 << 16)       /* states of the DFA */
+#define WK_XMAXTABLE    (1 << 26)       /* entries of its transition table */
+#define WK_XDEAD        0
+#define WK_XSTART       1
+
+struct wk_xrange {
+    wchar_t lo, hi;
+};
+
+/* one element of a rule, the characters in ranges [r0, r1), or not in them */
+struct wk_xelem {
+    size_t r0, r1;
+    int neg;
+};
+
+/* elements [e0, e0+len) */
+struct wk_xrule {
+    size_t e0, len;
+    int head, tail;                     /* anchored by ^ and $ */
+};
+
+struct wk_xbuild {
+    struct wk_xrange *rng;
+    size_t nrng, crng;
+    struct wk_xelem *el;
+    size_t nel, cel;
+    struct wk_xrule *rule;
+    size_t nrule, crule;
+};
+
+/* one length of the mask, positions by level from the slowest to the fastest */
+struct wk_xspace {
+    const struct wk_space *sp;
+    size_t *rd;                         /* position read at each level */
+    uint32_t **xc;                      /* class of every choice of each level */
+    uint64_t *cnt;                      /* cnt[i*nstates + s] */
+    uint64_t base, count;               /* kept candidates before and in sp's range */
+};
+
+struct wk_exclude {
+    struct wk_xspace *spaces;
+    size_t nspaces;
+    size_t nstates, ncls;
+    uint32_t *delta;                    /* delta[s*ncls + c] */
+    unsigned char *reject;              /* a candidate ending in s is excluded */
+    int checkdups;
+};
+
+static int wk_xgrow(void **p, size_t *cap, size_t n, size_t size);
+static int wk_xparse(struct wk_xbuild *b, const wchar_t *w, const char *rule);
+static int wk_xparse_mb(struct wk_xbuild *b, const char *s);
+static int wk_xfile(struct wk_xbuild *b, const char *filename);
+static int wk_xin(const struct wk_xbuild *b, size_t e, wchar_t c);
+static int wk_wchar_cmp(const void *a, const void *b);
+static int wk_xitem_cmp(const void *a, const void *b);
+static int wk_xdfa(struct wk_exclude *ex, const struct wk_xbuild *b, const unsigned char *in);
+static int wk_xspace_init(struct wk_exclude *ex, struct wk_xspace *xs, const wchar_t *sym,
+                          size_t nsym, const uint32_t *cls);
+static uint64_t wk_xrank(const struct wk_exclude *ex, const struct wk_xspace *xs, uint64_t idx);
+static size_t wk_xspace_fill(const struct wk_exclude *ex, const struct wk_xspace *xs,
+                             uint64_t j, uint64_t n, char *buf, size_t *nrec);
+static size_t wk_exclude_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                              char *buf, size_t *nrec);
+
+/* make room for n elements of size bytes */
+static int wk_xgrow(void **p, size_t *cap, size_t n, size_t size) {
+    void *t;
+    size_t c = *cap ? *cap : 16;
+
+    if (n <= *cap)
+        return 0;
+    while (c < n)
+        c *= 2;
+    t = realloc(*p, c * size);
+    if (t == NULL) {
+        fprintf(stderr,"exclude: can't allocate memory for the rules\n");
+        return -1;
+    }
+    *p = t;
+    *cap = c;
+    return 0;
+}
+
+static int wk_xparse(struct wk_xbuild *b, const wchar_t *w, const char *rule) {
+    struct wk_xrule r;
+    struct wk_xelem e;
+    wchar_t lo, hi;
+    int first;
+
+    r.e0 = b->nel;
+    r.head = r.tail = 0;
+    if (*w == L'^') {
+        r.head = 1;
+        w++;
+    }
+    while (*w != L'\0') {
+        if (w[0] == L'$' && w[1] == L'\0') {
+            r.tail = 1;
+            break;
+        }
+        e.r0 = b->nrng;
+        e.neg = 0;
+        if (*w == L'.') {
+            e.neg = 1;
+            w++;
+        } else if (*w == L'[') {
+            w++;
+            if (*w == L'^') {
+                e.neg = 1;
+                w++;
+            }
+            /* a ] right after the [ is a member */
+            for (first = 1; *w != L'\0' && (*w != L']' || first); first = 0) {
+                lo = *w == L'\\' && w[1] != L'\0' ? *++w : *w;
+                hi = lo;
+                w++;
+                if (w[0] == L'-' && w[1] != L'\0' && w[1] != L']') {
+                    w++;
+                    hi = *w == L'\\' && w[1] != L'\0' ? *++w : *w;
+                    w++;
+                }
+                if (hi < lo) {
+                    fprintf(stderr,"exclude: bad range in rule %s\n", rule);
+                    return -1;
+                }
+                if (wk_xgrow((void **)&b->rng, &b->crng, b->nrng + 1, sizeof(*b->rng)) == -1)
+                    return -1;
+                b->rng[b->nrng].lo = lo;
+                b->rng[b->nrng++].hi = hi;
+            }
+            if (*w != L']') {
+                fprintf(stderr,"exclude: missing ] in rule %s\n", rule);
+                return -1;
+            }
+            w++;
+        } else {
+            lo = *w == L'\\' && w[1] != L'\0' ? *++w : *w;
+            w++;
+            if (wk_xgrow((void **)&b->rng, &b->crng, b->nrng + 1, sizeof(*b->rng)) == -1)
+                return -1;
+            b->rng[b->nrng].lo = b->rng[b->nrng].hi = lo;
+            b->nrng++;
+        }
+        e.r1 = b->nrng;
+        if (wk_xgrow((void **)&b->el, &b->cel, b->nel + 1, sizeof(*b->el)) == -1)
+            return -1;
+        b->el[b->nel++] = e;
+    }
+
+    r.len = b->nel - r.e0;
+    if (r.len == 0) {
+        fprintf(stderr,"exclude: rule %s matches no character\n", rule);
+        return -1;
+    }
+    if (wk_xgrow((void **)&b->rule, &b->crule, b->nrule + 1, sizeof(*b->rule)) == -1)
+        return -1;
+    b->rule[b->nrule++] = r;
+    return 0;
+}
+
+static int wk_xparse_mb(struct wk_xbuild *b, const char *s) {
+    wchar_t *w;
+    size_t i, n = strlen(s) + 1;
+    int rc;
+
+    w = calloc(n, sizeof(wchar_t));
+    if (w == NULL) {
+        fprintf(stderr,"exclude: can't allocate memory for the rules\n");
+        return -1;
+    }
+    /* bytes the locale can't decode stand for themselves, as on the command line */
+    if (mbstowcs(w, s, n) == NPOS) {
+        for (i = 0; i < n; i++)
+            w[i] = (wchar_t)(unsigned char)s[i];
+    }
+    rc = wk_xparse(b, w, s);
+    free(w);
+    return rc;
+}
+
+static int wk_xfile(struct wk_xbuild *b, const char *filename) {
+    FILE *fp;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    int rc = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr,"exclude: can't open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    while (rc == 0 && (n = getline(&line, &cap, fp)) != -1) {
+        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+            line[--n] = '\0';
+        if (n == 0 || line[0] == '#')
+            continue;
+        rc = wk_xparse_mb(b, line);
+    }
+    free(line);
+    fclose(fp);
+    return rc;
+}
+
+/* whether element e matches c */
+static int wk_xin(const struct wk_xbuild *b, size_t e, wchar_t c) {
+    size_t r;
+
+    for (r = b->el[e].r0; r < b->el[e].r1; r++) {
+        if (c >= b->rng[r].lo && c <= b->rng[r].hi)
+            return !b->el[e].neg;
+    }
+    return b->el[e].neg;
+}
+
+static int wk_wchar_cmp(const void *a, const void *b) {
+    wchar_t x = *(const wchar_t *)a, y = *(const wchar_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int wk_xitem_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Subset construction.  Item i < nel is a partial match of the rule
+ * holding element i that has matched it and the elements before it in
+ * the rule.  A full match of a $ rule stays an item until the next
+ * character, a full match of any other rule is the dead state.
+ */
+static int wk_xdfa(struct wk_exclude *ex, const struct wk_xbuild *b, const unsigned char *in) {
+    const size_t nc = ex->ncls;
+    uint32_t *erule = NULL, *items = NULL, *soff = NULL, *slen = NULL, *hash = NULL;
+    uint32_t *tmp = NULL, *mark = NULL, *tab;
+    size_t nitems = 0, citems = 0, cstates = 0, cdelta = 0, crej = 0, hcap = 1024;
+    size_t s, c, k, r, i, e, n, h, last;
+    uint32_t stamp = 0, t;
+    int rc = -1;
+
+    erule = malloc(b->nel * sizeof(*erule));
+    tmp = malloc((b->nel + 1) * sizeof(*tmp));
+    mark = calloc(b->nel, sizeof(*mark));
+    hash = calloc(hcap, sizeof(*hash));
+    if (erule == NULL || tmp == NULL || mark == NULL || hash == NULL)
+        goto nomem;
+    for (r = 0; r < b->nrule; r++) {
+        for (e = b->rule[r].e0; e < b->rule[r].e0 + b->rule[r].len; e++)
+            erule[e] = (uint32_t)r;
+    }
+
+    /* dead and start state, both without items */
+    if (wk_xgrow((void **)&soff, &cstates, 2, sizeof(*soff)) == -1)
+        goto out;
+    slen = calloc(cstates, sizeof(*slen));
+    if (slen == NULL)
+        goto nomem;
+    soff[0] = soff[1] = 0;
+    ex->nstates = 2;
+
+    for (s = 0; s < ex->nstates; s++) {
+        if (wk_xgrow((void **)&ex->delta, &cdelta, (s + 1) * nc, sizeof(*ex->delta)) == -1
+            || wk_xgrow((void **)&ex->reject, &crej, s + 1, 1) == -1)
+            goto out;
+        ex->reject[s] = s == WK_XDEAD;
+        for (k = 0; k < slen[s]; k++) {
+            e = items[soff[s] + k];
+            if (e == b->rule[erule[e]].e0 + b->rule[erule[e]].len - 1)
+                ex->reject[s] = 1;
+        }
+
+        for (c = 0; c < nc; c++) {
+            if (s == WK_XDEAD) {
+                ex->delta[s*nc + c] = WK_XDEAD;
+                continue;
+            }
+            stamp++;
+            n = 0;
+            /* advance the partial matches, then start new ones */
+            for (k = 0; k < slen[s] + b->nrule && n != NPOS; k++) {
+                if (k < slen[s]) {
+                    i = items[soff[s] + k];
+                    r = erule[i];
+                    last = b->rule[r].e0 + b->rule[r].len - 1;
+                    if (i == last || !in[(i+1)*nc + c])
+                        continue;
+                    i++;
+                } else {
+                    r = k - slen[s];
+                    i = b->rule[r].e0;
+                    if ((b->rule[r].head && s != WK_XSTART) || !in[i*nc + c])
+                        continue;
+                    last = i + b->rule[r].len - 1;
+                }
+                if (i == last && !b->rule[r].tail)
+                    n = NPOS;
+                else if (mark[i] != stamp) {
+                    mark[i] = stamp;
+                    tmp[n++] = (uint32_t)i;
+                }
+            }
+            if (n == NPOS) {
+                ex->delta[s*nc + c] = WK_XDEAD;
+                continue;
+            }
+            qsort(tmp, n, sizeof(*tmp), wk_xitem_cmp);
+
+            /* look the item set up, dead and start are not in the table */
+            for (h = 0, k = 0; k < n; k++)
+                h = (h ^ tmp[k]) * 0x100000001b3ULL;
+            for (h &= hcap - 1; hash[h] != 0; h = (h + 1) & (hcap - 1)) {
+                t = hash[h];
+                if (slen[t] == n && memcmp(&items[soff[t]], tmp, n * sizeof(*tmp)) == 0)
+                    break;
+            }
+            if (hash[h] != 0) {
+                ex->delta[s*nc + c] = hash[h];
+                continue;
+            }
+
+            if (ex->nstates == WK_XMAXSTATES || (ex->nstates + 1) * nc > WK_XMAXTABLE) {
+                fprintf(stderr,"exclude: the rules need more than %lu DFA states\n",
+                        (unsigned long)ex->nstates);
+                goto out;
+            }
+            t = (uint32_t)ex->nstates++;
+            if (wk_xgrow((void **)&soff, &cstates, ex->nstates, sizeof(*soff)) == -1)
+                goto out;
+            if ((tab = realloc(slen, cstates * sizeof(*slen))) == NULL)
+                goto nomem;
+            slen = tab;
+            if (wk_xgrow((void **)&items, &citems, nitems + n, sizeof(*items)) == -1)
+                goto out;
+            memcpy(&items[nitems], tmp, n * sizeof(*tmp));
+            soff[t] = (uint32_t)nitems;
+            slen[t] = (uint32_t)n;
+            nitems += n;
+            hash[h] = t;
+            ex->delta[s*nc + c] = t;
+
+            /* keep the table at most half full */
+            if (2 * ex->nstates > hcap) {
+                tab = calloc(2 * hcap, sizeof(*tab));
+                if (tab == NULL)
+                    goto nomem;
+                for (h = 0; h < hcap; h++) {
+                    if (hash[h] == 0)
+                        continue;
+                    for (i = 0, k = 0; k < slen[hash[h]]; k++)
+                        i = (i ^ items[soff[hash[h]] + k]) * 0x100000001b3ULL;
+                    for (i &= 2 * hcap - 1; tab[i] != 0; i = (i + 1) & (2 * hcap - 1))
+                        ;
+                    tab[i] = hash[h];
+                }
+                free(hash);
+                hash = tab;
+                hcap *= 2;
+            }
+        }
+    }
+    rc = 0;
+    goto out;
+
+nomem:
+    fprintf(stderr,"exclude: can't allocate memory for the DFA\n");
+out:
+    free(erule);
+    free(items);
+    free(soff);
+    free(slen);
+    free(hash);
+    free(tmp);
+    free(mark);
+    return rc;
+}
+
+/* classes of every level of one length and its counts */
+static int wk_xspace_init(struct wk_exclude *ex, struct wk_xspace *xs, const wchar_t *sym,
+                          size_t nsym, const uint32_t *cls) {
+    const struct wk_space *sp = xs->sp;
+    const size_t len = sp->len, ns = ex->nstates;
+    const struct wk_epos *e;
+    const wchar_t *w;
+    uint64_t *cur, *nxt, sum;
+    size_t i, d, s;
+
+    xs->rd = calloc(len ? len : 1, sizeof(*xs->rd));
+    xs->xc = calloc(len ? len : 1, sizeof(*xs->xc));
+    xs->cnt = calloc((len + 1) * ns, sizeof(*xs->cnt));
+    if (xs->rd == NULL || xs->xc == NULL || xs->cnt == NULL)
+        goto nomem;
+
+    for (i = 0; i < len; i++) {
+        xs->rd[i] = sp->order[len - 1 - i];
+        e = &sp->pos[xs->rd[i]];
+        xs->xc[i] = malloc(e->radix * sizeof(**xs->xc));
+        if (xs->xc[i] == NULL)
+            goto nomem;
+        for (d = 0; d < e->radix; d++) {
+            w = bsearch(&e->wcs[d], sym, nsym, sizeof(*sym), wk_wchar_cmp);
+            xs->xc[i][d] = cls[w - sym];
+        }
+    }
+
+    for (s = 0; s < ns; s++)
+        xs->cnt[len*ns + s] = !ex->reject[s];
+    for (i = len; i > 0; i--) {
+        e = &sp->pos[xs->rd[i-1]];
+        cur = &xs->cnt[(i-1)*ns];
+        nxt = &xs->cnt[i*ns];
+        for (s = 0; s < ns; s++) {
+            for (d = 0, sum = 0; d < e->radix; d++)
+                sum += nxt[ex->delta[s*ex->ncls + xs->xc[i-1][d]]];
+            cur[s] = sum;
+        }
+    }
+
+    xs->base = wk_xrank(ex, xs, sp->first);
+    xs->count = wk_xrank(ex, xs, sp->first + sp->count) - xs->base;
+    return 0;
+
+nomem:
+    fprintf(stderr,"exclude: can't allocate memory for length %lu\n", (unsigned long)len);
+    return -1;
+}
+
+/* kept candidates of the space before candidate idx of the plain mask */
+static uint64_t wk_xrank(const struct wk_exclude *ex, const struct wk_xspace *xs, uint64_t idx) {
+    const struct wk_space *sp = xs->sp;
+    const size_t len = sp->len, ns = ex->nstates;
+    size_t lv[MAXSTRING], i, d, s = WK_XSTART, radix;
+    uint64_t r = 0;
+
+    for (i = len; i > 0; i--) {
+        radix = sp->pos[xs->rd[i-1]].radix;
+        lv[i-1] = (size_t)(idx % radix);
+        idx /= radix;
+    }
+    /* past the end of the space */
+    if (idx > 0)
+        return xs->cnt[WK_XSTART];
+
+    for (i = 0; i < len && s != WK_XDEAD; i++) {
+        for (d = 0; d < lv[i]; d++)
+            r += xs->cnt[(i+1)*ns + ex->delta[s*ex->ncls + xs->xc[i][d]]];
+        s = ex->delta[s*ex->ncls + xs->xc[i][lv[i]]];
+    }
+    return r;
+}
+
+/*
+ * Write kept candidates [j, j+n) of one space, j counts from the start of
+ * the space.  As in wk_space_runs the fastest level is written as a run
+ * over its choices, the choices leading to a rejecting state are skipped.
+ */
+static size_t wk_xspace_fill(const struct wk_exclude *ex, const struct wk_xspace *xs,
+                             uint64_t j, uint64_t n, char *buf, size_t *nrec) {
+    const struct wk_space *sp = xs->sp;
+    const size_t len = sp->len, ns = ex->nstates, nc = ex->ncls, last = len - 1;
+    const uint64_t *kept = &xs->cnt[len*ns];
+    const struct wk_epos *e, *e0;
+    const uint32_t *row;
+    size_t lv[MAXSTRING], digit[MAXSTRING], st[MAXSTRING+1];
+    char cur[MAXSTRING];
+    char *out = buf;
+    size_t i, d, s = WK_XSTART, p, p0;
+    uint64_t c;
+
+    if (n == 0)
+        return 0;
+    if (len == 0) {
+        *out++ = wk_eol;
+        (*nrec)++;
+        return 1;
+    }
+
+    /* the j-th kept candidate, level by level */
+    st[0] = WK_XSTART;
+    for (i = 0; i < len; i++) {
+        for (d = 0;; d++) {
+            s = ex->delta[st[i]*nc + xs->xc[i][d]];
+            c = xs->cnt[(i+1)*ns + s];
+            if (j < c)
+                break;
+            j -= c;
+        }
+        lv[i] = d;
+        st[i+1] = s;
+    }
+    p0 = xs->rd[last];
+    e0 = &sp->pos[p0];
+    i = 0;
+
+    for (;;) {
+        /* levels i and below changed */
+        for (; i < len; i++) {
+            p = xs->rd[i];
+            digit[p] = lv[i];
+            cur[p] = sp->pos[p].enc[lv[i]][0];
+        }
+        row = &ex->delta[st[last]*nc];
+        for (d = lv[last]; d < e0->radix && n > 0; d++) {
+            if (kept[row[xs->xc[last][d]]] == 0)
+                continue;
+            n--;
+            digit[p0] = d;
+            if (ex->checkdups && wk_space_dupes(sp, digit))
+                continue;
+            if (sp->single) {
+                memcpy(out, cur, len);
+                out[p0] = e0->enc[d][0];
+                out += len;
+            } else {
+                for (p = 0; p < len; p++) {
+                    e = &sp->pos[p];
+                    memcpy(out, e->enc[digit[p]], e->elen[digit[p]]);
+                    out += e->elen[digit[p]];
+                }
+            }
+            *out++ = wk_eol;
+            (*nrec)++;
+        }
+        if (n == 0)
+            break;
+
+        /* next kept choice of the deepest level above the run that has one */
+        for (i = last; i > 0; i--) {
+            e = &sp->pos[xs->rd[i-1]];
+            for (d = lv[i-1] + 1; d < e->radix; d++) {
+                s = ex->delta[st[i-1]*nc + xs->xc[i-1][d]];
+                if (xs->cnt[i*ns + s] != 0)
+                    break;
+            }
+            if (d < e->radix)
+                break;
+        }
+        i--;
+        lv[i] = d;
+        st[i+1] = s;
+        /* and the first kept choice of every level below it */
+        for (p = i + 1; p < len; p++) {
+            for (d = 0;; d++) {
+                s = ex->delta[st[p]*nc + xs->xc[p][d]];
+                if (xs->cnt[(p+1)*ns + s] != 0)
+                    break;
+            }
+            lv[p] = d;
+            st[p+1] = s;
+        }
+    }
+    return (size_t)(out - buf);
+}
+
+static size_t wk_exclude_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                              char *buf, size_t *nrec) {
+    const struct wk_exclude *ex = src->priv;
+    const struct wk_xspace *xs;
+    size_t s, len = 0;
+    uint64_t take;
+
+    *nrec = 0;
+    for (s = 0; s < ex->nspaces && n > 0; s++) {
+        xs = &ex->spaces[s];
+        if (first >= xs->count) {
+            first -= xs->count;
+            continue;
+        }
+        take = xs->count - first < n ? xs->count - first : n;
+        len += wk_xspace_fill(ex, xs, xs->base + first, take, buf + len, nrec);
+        n -= take;
+        first = 0;
+    }
+    return len;
+}
+
+/*
+ * Keep the candidates of the compiled mask that match none of the rules,
+ * given inline and in rule files.  inverted must be the order the mask
+ * was compiled in.
+ */
+int wk_exclude_source(const struct wk_mask *mask, int inverted, char **rules, size_t nrules,
+                      char **files, size_t nfiles, struct wk_source *src) {
+    struct wk_xbuild b;
+    struct wk_xelem te;
+    struct wk_exclude *ex = NULL;
+    struct wk_xspace *xs;
+    const struct wk_space *sp;
+    wchar_t *sym = NULL;
+    uint32_t *cls = NULL, *remap = NULL;
+    unsigned char *in = NULL;
+    size_t i, k, s, p, e, csym = 0, nsym = 0, ncls = 1, nn;
+    uint64_t total = 0;
+    int rc = -1;
+
+    memset(&b, 0, sizeof(b));
+    for (i = 0; i < nrules; i++) {
+        if (wk_xparse_mb(&b, rules[i]) == -1)
+            goto out;
+    }
+    for (i = 0; i < nfiles; i++) {
+        if (wk_xfile(&b, files[i]) == -1)
+            goto out;
+    }
+    if (b.nrule == 0) {
+        fprintf(stderr,"exclude: no rules given\n");
+        goto out;
+    }
+    /* -i reads candidates right to left */
+    if (inverted) {
+        for (i = 0; i < b.nrule; i++) {
+            for (k = 0; k < b.rule[i].len / 2; k++) {
+                te = b.el[b.rule[i].e0 + k];
+                b.el[b.rule[i].e0 + k] = b.el[b.rule[i].e0 + b.rule[i].len - 1 - k];
+                b.el[b.rule[i].e0 + b.rule[i].len - 1 - k] = te;
+            }
+            k = (size_t)b.rule[i].head;
+            b.rule[i].head = b.rule[i].tail;
+            b.rule[i].tail = (int)k;
+        }
+    }
+
+    /* every character the mask can produce, once */
+    for (s = 0; s < mask->nspaces; s++) {
+        sp = &mask->spaces[s];
+        for (p = 0; p < sp->len; p++) {
+            if (wk_xgrow((void **)&sym, &csym, nsym + sp->pos[p].radix, sizeof(*sym)) == -1)
+                goto out;
+            for (k = 0; k < sp->pos[p].radix; k++)
+                sym[nsym++] = sp->pos[p].wcs[k];
+        }
+    }
+    if (nsym > 0)
+        qsort(sym, nsym, sizeof(*sym), wk_wchar_cmp);
+    for (i = 0, k = 0; i < nsym; i++) {
+        if (k == 0 || sym[i] != sym[k-1])
+            sym[k++] = sym[i];
+    }
+    nsym = k;
+
+    /* split the characters by every element until each class is uniform */
+    cls = calloc(nsym + 1, sizeof(*cls));
+    remap = malloc(2 * (nsym + 1) * sizeof(*remap));
+    if (cls == NULL || remap == NULL)
+        goto nomem;
+    for (e = 0; e < b.nel; e++) {
+        for (k = 0; k < 2 * ncls; k++)
+            remap[k] = UINT32_MAX;
+        for (i = 0, nn = 0; i < nsym; i++) {
+            k = 2 * cls[i] + (size_t)wk_xin(&b, e, sym[i]);
+            if (remap[k] == UINT32_MAX)
+                remap[k] = (uint32_t)nn++;
+            cls[i] = remap[k];
+        }
+        if (nn > 0)
+            ncls = nn;
+    }
+    in = calloc(b.nel * ncls, 1);
+    if (in == NULL)
+        goto nomem;
+    for (e = 0; e < b.nel; e++) {
+        for (i = 0; i < nsym; i++)
+            in[e*ncls + cls[i]] = (unsigned char)wk_xin(&b, e, sym[i]);
+    }
+
+    ex = calloc(1, sizeof(*ex));
+    if (ex == NULL)
+        goto nomem;
+    ex->ncls = ncls;
+    ex->checkdups = mask->checkdups;
+    if (wk_xdfa(ex, &b, in) == -1)
+        goto out;
+
+    ex->nspaces = mask->nspaces;
+    ex->spaces = calloc(mask->nspaces, sizeof(*ex->spaces));
+    if (ex->spaces == NULL)
+        goto nomem;
+    for (s = 0; s < mask->nspaces; s++) {
+        xs = &ex->spaces[s];
+        xs->sp = &mask->spaces[s];
+        if (wk_xspace_init(ex, xs, sym, nsym, cls) == -1)
+            goto out;
+        total += xs->count;
+        fprintf(stderr,"exclude: length %lu keeps %llu of %llu candidates\n",
+                (unsigned long)xs->sp->len, (unsigned long long)xs->count,
+                (unsigned long long)xs->sp->count);
+    }
+    fprintf(stderr,"exclude: %lu rules, %lu DFA states over %lu character classes\n",
+            (unsigned long)b.nrule, (unsigned long)ex->nstates, (unsigned long)ncls);
+    if (total == 0) {
+        fprintf(stderr,"exclude: the rules exclude every candidate\n");
+        goto out;
+    }
+
+    src->total = total;
+    src->maxrec = mask->maxrec;
+    src->fill = wk_exclude_fill;
+    src->priv = ex;
+    rc = 0;
+    goto out;
+
+nomem:
+    fprintf(stderr,"exclude: can't allocate memory\n");
+out:
+    free(b.rng);
+    free(b.el);
+    free(b.rule);
+    free(sym);
+    free(cls);
+    free(remap);
+    free(in);
+    return rc;
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Sorted, deduplicated word lists for -q, bounded in memory.
+ *
+ * The input is cut into runs of at most WK_SORT_MEM / nthreads bytes.
+ * Every thread takes the next run, sorts its lines as byte strings, drops
+ * duplicates and writes the run to a temporary file, then the runs are
+ * merged with a heap into the sorted list.  Byte order of UTF-8 is code
+ * point order, the same order wcscmp gave the old loader.
+ *
+ * The sorted list is kept in the cache directory under a hash of the
+ * input's contents, so the next run over the same list only hashes it and
+ * maps the cached file.  The directory is $BFC_CACHE, else
+ * $XDG_CACHE_HOME/bfc, else ~/.cache/bfc.
+ */
+
+#define WK_SORT_MEM     (256UL << 20)   /* bytes of input sorted in memory at once */
+
+struct wk_sortjob {
+    FILE *in;
+    const char *prefix;                 /* run files are prefix.runN, prefix names the process */
+    size_t runbytes;
+    pthread_mutex_t lock;               /* guards in, nruns and error */
+    size_t nruns;
+    int error;
+};
+
+struct wk_run {
+    FILE *fp;
+    char *line;
+    size_t cap;
+    ssize_t len;
+};
+
+static uint64_t wk_file_hash(const char *filename);
+static int wk_line_cmp(const void *a, const void *b);
+static int wk_sort_run(struct wk_sortjob *job, char *buf, size_t len, size_t run);
+static void *wk_sort_worker(void *arg);
+static int wk_run_next(struct wk_run *r);
+static int wk_run_less(const struct wk_run *a, const struct wk_run *b);
+static void wk_heap_down(struct wk_run **heap, size_t n, size_t i);
+static int wk_merge_runs(const char *prefix, size_t nruns, const char *outpath);
+
+/* 64 bit hash of the whole file, 8 bytes at a time */
+static uint64_t wk_file_hash(const char *filename) {
+    unsigned char buf[1 << 16];
+    uint64_t h = 0x9e3779b97f4a7c15ULL, v;
+    size_t n, i;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) == -1)
+        return 0;
+    while ((n = (size_t)read(fd, buf, sizeof(buf))) > 0 && n != NPOS) {
+        for (i = 0; i < n; i += 8) {
+            v = 0;
+            memcpy(&v, buf + i, n - i < 8 ? n - i : 8);
+            h = (h ^ v) * 0xff51afd7ed558ccdULL;
+            h ^= h >> 32;
+        }
+        h ^= n;
+    }
+    (void)close(fd);
+    return h;
+}
+
+/* the directory of cached sort results and tuning profiles, created if missing */
+int wk_cache_dir(char *dir, size_t size) {
+    const char *env;
+
+    if ((env = getenv("BFC_CACHE")) != NULL && *env != '\0') {
+        snprintf(dir, size, "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env != '\0') {
+        snprintf(dir, size, "%s/bfc", env);
+        (void)mkdir(env, 0755);
+    } else if ((env = getenv("HOME")) != NULL && *env != '\0') {
+        snprintf(dir, size, "%s/.cache", env);
+        (void)mkdir(dir, 0755);
+        snprintf(dir, size, "%s/.cache/bfc", env);
+    } else {
+        snprintf(dir, size, "/tmp/bfc");
+    }
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr,"bfc: can't create the cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* lines are NUL terminated inside the run buffer */
+static int wk_line_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int wk_sort_run(struct wk_sortjob *job, char *buf, size_t len, size_t run) {
+    char path[PATH_MAX];
+    char **lines, *p, *end = buf + len, *nl;
+    size_t n = 0, cap = 1024, i, l;
+    FILE *out;
+
+    lines = malloc(cap * sizeof(*lines));
+    if (lines == NULL)
+        goto nomem;
+
+    for (p = buf; p < end; p = nl + 1) {
+        if ((nl = memchr(p, '\n', (size_t)(end - p))) == NULL)
+            nl = end;
+        *nl = '\0';
+        l = (size_t)(nl - p);
+        if (l > 0 && p[l-1] == '\r')
+            p[--l] = '\0';
+        if (l == 0)
+            continue;
+        if (n == cap) {
+            char **nlines = realloc(lines, 2 * cap * sizeof(*lines));
+            if (nlines == NULL)
+                goto nomem;
+            lines = nlines;
+            cap *= 2;
+        }
+        lines[n++] = p;
+    }
+
+    qsort(lines, n, sizeof(*lines), wk_line_cmp);
+
+    snprintf(path, sizeof(path), "%s.run%lu", job->prefix, (unsigned long)run);
+    if ((out = fopen(path, "w")) == NULL) {
+        fprintf(stderr,"sort: can't create %s: %s\n", path, strerror(errno));
+        free(lines);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (i > 0 && strcmp(lines[i], lines[i-1]) == 0)
+            continue;
+        fputs(lines[i], out);
+        fputc('\n', out);
+    }
+    free(lines);
+    if (fclose(out) != 0) {
+        fprintf(stderr,"sort: can't write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+
+nomem:
+    fprintf(stderr,"sort: can't allocate memory for a run\n");
+    free(lines);
+    return -1;
+}
+
+/* read the next run under the lock, sort and write it outside of it */
+static void *wk_sort_worker(void *arg) {
+    struct wk_sortjob *job = arg;
+    char *buf;
+    size_t len, run;
+    int c, error;
+
+    /* room to finish a line cut by the run and to terminate it */
+    buf = malloc(job->runbytes + MAXSTRING * WK_MBMAX + 2);
+    if (buf == NULL) {
+        fprintf(stderr,"sort: can't allocate memory for a run\n");
+        pthread_mutex_lock(&job->lock);
+        job->error = 1;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        if (job->error) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        len = fread(buf, 1, job->runbytes, job->in);
+        /* finish the last line of the run */
+        while (len > 0 && buf[len-1] != '\n' && (c = getc(job->in)) != EOF) {
+            if (len == job->runbytes + MAXSTRING * WK_MBMAX + 1) {
+                fprintf(stderr,"sort: line longer than %d bytes\n", MAXSTRING * WK_MBMAX);
+                job->error = 1;
+                break;
+            }
+            buf[len++] = (char)c;
+        }
+        run = job->nruns;
+        if (len > 0)
+            job->nruns++;
+        error = job->error;
+        pthread_mutex_unlock(&job->lock);
+
+        if (len == 0 || error)
+            break;
+        if (wk_sort_run(job, buf, len, run) == -1) {
+            pthread_mutex_lock(&job->lock);
+            job->error = 1;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int wk_run_next(struct wk_run *r) {
+    r->len = getline(&r->line, &r->cap, r->fp);
+    if (r->len > 0 && r->line[r->len-1] == '\n')
+        r->line[--r->len] = '\0';
+    return r->len >= 0;
+}
+
+static int wk_run_less(const struct wk_run *a, const struct wk_run *b) {
+    return strcmp(a->line, b->line) < 0;
+}
+
+static void wk_heap_down(struct wk_run **heap, size_t n, size_t i) {
+    struct wk_run *t;
+    size_t c;
+
+    for (;;) {
+        c = 2*i + 1;
+        if (c >= n)
+            break;
+        if (c + 1 < n && wk_run_less(heap[c+1], heap[c]))
+            c++;
+        if (!wk_run_less(heap[c], heap[i]))
+            break;
+        t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+        i = c;
+    }
+}
+
+/* k-way merge of the sorted runs into outpath, dropping duplicates */
+static int wk_merge_runs(const char *prefix, size_t nruns, const char *outpath) {
+    char path[PATH_MAX];
+    struct wk_run *runs, **heap;
+    char *last = NULL;
+    size_t n = 0, i, lastcap = 0;
+    FILE *out;
+    int rc = -1;
+
+    runs = calloc(nruns, sizeof(*runs));
+    heap = calloc(nruns, sizeof(*heap));
+    if (runs == NULL || heap == NULL) {
+        fprintf(stderr,"sort: can't allocate memory for the merge\n");
+        goto done;
+    }
+    if ((out = fopen(outpath, "w")) == NULL) {
+        fprintf(stderr,"sort: can't create %s: %s\n", outpath, strerror(errno));
+        goto done;
+    }
+
+    for (i = 0; i < nruns; i++) {
+        snprintf(path, sizeof(path), "%s.run%lu", prefix, (unsigned long)i);
+        if ((runs[i].fp = fopen(path, "r")) == NULL) {
+            fprintf(stderr,"sort: can't open %s: %s\n", path, strerror(errno));
+            goto close;
+        }
+        if (wk_run_next(&runs[i]))
+            heap[n++] = &runs[i];
+    }
+    for (i = n / 2; i > 0; i--)
+        wk_heap_down(heap, n, i - 1);
+
+    while (n > 0) {
+        if (last == NULL || strcmp(last, heap[0]->line) != 0) {
+            fputs(heap[0]->line, out);
+            fputc('\n', out);
+            if ((size_t)heap[0]->len + 1 > lastcap) {
+                lastcap = (size_t)heap[0]->len + 1;
+                free(last);
+                if ((last = malloc(lastcap)) == NULL) {
+                    fprintf(stderr,"sort: can't allocate memory for the merge\n");
+                    goto close;
+                }
+            }
+            memcpy(last, heap[0]->line, (size_t)heap[0]->len + 1);
+        }
+        if (!wk_run_next(heap[0]))
+            heap[0] = heap[--n];
+        wk_heap_down(heap, n, 0);
+    }
+    rc = 0;
+
+close:
+    if (fclose(out) != 0 && rc == 0) {
+        fprintf(stderr,"sort: can't write %s: %s\n", outpath, strerror(errno));
+        rc = -1;
+    }
+    for (i = 0; i < nruns; i++) {
+        if (runs[i].fp != NULL)
+            (void)fclose(runs[i].fp);
+        free(runs[i].line);
+    }
+done:
+    free(last);
+    free(runs);
+    free(heap);
+    return rc;
+}
+
+/* the words of filename sorted and without duplicates, from the cache if possible */
+int wk_words_sorted(const char *filename, int nthreads, struct wk_words *w) {
+    char dir[PATH_MAX], prefix[PATH_MAX], cached[PATH_MAX], tmp[PATH_MAX + 16], run[PATH_MAX + 48];
+    char runs[PATH_MAX + 16];
+    struct wk_sortjob job;
+    pthread_t tid[WK_MAXTHREADS];
+    struct stat st;
+    uint64_t h;
+    size_t i;
+    int t, started;
+
+    if (stat(filename, &st) == -1) {
+        fprintf(stderr,"sort: can't open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (wk_cache_dir(dir, sizeof(dir)) == -1)
+        return -1;
+
+    h = wk_file_hash(filename);
+    if ((size_t)snprintf(prefix, sizeof(prefix), "%s/%016llx", dir, (unsigned long long)h) >= sizeof(prefix)
+        || (size_t)snprintf(cached, sizeof(cached), "%s.sorted", prefix) >= sizeof(cached)) {
+        fprintf(stderr,"sort: cache directory name too long: %s\n", dir);
+        return -1;
+    }
+    if (access(cached, R_OK) == 0)
+        return wk_words_mmap(cached, w);
+    /* sorts of the same list by other processes keep their own runs */
+    snprintf(runs, sizeof(runs), "%s.%ld", prefix, (long)getpid());
+
+    memset(&job, 0, sizeof(job));
+    if ((job.in = fopen(filename, "r")) == NULL) {
+        fprintf(stderr,"sort: can't open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > WK_MAXTHREADS)
+        nthreads = WK_MAXTHREADS;
+    job.prefix = runs;
+    job.runbytes = WK_SORT_MEM / (size_t)nthreads;
+    if ((unsigned long long)st.st_size < job.runbytes)
+        job.runbytes = (size_t)st.st_size + 1;
+    pthread_mutex_init(&job.lock, NULL);
+
+    for (t = 0, started = 0; t < nthreads; t++) {
+        if (pthread_create(&tid[t], NULL, wk_sort_worker, &job) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+        wk_sort_worker(&job);
+    for (t = 0; t < started; t++)
+        pthread_join(tid[t], NULL);
+    pthread_mutex_destroy(&job.lock);
+    (void)fclose(job.in);
+
+    /* merge into a temporary name so an interrupted sort is never taken from the cache */
+    snprintf(tmp, sizeof(tmp), "%s.tmp%ld", prefix, (long)getpid());
+    if (!job.error) {
+        if (job.nruns == 1) {
+            snprintf(run, sizeof(run), "%s.run0", runs);
+            if (rename(run, tmp) == -1)
+                job.error = 1;
+        } else if (wk_merge_runs(runs, job.nruns, tmp) == -1) {
+            job.error = 1;
+        }
+    }
+    for (i = 0; i < job.nruns; i++) {
+        snprintf(run, sizeof(run), "%s.run%lu", runs, (unsigned long)i);
+        (void)remove(run);
+    }
+    if (job.error || rename(tmp, cached) == -1) {
+        fprintf(stderr,"sort: can't sort %s\n", filename);
+        (void)remove(tmp);
+        return -1;
+    }
+    return wk_words_mmap(cached, w);
+}
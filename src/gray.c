@@ -0,0 +1,261 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Gray code order (--gray).  Every length of the mask is walked in the
+ * reflected mixed-radix Gray code over the radices of its positions, so
+ * each candidate differs from the one before it in exactly one position.
+ * Index i has the plain digits a of i, taken from the slowest changing
+ * position to the fastest.  The Gray digit of a position is a, or
+ * radix-1-a when the number formed by the slower digits is odd, and that
+ * digit moves down instead of up as i grows.  Stepping moves the fastest
+ * position that can still go its way and turns the ones faster than it
+ * around, which is constant work on average.
+ *
+ * With --delta a record that differs from the previous one in a single
+ * position is written as the position, two lowercase hex digits counted
+ * from 0, followed by the new character.  Any other record is written as
+ * = followed by the whole candidate: the first record of every chunk,
+ * the first of a new length, and one after candidates dropped by -d.
+ * Chunks can be decoded on their own, so -j, -x and -r work as usual.
+ */
+
+struct wk_gray {
+    const struct wk_mask *mask;
+    int delta;
+};
+
+static void wk_gray_unrank(const struct wk_space *sp, uint64_t idx, size_t *g, int *dir);
+static size_t wk_gray_runs(const struct wk_gray *gr, const struct wk_space *sp, uint64_t idx,
+                           uint64_t n, char *buf, size_t *nrec);
+static size_t wk_gray_space(const struct wk_gray *gr, const struct wk_space *sp, uint64_t idx,
+                            uint64_t n, char *buf, size_t *nrec);
+static size_t wk_gray_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                           char *buf, size_t *nrec);
+
+/* Gray digits of candidate idx and the way each of them moves next */
+static void wk_gray_unrank(const struct wk_space *sp, uint64_t idx, size_t *g, int *dir) {
+    size_t k, p, a[MAXSTRING], radix;
+    unsigned odd = 0;
+
+    for (k = 0; k < sp->len; k++) {
+        p = sp->order[k];
+        a[p] = (size_t)(idx % sp->pos[p].radix);
+        idx /= sp->pos[p].radix;
+    }
+    for (k = sp->len; k > 0; k--) {
+        p = sp->order[k-1];
+        radix = sp->pos[p].radix;
+        g[p] = odd ? radix - 1 - a[p] : a[p];
+        dir[p] = odd ? -1 : 1;
+        odd = (odd * (unsigned)(radix & 1) + (unsigned)(a[p] & 1)) & 1;
+    }
+}
+
+/*
+ * Single byte lengths without -d.  The fastest position sweeps its whole
+ * radix between two moves of the others, so it is written as a run that
+ * only patches one byte of the line, or writes one delta, per candidate.
+ */
+static size_t wk_gray_runs(const struct wk_gray *gr, const struct wk_space *sp, uint64_t idx,
+                           uint64_t n, char *buf, size_t *nrec) {
+    static const char hex[] = "0123456789abcdef";
+    const size_t len = sp->len, p0 = sp->order[0];
+    const struct wk_epos *e0 = &sp->pos[p0];
+    size_t g[MAXSTRING], k, p;
+    int dir[MAXSTRING];
+    char line[MAXSTRING+2], *out = buf;
+    long d, ng;
+
+    wk_gray_unrank(sp, idx, g, dir);
+    line[0] = '=';
+    for (p = 0; p < len; p++)
+        line[p+1] = sp->pos[p].enc[g[p]][0];
+    line[len+1] = wk_eol;
+
+    /* the first record is whole, the run goes on from the next one */
+    if (gr->delta) {
+        memcpy(out, line, len + 2);
+        out += len + 2;
+    } else {
+        memcpy(out, line + 1, len + 1);
+        out += len + 1;
+    }
+    (*nrec)++;
+    n--;
+
+    while (n > 0) {
+        /* the rest of the run of p0 */
+        for (d = (long)g[p0] + dir[p0]; d >= 0 && (size_t)d < e0->radix && n > 0; d += dir[p0], n--) {
+            if (gr->delta) {
+                out[0] = hex[p0 >> 4];
+                out[1] = hex[p0 & 15];
+                out[2] = e0->enc[d][0];
+                out[3] = wk_eol;
+                out += 4;
+            } else {
+                memcpy(out, line + 1, len + 1);
+                out[p0] = e0->enc[d][0];
+                out += len + 1;
+            }
+            (*nrec)++;
+        }
+        g[p0] = (size_t)(d - dir[p0]);
+        line[p0+1] = e0->enc[g[p0]][0];
+        if (n == 0)
+            break;
+
+        /* p0 turns around, the next slowest position that can moves */
+        dir[p0] = -dir[p0];
+        for (k = 1; k < len; k++) {
+            p = sp->order[k];
+            ng = (long)g[p] + dir[p];
+            if (ng >= 0 && (size_t)ng < sp->pos[p].radix)
+                break;
+            dir[p] = -dir[p];
+        }
+        g[p] = (size_t)ng;
+        line[p+1] = sp->pos[p].enc[g[p]][0];
+        if (gr->delta) {
+            out[0] = hex[p >> 4];
+            out[1] = hex[p & 15];
+            out[2] = line[p+1];
+            out[3] = wk_eol;
+            out += 4;
+        } else {
+            memcpy(out, line + 1, len + 1);
+            out += len + 1;
+        }
+        (*nrec)++;
+        n--;
+    }
+    return (size_t)(out - buf);
+}
+
+/* write candidates [idx, idx+n) of one space */
+static size_t wk_gray_space(const struct wk_gray *gr, const struct wk_space *sp, uint64_t idx,
+                            uint64_t n, char *buf, size_t *nrec) {
+    static const char hex[] = "0123456789abcdef";
+    size_t g[MAXSTRING];
+    int dir[MAXSTRING];
+    char cur[MAXSTRING];
+    const struct wk_epos *e;
+    char *out = buf;
+    size_t k, p, moved = 0;
+    int whole = 1;                      /* the next record is written as a whole */
+    long ng;
+
+    if (sp->single && !gr->mask->checkdups && sp->len > 0)
+        return wk_gray_runs(gr, sp, idx, n, buf, nrec);
+
+    wk_gray_unrank(sp, idx, g, dir);
+    for (p = 0; p < sp->len; p++)
+        cur[p] = sp->pos[p].enc[g[p]][0];
+
+    for (;;) {
+        if (gr->mask->checkdups && wk_space_dupes(sp, g)) {
+            /* the next record differs from the last one written in more than one place */
+            whole = 1;
+        } else if (gr->delta && !whole) {
+            e = &sp->pos[moved];
+            *out++ = hex[moved >> 4];
+            *out++ = hex[moved & 15];
+            memcpy(out, e->enc[g[moved]], e->elen[g[moved]]);
+            out += e->elen[g[moved]];
+            *out++ = wk_eol;
+            (*nrec)++;
+        } else {
+            if (gr->delta)
+                *out++ = '=';
+            if (sp->single) {
+                memcpy(out, cur, sp->len);
+                out += sp->len;
+            } else {
+                for (p = 0; p < sp->len; p++) {
+                    e = &sp->pos[p];
+                    memcpy(out, e->enc[g[p]], e->elen[g[p]]);
+                    out += e->elen[g[p]];
+                }
+            }
+            *out++ = wk_eol;
+            (*nrec)++;
+            whole = 0;
+        }
+        if (--n == 0)
+            break;
+
+        for (k = 0; k < sp->len; k++) {
+            p = sp->order[k];
+            ng = (long)g[p] + dir[p];
+            if (ng >= 0 && (size_t)ng < sp->pos[p].radix)
+                break;
+            dir[p] = -dir[p];
+        }
+        g[p] = (size_t)ng;
+        cur[p] = sp->pos[p].enc[g[p]][0];
+        moved = p;
+    }
+    return (size_t)(out - buf);
+}
+
+static size_t wk_gray_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                           char *buf, size_t *nrec) {
+    const struct wk_gray *gr = src->priv;
+    const struct wk_space *sp;
+    size_t s, len = 0;
+    uint64_t take;
+
+    *nrec = 0;
+    for (s = 0; s < gr->mask->nspaces && n > 0; s++) {
+        sp = &gr->mask->spaces[s];
+        if (first >= sp->count) {
+            first -= sp->count;
+            continue;
+        }
+        take = sp->count - first < n ? sp->count - first : n;
+        len += wk_gray_space(gr, sp, first, take, buf + len, nrec);
+        n -= take;
+        first = 0;
+    }
+    return len;
+}
+
+/*
+ * Walk the compiled mask in Gray code order, delta records if delta is
+ * set.  The mask must run over whole lengths, without -s or -e.
+ */
+int wk_gray_source(const struct wk_mask *mask, int delta, struct wk_source *src) {
+    struct wk_gray *gr;
+    size_t s;
+
+    gr = calloc(1, sizeof(*gr));
+    if (gr == NULL) {
+        fprintf(stderr,"gray: can't allocate memory\n");
+        return -1;
+    }
+    gr->mask = mask;
+    gr->delta = delta;
+
+    src->total = 0;
+    for (s = 0; s < mask->nspaces; s++)
+        src->total += mask->spaces[s].count;
+    /* the = of a whole record */
+    src->maxrec = mask->maxrec + (delta ? 1 : 0);
+    src->fill = wk_gray_fill;
+    src->priv = gr;
+    return 0;
+}
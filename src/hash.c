@@ -0,0 +1,505 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Hash stage (-H algo:file).  Every candidate is hashed in the worker that
+ * generated it and only candidates whose digest is in the target file are
+ * written, as "hexdigest:candidate".
+ *
+ * Candidates that fit in one block are hashed WK_HLANES at a time: lane l
+ * of every vector belongs to candidate l, so one pass of the compression
+ * function hashes a whole batch.  Longer candidates run alone in lane 0.
+ */
+
+#define WK_HLANES       8                           /* candidates per vector */
+#define WK_HMSGMAX      (2 * MAXSTRING * WK_MBMAX)  /* NTLM doubles the length */
+#define WK_HMAXDIGEST   20
+#define WK_HBUCKETS     65536                       /* index on the first two digest bytes */
+
+typedef uint32_t wk_hv __attribute__((vector_size(WK_HLANES * sizeof(uint32_t))));
+
+#define WK_ROTL(x, n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+struct wk_hashalgo {
+    const char *name;
+    size_t nstate;                      /* digest is nstate 32 bit words */
+    int bigendian;                      /* SHA-1 words and bit length are big endian */
+    int utf16;                          /* NTLM hashes the UTF-16LE form of the candidate */
+    const uint32_t *iv;
+    void (*compress)(wk_hv *st, const wk_hv *w);
+};
+
+struct wk_hashset {
+    const struct wk_hashalgo *algo;
+    size_t dlen;
+    unsigned char *digests;             /* n sorted digests of dlen bytes */
+    size_t n;
+    uint32_t *bucket;                   /* WK_HBUCKETS+1 offsets into digests */
+};
+
+static void wk_md5_compress(wk_hv *st, const wk_hv *w);
+static void wk_md4_compress(wk_hv *st, const wk_hv *w);
+static void wk_sha1_compress(wk_hv *st, const wk_hv *w);
+static uint32_t wk_load32(int bigendian, const unsigned char *p);
+static size_t wk_hash_pad(const struct wk_hashalgo *a, const unsigned char *m, size_t len,
+                          unsigned char *blk);
+static void wk_hash_digest(const struct wk_hashalgo *a, const wk_hv *st, int lane,
+                           unsigned char *out);
+static size_t wk_hash_prepare(const struct wk_hashalgo *a, const char *rec, size_t len,
+                              unsigned char *out);
+static void wk_hash_one(const struct wk_hashalgo *a, const unsigned char *m, size_t len,
+                        unsigned char *out);
+static void wk_hash_lanes(const struct wk_hashalgo *a, unsigned char (*m)[WK_HMSGMAX],
+                          const size_t *len, int nl, unsigned char (*out)[WK_HMAXDIGEST]);
+static int wk_hash_lookup(const struct wk_hashset *hs, const unsigned char *d);
+static char *wk_hash_hit(const struct wk_hashset *hs, const unsigned char *d,
+                         const char *rec, size_t len, char *out);
+static size_t wk_hash_run(const struct wk_filter *f, const char *in, size_t len,
+                          char *out, size_t *nrec);
+static int wk_digest_cmp(const void *a, const void *b);
+static int wk_hash_load(const char *filename, struct wk_hashset *hs);
+
+static const uint32_t wk_md5_iv[] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+static const uint32_t wk_sha1_iv[] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+static const struct wk_hashalgo wk_hashalgos[] = {
+    { "md5",  4, 0, 0, wk_md5_iv,  wk_md5_compress },
+    { "sha1", 5, 1, 0, wk_sha1_iv, wk_sha1_compress },
+    { "ntlm", 4, 0, 1, wk_md5_iv,  wk_md4_compress },
+};
+
+static const uint32_t wk_md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const int wk_md5_s[4][4] = { {7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21} };
+
+static void wk_md5_compress(wk_hv *st, const wk_hv *w) {
+    wk_hv a = st[0], b = st[1], c = st[2], d = st[3], f, t;
+    int i, g;
+
+    for (i = 0; i < 64; i++) {
+        switch (i / 16) {
+        case 0:  f = (b & c) | (~b & d); g = i; break;
+        case 1:  f = (d & b) | (~d & c); g = (5*i + 1) % 16; break;
+        case 2:  f = b ^ c ^ d;          g = (3*i + 5) % 16; break;
+        default: f = c ^ (b | ~d);       g = (7*i) % 16; break;
+        }
+        t = a + f + wk_md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b = b + WK_ROTL(t, wk_md5_s[i/16][i%4]);
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+}
+
+static const int wk_md4_x[3][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15},
+    {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15},
+};
+
+static const int wk_md4_s[3][4] = { {3, 7, 11, 19}, {3, 5, 9, 13}, {3, 9, 11, 15} };
+
+static void wk_md4_compress(wk_hv *st, const wk_hv *w) {
+    wk_hv a = st[0], b = st[1], c = st[2], d = st[3], f, t;
+    int i;
+
+    for (i = 0; i < 48; i++) {
+        switch (i / 16) {
+        case 0:  f = (b & c) | (~b & d); break;
+        case 1:  f = ((b & c) | (b & d) | (c & d)) + 0x5a827999; break;
+        default: f = (b ^ c ^ d) + 0x6ed9eba1; break;
+        }
+        t = a + f + w[wk_md4_x[i/16][i%16]];
+        a = d;
+        d = c;
+        c = b;
+        b = WK_ROTL(t, wk_md4_s[i/16][i%4]);
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+}
+
+static void wk_sha1_compress(wk_hv *st, const wk_hv *w) {
+    wk_hv a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f, t;
+    wk_hv x[16];
+    int i;
+
+    memcpy(x, w, sizeof(x));
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            t = x[(i-3) & 15] ^ x[(i-8) & 15] ^ x[(i-14) & 15] ^ x[i & 15];
+            x[i & 15] = WK_ROTL(t, 1);
+        }
+        if (i < 20)      f = ((b & c) | (~b & d)) + 0x5a827999;
+        else if (i < 40) f = (b ^ c ^ d) + 0x6ed9eba1;
+        else if (i < 60) f = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+        else             f = (b ^ c ^ d) + 0xca62c1d6;
+        t = WK_ROTL(a, 5) + f + e + x[i & 15];
+        e = d;
+        d = c;
+        c = WK_ROTL(b, 30);
+        b = a;
+        a = t;
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+    st[4] += e;
+}
+
+static uint32_t wk_load32(int bigendian, const unsigned char *p) {
+    if (bigendian)
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+/* Merkle-Damgard padding of m into blk, returns the number of 64 byte blocks */
+static size_t wk_hash_pad(const struct wk_hashalgo *a, const unsigned char *m, size_t len,
+                          unsigned char *blk) {
+    size_t nblk = (len + 8) / 64 + 1;
+    uint64_t bits = (uint64_t)len * 8;
+    int i;
+
+    memset(blk, 0, nblk * 64);
+    memcpy(blk, m, len);
+    blk[len] = 0x80;
+    for (i = 0; i < 8; i++)
+        blk[nblk*64 - 8 + i] = (unsigned char)(bits >> (a->bigendian ? 56 - 8*i : 8*i));
+    return nblk;
+}
+
+static void wk_hash_digest(const struct wk_hashalgo *a, const wk_hv *st, int lane,
+                           unsigned char *out) {
+    uint32_t v;
+    size_t i;
+    int k;
+
+    for (i = 0; i < a->nstate; i++) {
+        v = st[i][lane];
+        for (k = 0; k < 4; k++)
+            out[4*i + k] = (unsigned char)(v >> (a->bigendian ? 24 - 8*k : 8*k));
+    }
+}
+
+/* the bytes that are hashed for one candidate */
+static size_t wk_hash_prepare(const struct wk_hashalgo *a, const char *rec, size_t len,
+                              unsigned char *out) {
+    mbstate_t state;
+    wchar_t wc;
+    size_t i, n, k = 0;
+    uint32_t u;
+
+    if (!a->utf16) {
+        memcpy(out, rec, len);
+        return len;
+    }
+
+    memset(&state, 0, sizeof(state));
+    for (i = 0; i < len; i += n) {
+        n = mbrtowc(&wc, rec + i, len - i, &state);
+        if (n == NPOS || n == (size_t)-2 || n == 0) {
+            /* not valid in the locale, take the byte as its code point */
+            wc = (unsigned char)rec[i];
+            n = 1;
+            memset(&state, 0, sizeof(state));
+        }
+        u = (uint32_t)wc;
+        if (u >= 0x10000) {
+            u -= 0x10000;
+            out[k++] = (unsigned char)((0xd800 | (u >> 10)) & 0xff);
+            out[k++] = (unsigned char)((0xd800 | (u >> 10)) >> 8);
+            u = 0xdc00 | (u & 0x3ff);
+        }
+        out[k++] = (unsigned char)(u & 0xff);
+        out[k++] = (unsigned char)(u >> 8);
+    }
+    return k;
+}
+
+/* any length, lane 0 only */
+static void wk_hash_one(const struct wk_hashalgo *a, const unsigned char *m, size_t len,
+                        unsigned char *out) {
+    unsigned char blk[WK_HMSGMAX + 128];
+    wk_hv st[5], w[16];
+    size_t b, nblk, i;
+
+    nblk = wk_hash_pad(a, m, len, blk);
+    for (i = 0; i < a->nstate; i++)
+        st[i] = (wk_hv){0} + a->iv[i];
+    for (b = 0; b < nblk; b++) {
+        for (i = 0; i < 16; i++) {
+            w[i] = (wk_hv){0};
+            w[i][0] = wk_load32(a->bigendian, blk + b*64 + 4*i);
+        }
+        a->compress(st, w);
+    }
+    wk_hash_digest(a, st, 0, out);
+}
+
+/* nl candidates of at most 55 bytes, one per lane */
+static void wk_hash_lanes(const struct wk_hashalgo *a, unsigned char (*m)[WK_HMSGMAX],
+                          const size_t *len, int nl, unsigned char (*out)[WK_HMAXDIGEST]) {
+    uint32_t x[16][WK_HLANES];
+    unsigned char blk[64];
+    wk_hv st[5], w[16];
+    size_t i;
+    int l;
+
+    memset(x, 0, sizeof(x));
+    for (l = 0; l < nl; l++) {
+        (void)wk_hash_pad(a, m[l], len[l], blk);
+        for (i = 0; i < 16; i++)
+            x[i][l] = wk_load32(a->bigendian, blk + 4*i);
+    }
+    for (i = 0; i < 16; i++)
+        memcpy(&w[i], x[i], sizeof(wk_hv));
+    for (i = 0; i < a->nstate; i++)
+        st[i] = (wk_hv){0} + a->iv[i];
+
+    a->compress(st, w);
+
+    for (l = 0; l < nl; l++)
+        wk_hash_digest(a, st, l, out[l]);
+}
+
+static int wk_hash_lookup(const struct wk_hashset *hs, const unsigned char *d) {
+    size_t lo, hi, mid;
+    unsigned b = (unsigned)d[0] << 8 | d[1];
+    int c;
+
+    lo = hs->bucket[b];
+    hi = hs->bucket[b+1];
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        c = memcmp(hs->digests + mid * hs->dlen, d, hs->dlen);
+        if (c == 0)
+            return 1;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+static char *wk_hash_hit(const struct wk_hashset *hs, const unsigned char *d,
+                         const char *rec, size_t len, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < hs->dlen; i++) {
+        *out++ = hex[d[i] >> 4];
+        *out++ = hex[d[i] & 15];
+    }
+    *out++ = ':';
+    memcpy(out, rec, len);
+    out[len] = wk_eol;
+    return out + len + 1;
+}
+
+static size_t wk_hash_run(const struct wk_filter *f, const char *in, size_t len,
+                          char *out, size_t *nrec) {
+    const struct wk_hashset *hs = f->priv;
+    const struct wk_hashalgo *a = hs->algo;
+    unsigned char m[WK_HLANES][WK_HMSGMAX];
+    unsigned char d[WK_HLANES][WK_HMAXDIGEST];
+    const char *rec[WK_HLANES];
+    size_t rlen[WK_HLANES], mlen[WK_HLANES];
+    const char *p = in, *end = in + len, *nl;
+    char *o = out;
+    size_t hits = 0;
+    int k = 0, l;
+
+    while (p < end || k > 0) {
+        if (p < end) {
+            nl = memchr(p, wk_eol, (size_t)(end - p));
+            rec[k] = p;
+            rlen[k] = (size_t)(nl - p);
+            mlen[k] = wk_hash_prepare(a, p, rlen[k], m[k]);
+            p = nl + 1;
+
+            if (mlen[k] > 55) {
+                wk_hash_one(a, m[k], mlen[k], d[k]);
+                if (wk_hash_lookup(hs, d[k])) {
+                    o = wk_hash_hit(hs, d[k], rec[k], rlen[k], o);
+                    hits++;
+                }
+            } else {
+                k++;
+            }
+            if (k < WK_HLANES && p < end)
+                continue;
+        }
+
+        if (k > 0) {
+            wk_hash_lanes(a, m, mlen, k, d);
+            for (l = 0; l < k; l++) {
+                if (wk_hash_lookup(hs, d[l])) {
+                    o = wk_hash_hit(hs, d[l], rec[l], rlen[l], o);
+                    hits++;
+                }
+            }
+            k = 0;
+        }
+    }
+
+    *nrec = hits;
+    return (size_t)(o - out);
+}
+
+static int wk_digest_cmp(const void *a, const void *b) {
+    return memcmp(a, b, WK_HMAXDIGEST);
+}
+
+/* one hex digest per line, anything after it (such as ":salt") is ignored */
+static int wk_hash_load(const char *filename, struct wk_hashset *hs) {
+    char line[1024];
+    unsigned char *d;
+    unsigned long skipped = 0;
+    size_t cap = 1024, i, k;
+    unsigned v;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr,"hash: can't open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    /* digests are padded to WK_HMAXDIGEST while sorting so one compare fits all */
+    d = calloc(cap, WK_HMAXDIGEST);
+    if (d == NULL)
+        goto nomem;
+
+    while (fgets(line, (int)sizeof(line), fp) != NULL) {
+        if (hs->n == cap) {
+            unsigned char *nd = realloc(d, 2 * cap * WK_HMAXDIGEST);
+            if (nd == NULL)
+                goto nomem;
+            memset(nd + cap * WK_HMAXDIGEST, 0, cap * WK_HMAXDIGEST);
+            d = nd;
+            cap *= 2;
+        }
+        for (i = 0; i < hs->dlen; i++) {
+            if (sscanf(line + 2*i, "%2x", &v) != 1 || !isxdigit((unsigned char)line[2*i])
+                || !isxdigit((unsigned char)line[2*i+1]))
+                break;
+            d[hs->n * WK_HMAXDIGEST + i] = (unsigned char)v;
+        }
+        if (i < hs->dlen || isxdigit((unsigned char)line[2*i])) {
+            if (line[strspn(line, " \t\r\n")] != '\0')
+                skipped++;
+            memset(d + hs->n * WK_HMAXDIGEST, 0, WK_HMAXDIGEST);
+            continue;
+        }
+        hs->n++;
+    }
+    (void)fclose(fp);
+
+    if (skipped)
+        fprintf(stderr,"hash: skipped %lu lines of %s that are not %s hashes\n",
+                skipped, filename, hs->algo->name);
+    if (hs->n == 0) {
+        fprintf(stderr,"hash: %s has no %s hashes\n", filename, hs->algo->name);
+        free(d);
+        return -1;
+    }
+
+    qsort(d, hs->n, WK_HMAXDIGEST, wk_digest_cmp);
+
+    /* pack to dlen bytes without duplicates and index by the first two bytes */
+    hs->digests = malloc(hs->n * hs->dlen);
+    hs->bucket = calloc(WK_HBUCKETS + 1, sizeof(uint32_t));
+    if (hs->digests == NULL || hs->bucket == NULL) {
+        free(d);
+        fprintf(stderr,"hash: can't allocate memory for %lu hashes\n", (unsigned long)hs->n);
+        return -1;
+    }
+    for (i = k = 0; i < hs->n; i++) {
+        if (k > 0 && memcmp(hs->digests + (k-1) * hs->dlen, d + i * WK_HMAXDIGEST, hs->dlen) == 0)
+            continue;
+        memcpy(hs->digests + k * hs->dlen, d + i * WK_HMAXDIGEST, hs->dlen);
+        hs->bucket[((unsigned)d[i * WK_HMAXDIGEST] << 8 | d[i * WK_HMAXDIGEST + 1]) + 1]++;
+        k++;
+    }
+    hs->n = k;
+    for (i = 0; i < WK_HBUCKETS; i++)
+        hs->bucket[i+1] += hs->bucket[i];
+    free(d);
+    return 0;
+
+nomem:
+    fprintf(stderr,"hash: can't allocate memory for the hashes of %s\n", filename);
+    free(d);
+    (void)fclose(fp);
+    return -1;
+}
+
+/* spec is algo:file with algo md5, sha1 or ntlm */
+int wk_hash_filter(const char *spec, struct wk_filter *filter) {
+    const char *colon = strchr(spec, ':');
+    struct wk_hashset *hs;
+    size_t i;
+
+    if (colon == NULL) {
+        fprintf(stderr,"-H must be given as algo:file\n");
+        return -1;
+    }
+
+    hs = calloc(1, sizeof(*hs));
+    if (hs == NULL) {
+        fprintf(stderr,"hash: can't allocate memory\n");
+        return -1;
+    }
+    for (i = 0; i < sizeof(wk_hashalgos) / sizeof(wk_hashalgos[0]); i++) {
+        if (strlen(wk_hashalgos[i].name) == (size_t)(colon - spec)
+            && strncmp(spec, wk_hashalgos[i].name, (size_t)(colon - spec)) == 0)
+            hs->algo = &wk_hashalgos[i];
+    }
+    if (hs->algo == NULL) {
+        fprintf(stderr,"Only md5, sha1 and ntlm hashes are supported\n");
+        free(hs);
+        return -1;
+    }
+    hs->dlen = hs->algo->nstate * 4;
+
+    if (wk_hash_load(colon + 1, hs) == -1) {
+        free(hs);
+        return -1;
+    }
+
+    filter->mult = 1;
+    filter->extra = 2 * hs->dlen + 1;
+    filter->run = wk_hash_run;
+    filter->priv = hs;
+    return 0;
+}
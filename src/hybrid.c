@@ -0,0 +1,223 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Hybrid mode: every word combined with every mask expansion.
+ *
+ * The mask keyspace is cut into batches of hyb->batch expansions.  For
+ * every batch and side (word+mask, then mask+word) every word is combined
+ * with the whole batch, so the expansions are generated once per batch
+ * and then only copied.  Candidate indexes follow that order:
+ *
+ *   batch, side, word, expansion within the batch
+ *
+ * When the mask fits in one batch this is simply word-major order.
+ */
+
+#define WK_HYB_BATCHBYTES   (64 * 1024)     /* expansions kept per batch, sized for L2 */
+
+/* expansions of the mask range [first, first+n), records point into buf */
+struct wk_hyb_exp {
+    char *buf;
+    uint32_t *off;                  /* nrec+1 offsets, each record ends with the delimiter */
+    size_t nrec;
+    uint64_t first, n;
+};
+
+/* batch buffers of one worker, kept from chunk to chunk */
+struct wk_hyb_scratch {
+    struct wk_hyb_exp full, part;
+    struct wk_hyb_scratch *next;
+};
+
+struct wk_hybrid {
+    const struct wk_words *words;
+    struct wk_source *msrc;         /* mask expansions */
+    int sides;
+    int order;
+    uint64_t batch;
+    pthread_mutex_t lock;
+    struct wk_hyb_scratch *spare;   /* scratch no worker is using */
+};
+
+static void wk_hyb_expand(const struct wk_hybrid *hyb, uint64_t first, uint64_t n,
+                          struct wk_hyb_exp *x);
+static char *wk_hyb_row(const struct wk_hybrid *hyb, int side, size_t w,
+                        const struct wk_hyb_exp *x, char *out, size_t *nrec);
+static struct wk_hyb_scratch *wk_hyb_scratch_get(struct wk_hybrid *hyb);
+static size_t wk_hyb_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                          char *buf, size_t *nrec);
+
+static void wk_hyb_expand(const struct wk_hybrid *hyb, uint64_t first, uint64_t n,
+                          struct wk_hyb_exp *x) {
+    size_t len, r;
+    char *p;
+
+    x->first = first;
+    x->n = n;
+    x->nrec = 0;
+    len = hyb->msrc->fill(hyb->msrc, first, n, x->buf, &x->nrec);
+
+    x->off[0] = 0;
+    for (p = x->buf, r = 1; r <= x->nrec; r++) {
+        p = memchr(p, wk_eol, (size_t)(x->buf + len - p)) + 1;
+        x->off[r] = (uint32_t)(p - x->buf);
+    }
+}
+
+/* one word combined with every expansion of x */
+static char *wk_hyb_row(const struct wk_hybrid *hyb, int side, size_t w,
+                        const struct wk_hyb_exp *x, char *out, size_t *nrec) {
+    const char *word = hyb->words->arena + hyb->words->off[w];
+    size_t wlen = hyb->words->len[w];
+    size_t r, rlen;
+
+    for (r = 0; r < x->nrec; r++) {
+        rlen = x->off[r+1] - x->off[r];
+        if (side == WK_HYB_WM) {
+            memcpy(out, word, wlen);
+            memcpy(out + wlen, x->buf + x->off[r], rlen);
+        } else {
+            memcpy(out, x->buf + x->off[r], rlen - 1);
+            memcpy(out + rlen - 1, word, wlen);
+            out[rlen - 1 + wlen] = wk_eol;
+        }
+        out += wlen + rlen;
+    }
+    *nrec += x->nrec;
+    return out;
+}
+
+/* scratch of a worker, there are never more than workers filling at once */
+static struct wk_hyb_scratch *wk_hyb_scratch_get(struct wk_hybrid *hyb) {
+    struct wk_hyb_scratch *sc;
+
+    pthread_mutex_lock(&hyb->lock);
+    if ((sc = hyb->spare) != NULL)
+        hyb->spare = sc->next;
+    pthread_mutex_unlock(&hyb->lock);
+    if (sc != NULL)
+        return sc;
+
+    sc = calloc(1, sizeof(*sc));
+    if (sc != NULL) {
+        sc->full.buf = malloc(hyb->batch * hyb->msrc->maxrec);
+        sc->full.off = calloc(hyb->batch + 1, sizeof(uint32_t));
+        sc->part.buf = malloc(hyb->batch * hyb->msrc->maxrec);
+        sc->part.off = calloc(hyb->batch + 1, sizeof(uint32_t));
+        if (sc->full.buf != NULL && sc->full.off != NULL && sc->part.buf != NULL
+            && sc->part.off != NULL)
+            return sc;
+        free(sc->full.buf);
+        free(sc->full.off);
+        free(sc->part.buf);
+        free(sc->part.off);
+        free(sc);
+    }
+    fprintf(stderr,"hybrid: can't allocate memory for mask batch\n");
+    return NULL;
+}
+
+static size_t wk_hyb_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                          char *buf, size_t *nrec) {
+    struct wk_hybrid *hyb = src->priv;
+    uint64_t nw = hyb->words->n;
+    uint64_t mtotal = hyb->msrc->total;
+    uint64_t b, sb, r, m, take;
+    struct wk_hyb_scratch *sc;
+    char *out = buf;
+    size_t w;
+    int side;
+
+    *nrec = 0;
+    if ((sc = wk_hyb_scratch_get(hyb)) == NULL)
+        return NPOS;
+
+    while (n > 0) {
+        b = first / (hyb->batch * nw * (uint64_t)hyb->sides);
+        sb = mtotal - b * hyb->batch < hyb->batch ? mtotal - b * hyb->batch : hyb->batch;
+        r = first - b * hyb->batch * nw * (uint64_t)hyb->sides;
+        side = (int)(r / (sb * nw));
+        r %= sb * nw;
+        w = (size_t)(r / sb);
+        m = r % sb;
+        take = sb - m < n ? sb - m : n;
+
+        if (hyb->sides == 1)
+            side = hyb->order;
+
+        if (m == 0 && take == sb) {
+            /* the batch of the last chunk is often still there */
+            if (sc->full.n == 0 || sc->full.first != b * hyb->batch)
+                wk_hyb_expand(hyb, b * hyb->batch, sb, &sc->full);
+            out = wk_hyb_row(hyb, side, w, &sc->full, out, nrec);
+        } else {
+            /* chunk starts or ends inside a row */
+            wk_hyb_expand(hyb, b * hyb->batch + m, take, &sc->part);
+            out = wk_hyb_row(hyb, side, w, &sc->part, out, nrec);
+        }
+        first += take;
+        n -= take;
+    }
+
+    pthread_mutex_lock(&hyb->lock);
+    sc->next = hyb->spare;
+    hyb->spare = sc;
+    pthread_mutex_unlock(&hyb->lock);
+    return (size_t)(out - buf);
+}
+
+/* order is WK_HYB_WM, WK_HYB_MW or WK_HYB_BOTH */
+int wk_hybrid_source(const struct wk_words *words, struct wk_source *msrc, int order,
+                     struct wk_source *src) {
+    struct wk_hybrid *hyb;
+    uint64_t per;
+
+    if (words->n == 0 || msrc->total == 0) {
+        fprintf(stderr,"hybrid: nothing to combine\n");
+        return -1;
+    }
+
+    hyb = calloc(1, sizeof(*hyb));
+    if (hyb == NULL) {
+        fprintf(stderr,"hybrid: can't allocate memory\n");
+        return -1;
+    }
+    hyb->words = words;
+    hyb->msrc = msrc;
+    pthread_mutex_init(&hyb->lock, NULL);
+    hyb->order = order;
+    hyb->sides = order == WK_HYB_BOTH ? 2 : 1;
+    hyb->batch = WK_HYB_BATCHBYTES / msrc->maxrec;
+    if (hyb->batch == 0)
+        hyb->batch = 1;
+    if (hyb->batch > msrc->total)
+        hyb->batch = msrc->total;
+
+    per = msrc->total * (uint64_t)hyb->sides;
+    if (per / hyb->sides != msrc->total || words->n > UINT64_MAX / per) {
+        fprintf(stderr,"hybrid: the keyspace has more than 2^64 candidates\n");
+        free(hyb);
+        return -1;
+    }
+
+    src->total = per * words->n;
+    src->maxrec = words->maxlen + msrc->maxrec;
+    src->fill = wk_hyb_fill;
+    src->priv = hyb;
+    return 0;
+}
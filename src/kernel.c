@@ -0,0 +1,89 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Generation kernels for the common lengths.  Each one is the run loop of
+ * wk_space_runs for single byte choices with the length a constant, so the
+ * line copy, the record stride, the delimiter and the carry over the other
+ * positions are all sized at compile time.  The line is kept between runs
+ * and only the positions a carry touched are patched.
+ */
+
+static inline __attribute__((always_inline))
+size_t wk_kernel_body(const struct wk_space *sp, size_t *digit, uint64_t n,
+                      char *buf, size_t *nrec, const size_t len) {
+    const size_t p0 = sp->order[0];
+    const struct wk_epos *e0 = &sp->pos[p0];
+    char line[WK_KERNEL_MAX+1], *out = buf;
+    const struct wk_epos *e;
+    uint64_t m, j;
+    size_t i, k, p;
+
+    for (i = 0; i < len; i++)
+        line[i] = sp->pos[i].enc[digit[i]][0];
+    line[len] = wk_eol;
+
+    for (;;) {
+        m = e0->radix - digit[p0] < n ? e0->radix - digit[p0] : n;
+        for (j = 0; j < m; j++) {
+            memcpy(out, line, len + 1);
+            out[p0] = e0->enc[digit[p0] + j][0];
+            out += len + 1;
+        }
+        *nrec += m;
+        if ((n -= m) == 0)
+            break;
+
+        digit[p0] = 0;
+        for (k = 1; k < len; k++) {
+            p = sp->order[k];
+            e = &sp->pos[p];
+            if (++digit[p] < e->radix) {
+                line[p] = e->enc[digit[p]][0];
+                break;
+            }
+            digit[p] = 0;
+            line[p] = e->enc[0][0];
+        }
+    }
+    return (size_t)(out - buf);
+}
+
+#define WK_KERNEL(L)                                                                \
+static size_t wk_kernel_##L(const struct wk_space *sp, size_t *digit, uint64_t n,  \
+                            char *buf, size_t *nrec) {                             \
+    return wk_kernel_body(sp, digit, n, buf, nrec, L);                             \
+}
+
+WK_KERNEL(4)  WK_KERNEL(5)  WK_KERNEL(6)  WK_KERNEL(7)
+WK_KERNEL(8)  WK_KERNEL(9)  WK_KERNEL(10) WK_KERNEL(11)
+WK_KERNEL(12) WK_KERNEL(13) WK_KERNEL(14) WK_KERNEL(15)
+WK_KERNEL(16)
+
+static const wk_kernel_fn wk_kernels[WK_KERNEL_MAX - WK_KERNEL_MIN + 1] = {
+    wk_kernel_4,  wk_kernel_5,  wk_kernel_6,  wk_kernel_7,
+    wk_kernel_8,  wk_kernel_9,  wk_kernel_10, wk_kernel_11,
+    wk_kernel_12, wk_kernel_13, wk_kernel_14, wk_kernel_15,
+    wk_kernel_16,
+};
+
+/* kernel of a single byte length, NULL to use the generic loop */
+wk_kernel_fn wk_kernel_for(size_t len) {
+    if (len < WK_KERNEL_MIN || len > WK_KERNEL_MAX)
+        return NULL;
+    return wk_kernels[len - WK_KERNEL_MIN];
+}
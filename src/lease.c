@@ -0,0 +1,224 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+/*
+ * Consumer side of bfc serve.  The protocol is one line per request and
+ * one line per reply:
+ *
+ *   HELLO key first count      OK nblocks size, or ERR if the jobs differ
+ *   LEASE                      RANGE block first count ttl, WAIT secs or DONE
+ *   RENEW block                OK, or ERR once the lease has expired
+ *   COMPLETE block             OK once the block is in the journal
+ *
+ * A consumer generates [first, first+count) of a RANGE itself and
+ * completes the block afterwards.  A range that takes longer than the
+ * ttl is kept by wk_lease_keep, whose thread owns the socket until
+ * wk_lease_release and renews the lease every ttl/2 seconds.
+ */
+
+static int wk_lease_send(int fd, const char *line);
+static int wk_lease_recv(int fd, char *line, size_t size);
+static int wk_lease_call(int fd, const char *req, char *reply, size_t size);
+static void *wk_lease_keeper(void *arg);
+
+static int wk_lease_send(int fd, const char *line) {
+    size_t len = strlen(line);
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, line, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        line += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* replies are short and rare, read them a byte at a time */
+static int wk_lease_recv(int fd, char *line, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+
+    while (len + 1 < size) {
+        n = read(fd, line + len, 1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        if (line[len] == '\n') {
+            line[len] = '\0';
+            return 0;
+        }
+        len++;
+    }
+    return -1;
+}
+
+static int wk_lease_call(int fd, const char *req, char *reply, size_t size) {
+    if (wk_lease_send(fd, req) == -1 || wk_lease_recv(fd, reply, size) == -1) {
+        fprintf(stderr,"lease: lost the server\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* connect to the server of path, which must serve the same job, returns the socket */
+int wk_lease_connect(const char *path, const char *key, uint64_t first, uint64_t count) {
+    struct sockaddr_un addr;
+    char req[WK_LEASE_LINE], reply[WK_LEASE_LINE];
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"lease: socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+        || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr,"lease: can't connect to %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            (void)close(fd);
+        return -1;
+    }
+
+    if ((size_t)snprintf(req, sizeof(req), "HELLO %s %llu %llu\n", key, (unsigned long long)first,
+                         (unsigned long long)count) >= sizeof(req)
+        || wk_lease_call(fd, req, reply, sizeof(reply)) == -1) {
+        (void)close(fd);
+        return -1;
+    }
+    if (strncmp(reply, "OK", 2) != 0) {
+        fprintf(stderr,"lease: %s\n", reply);
+        (void)close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* 1 with the next lease in *l, 0 once every block is done, -1 on error */
+int wk_lease_next(int fd, struct wk_lease *l) {
+    char reply[WK_LEASE_LINE];
+    unsigned long long b, f, c;
+    unsigned secs;
+
+    for (;;) {
+        if (wk_lease_call(fd, "LEASE\n", reply, sizeof(reply)) == -1)
+            return -1;
+        if (sscanf(reply, "RANGE %llu %llu %llu %u", &b, &f, &c, &l->ttl) == 4) {
+            l->block = b;
+            l->first = f;
+            l->count = c;
+            return 1;
+        }
+        if (strcmp(reply, "DONE") == 0)
+            return 0;
+        /* the rest is leased to others, one of them may give up */
+        if (sscanf(reply, "WAIT %u", &secs) == 1) {
+            sleep(secs ? secs : 1);
+            continue;
+        }
+        fprintf(stderr,"lease: %s\n", reply);
+        return -1;
+    }
+}
+
+/* keep a lease that takes longer than its ttl */
+int wk_lease_renew(int fd, const struct wk_lease *l) {
+    char req[64], reply[WK_LEASE_LINE];
+
+    snprintf(req, sizeof(req), "RENEW %llu\n", (unsigned long long)l->block);
+    if (wk_lease_call(fd, req, reply, sizeof(reply)) == -1)
+        return -1;
+    if (strcmp(reply, "OK") != 0) {
+        fprintf(stderr,"lease: %s\n", reply);
+        return -1;
+    }
+    return 0;
+}
+
+/* call once the candidates of the lease are written */
+int wk_lease_complete(int fd, const struct wk_lease *l) {
+    char req[64], reply[WK_LEASE_LINE];
+
+    snprintf(req, sizeof(req), "COMPLETE %llu\n", (unsigned long long)l->block);
+    if (wk_lease_call(fd, req, reply, sizeof(reply)) == -1)
+        return -1;
+    if (strcmp(reply, "OK") != 0) {
+        fprintf(stderr,"lease: %s\n", reply);
+        return -1;
+    }
+    return 0;
+}
+
+static void *wk_lease_keeper(void *arg) {
+    struct wk_lease_keeper *k = arg;
+    unsigned secs = k->lease.ttl / 2 ? k->lease.ttl / 2 : 1;
+    struct timespec ts;
+
+    pthread_mutex_lock(&k->lock);
+    while (!k->stop && !k->lost) {
+        (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += secs;
+        while (!k->stop && pthread_cond_timedwait(&k->cond, &k->lock, &ts) != ETIMEDOUT)
+            ;
+        if (!k->stop && wk_lease_renew(k->fd, &k->lease) == -1)
+            k->lost = 1;
+    }
+    pthread_mutex_unlock(&k->lock);
+    return NULL;
+}
+
+/* renew l on fd in the background, fd is not to be used until wk_lease_release */
+int wk_lease_keep(struct wk_lease_keeper *k, int fd, const struct wk_lease *l) {
+    pthread_condattr_t attr;
+
+    memset(k, 0, sizeof(*k));
+    k->fd = fd;
+    k->lease = *l;
+    pthread_mutex_init(&k->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&k->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&k->tid, NULL, wk_lease_keeper, k) != 0) {
+        fprintf(stderr,"lease: can't create the thread renewing the lease\n");
+        pthread_cond_destroy(&k->cond);
+        pthread_mutex_destroy(&k->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/* stop renewing, -1 if the lease was lost on the way */
+int wk_lease_release(struct wk_lease_keeper *k) {
+    pthread_mutex_lock(&k->lock);
+    k->stop = 1;
+    pthread_cond_signal(&k->cond);
+    pthread_mutex_unlock(&k->lock);
+    pthread_join(k->tid, NULL);
+    pthread_cond_destroy(&k->cond);
+    pthread_mutex_destroy(&k->lock);
+    return k->lost ? -1 : 0;
+}
@@ -0,0 +1,534 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Markov mode.  -T trains character counts per position and per previous
+ * character from a word list and writes them to a stats file, -M reads
+ * them back and orders the charset of every position from the most to the
+ * least frequent character.  With the prev: form (the default) the order
+ * of a position depends on the character before it.
+ *
+ * A candidate is a vector of ranks, rank 0 being the most likely character
+ * of its position.  Level L holds the candidates whose largest rank is
+ * L-1, so levels are visited from the most likely corner of the keyspace
+ * outwards.  Level L is the cube [0,L)^len minus the cube [0,L-1)^len,
+ * which splits into len boxes, box j having rank L-1 at position j, ranks
+ * below L-1 before j and ranks below L after j.  Every box is a plain
+ * product of rank ranges, so levels have exact sizes and every candidate
+ * has an index that workers and -r can seek to.
+ *
+ * Stats file, host byte order:
+ *
+ *   "BFCMKV1\n"  uint64 n  then n entries of uint32 pos, prev, ch, count
+ *
+ * sorted by (pos, prev, ch), prev is 0 at position 0.
+ */
+
+#define WK_MK_MAGIC     "BFCMKV1\n"
+
+struct wk_mkentry {
+    uint32_t pos, prev, ch, count;
+};
+
+struct wk_mkstats {
+    struct wk_mkentry *e;               /* sorted by pos, prev, ch */
+    size_t n;
+    struct wk_mkentry *tot;             /* prev summed out, sorted by pos, ch */
+    size_t ntot;
+};
+
+/* one length of the mask with its rank tables */
+struct wk_mkspace {
+    const struct wk_space *sp;
+    unsigned char **ord;                /* ord[p][row*radix + rank] is the charset index */
+    int cond;                           /* rows are the charset index at p-1 */
+};
+
+struct wk_mkbox {
+    const struct wk_mkspace *ms;
+    size_t level, j;
+    uint64_t count, cum;                /* cum counts the candidates of earlier boxes */
+};
+
+struct wk_markov {
+    struct wk_mkspace *spaces;
+    size_t nspaces;
+    struct wk_mkbox *boxes;
+    size_t nboxes;
+    int checkdups;
+};
+
+static uint64_t wk_mk_hash(uint32_t pos, uint32_t prev, uint32_t ch);
+static int wk_mk_count(struct wk_mkentry **tab, size_t *cap, size_t *used,
+                       uint32_t pos, uint32_t prev, uint32_t ch);
+static int wk_mkentry_cmp(const void *a, const void *b);
+static int wk_mk_load(const char *filename, struct wk_mkstats *st);
+static uint32_t wk_mk_lookup(const struct wk_mkentry *e, size_t n,
+                             uint32_t pos, uint32_t prev, uint32_t ch);
+static int wk_mk_order(const struct wk_mkstats *st, struct wk_mkspace *ms, size_t p);
+static void wk_mk_range(const struct wk_mkbox *b, size_t p, size_t *lo, size_t *hi);
+static size_t wk_markov_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                             char *buf, size_t *nrec);
+static void wk_markov_free(struct wk_markov *mk);
+
+static uint64_t wk_mk_hash(uint32_t pos, uint32_t prev, uint32_t ch) {
+    uint64_t h = ((uint64_t)pos << 42) ^ ((uint64_t)prev << 21) ^ ch;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* add one to (pos, prev, ch) in an open addressing table, count 0 marks a free slot */
+static int wk_mk_count(struct wk_mkentry **tab, size_t *cap, size_t *used,
+                       uint32_t pos, uint32_t prev, uint32_t ch) {
+    struct wk_mkentry *t = *tab, *old;
+    size_t i, k, oldcap;
+
+    if (2 * (*used + 1) > *cap) {
+        old = t;
+        oldcap = *cap;
+        t = calloc(2 * oldcap, sizeof(*t));
+        if (t == NULL) {
+            fprintf(stderr,"markov: can't allocate memory for the counts\n");
+            return -1;
+        }
+        *cap = 2 * oldcap;
+        for (k = 0; k < oldcap; k++) {
+            if (old[k].count == 0)
+                continue;
+            for (i = wk_mk_hash(old[k].pos, old[k].prev, old[k].ch) & (*cap - 1);
+                 t[i].count != 0; i = (i + 1) & (*cap - 1))
+                ;
+            t[i] = old[k];
+        }
+        free(old);
+        *tab = t;
+    }
+
+    for (i = wk_mk_hash(pos, prev, ch) & (*cap - 1); t[i].count != 0; i = (i + 1) & (*cap - 1)) {
+        if (t[i].pos == pos && t[i].prev == prev && t[i].ch == ch) {
+            if (t[i].count != UINT32_MAX)
+                t[i].count++;
+            return 0;
+        }
+    }
+    t[i].pos = pos;
+    t[i].prev = prev;
+    t[i].ch = ch;
+    t[i].count = 1;
+    (*used)++;
+    return 0;
+}
+
+static int wk_mkentry_cmp(const void *a, const void *b) {
+    const struct wk_mkentry *x = a, *y = b;
+
+    if (x->pos != y->pos) return x->pos < y->pos ? -1 : 1;
+    if (x->prev != y->prev) return x->prev < y->prev ? -1 : 1;
+    if (x->ch != y->ch) return x->ch < y->ch ? -1 : 1;
+    return 0;
+}
+
+/* count the characters of every line of wordlist and write them to statsfile */
+int wk_markov_train(const char *wordlist, const char *statsfile) {
+    char line[MAXSTRING * WK_MBMAX * 4];
+    wchar_t wline[MAXSTRING + 1];
+    struct wk_mkentry *tab;
+    size_t cap = 4096, used = 0, len, i, k;
+    unsigned long words = 0;
+    uint64_t n;
+    FILE *in, *out;
+
+    if ((in = fopen(wordlist, "r")) == NULL) {
+        fprintf(stderr,"markov: can't open %s: %s\n", wordlist, strerror(errno));
+        return -1;
+    }
+    tab = calloc(cap, sizeof(*tab));
+    if (tab == NULL) {
+        fprintf(stderr,"markov: can't allocate memory for the counts\n");
+        (void)fclose(in);
+        return -1;
+    }
+
+    while (fgets(line, (int)sizeof(line), in) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        len = mbstowcs(wline, line, MAXSTRING);
+        if (len == NPOS) {
+            /* not valid in the locale, one char per byte */
+            for (len = 0; line[len] != '\0' && len < MAXSTRING; len++)
+                wline[len] = (wchar_t)(unsigned char)line[len];
+        }
+        for (i = 0; i < len && i < MAXSTRING; i++) {
+            if (wk_mk_count(&tab, &cap, &used, (uint32_t)i,
+                            i ? (uint32_t)wline[i-1] : 0, (uint32_t)wline[i]) == -1) {
+                free(tab);
+                (void)fclose(in);
+                return -1;
+            }
+        }
+        if (len > 0)
+            words++;
+    }
+    (void)fclose(in);
+
+    for (i = k = 0; i < cap; i++) {
+        if (tab[i].count != 0)
+            tab[k++] = tab[i];
+    }
+    qsort(tab, k, sizeof(*tab), wk_mkentry_cmp);
+
+    if ((out = fopen(statsfile, "wb")) == NULL) {
+        fprintf(stderr,"markov: can't create %s: %s\n", statsfile, strerror(errno));
+        free(tab);
+        return -1;
+    }
+    n = k;
+    if (fwrite(WK_MK_MAGIC, 1, 8, out) != 8 || fwrite(&n, sizeof(n), 1, out) != 1
+        || fwrite(tab, sizeof(*tab), k, out) != k || fclose(out) != 0) {
+        fprintf(stderr,"markov: can't write %s: %s\n", statsfile, strerror(errno));
+        free(tab);
+        return -1;
+    }
+    fprintf(stderr,"markov: %lu words, %lu counts written to %s\n",
+            words, (unsigned long)k, statsfile);
+    free(tab);
+    return 0;
+}
+
+static int wk_mk_load(const char *filename, struct wk_mkstats *st) {
+    char magic[8];
+    uint64_t n;
+    size_t i, k;
+    FILE *fp;
+
+    memset(st, 0, sizeof(*st));
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        fprintf(stderr,"markov: can't open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, WK_MK_MAGIC, 8) != 0
+        || fread(&n, sizeof(n), 1, fp) != 1 || n > SIZE_MAX / sizeof(struct wk_mkentry)) {
+        fprintf(stderr,"markov: %s is not a stats file\n", filename);
+        (void)fclose(fp);
+        return -1;
+    }
+
+    st->e = malloc(n ? n * sizeof(*st->e) : 1);
+    st->tot = malloc(n ? n * sizeof(*st->tot) : 1);
+    if (st->e == NULL || st->tot == NULL) {
+        fprintf(stderr,"markov: can't allocate memory for %s\n", filename);
+        goto err;
+    }
+    if (fread(st->e, sizeof(*st->e), n, fp) != n) {
+        fprintf(stderr,"markov: %s is truncated\n", filename);
+        goto err;
+    }
+    (void)fclose(fp);
+    st->n = n;
+    qsort(st->e, st->n, sizeof(*st->e), wk_mkentry_cmp);
+
+    /* per position totals, prev summed out */
+    for (i = 0; i < st->n; i++) {
+        st->tot[i] = st->e[i];
+        st->tot[i].prev = 0;
+    }
+    qsort(st->tot, st->n, sizeof(*st->tot), wk_mkentry_cmp);
+    for (i = k = 0; i < st->n; i++) {
+        if (k > 0 && st->tot[k-1].pos == st->tot[i].pos && st->tot[k-1].ch == st->tot[i].ch) {
+            st->tot[k-1].count = st->tot[k-1].count + st->tot[i].count < st->tot[k-1].count
+                                 ? UINT32_MAX : st->tot[k-1].count + st->tot[i].count;
+            continue;
+        }
+        st->tot[k++] = st->tot[i];
+    }
+    st->ntot = k;
+    return 0;
+
+err:
+    free(st->e);
+    free(st->tot);
+    (void)fclose(fp);
+    return -1;
+}
+
+static uint32_t wk_mk_lookup(const struct wk_mkentry *e, size_t n,
+                             uint32_t pos, uint32_t prev, uint32_t ch) {
+    struct wk_mkentry key = { pos, prev, ch, 0 };
+    const struct wk_mkentry *r = bsearch(&key, e, n, sizeof(*e), wk_mkentry_cmp);
+
+    return r ? r->count : 0;
+}
+
+/*
+ * Rank table of position p: every row sorts the charset by count, most
+ * frequent first, charset order breaking ties.  A row without any count
+ * falls back to the per position totals.
+ */
+static int wk_mk_order(const struct wk_mkstats *st, struct wk_mkspace *ms, size_t p) {
+    const struct wk_epos *e = &ms->sp->pos[p];
+    const struct wk_epos *pe = p ? &ms->sp->pos[p-1] : NULL;
+    size_t rows = ms->cond && p ? pe->radix : 1;
+    uint32_t w[MAXCSET], t;
+    size_t row, a, b, any;
+    unsigned char *o;
+
+    ms->ord[p] = malloc(rows * e->radix);
+    if (ms->ord[p] == NULL) {
+        fprintf(stderr,"markov: can't allocate memory for the rank tables\n");
+        return -1;
+    }
+
+    for (row = 0; row < rows; row++) {
+        any = 0;
+        if (ms->cond) {
+            for (a = 0; a < e->radix; a++) {
+                w[a] = wk_mk_lookup(st->e, st->n, (uint32_t)p,
+                                    p ? (uint32_t)pe->wcs[row] : 0, (uint32_t)e->wcs[a]);
+                any |= w[a];
+            }
+        }
+        if (!any) {
+            for (a = 0; a < e->radix; a++)
+                w[a] = wk_mk_lookup(st->tot, st->ntot, (uint32_t)p, 0, (uint32_t)e->wcs[a]);
+        }
+
+        /* insertion sort, stable so equal counts keep the charset order */
+        o = ms->ord[p] + row * e->radix;
+        for (a = 0; a < e->radix; a++) {
+            t = w[a];
+            for (b = a; b > 0 && w[o[b-1]] < t; b--)
+                o[b] = o[b-1];
+            o[b] = (unsigned char)a;
+        }
+    }
+    return 0;
+}
+
+/* rank range [lo, hi) of position p inside box b */
+static void wk_mk_range(const struct wk_mkbox *b, size_t p, size_t *lo, size_t *hi) {
+    size_t radix = b->ms->sp->pos[p].radix;
+
+    if (p < b->j) {
+        *lo = 0;
+        *hi = b->level - 1;
+    } else if (p == b->j) {
+        *lo = b->level - 1;
+        *hi = b->level;
+    } else {
+        *lo = 0;
+        *hi = b->level;
+    }
+    if (*hi > radix)
+        *hi = radix;
+    if (*lo > *hi)
+        *lo = *hi;
+}
+
+static size_t wk_markov_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                             char *buf, size_t *nrec) {
+    const struct wk_markov *mk = src->priv;
+    const struct wk_mkbox *b;
+    const struct wk_space *sp;
+    const struct wk_epos *e;
+    size_t lo[MAXSTRING], hi[MAXSTRING], rank[MAXSTRING], digit[MAXSTRING];
+    size_t bl = 0, bh = mk->nboxes - 1, mid, p, row;
+    uint64_t k, take;
+    char *out = buf;
+
+    *nrec = 0;
+    /* last box starting at or before first */
+    while (bl < bh) {
+        mid = (bl + bh + 1) / 2;
+        if (mk->boxes[mid].cum <= first)
+            bl = mid;
+        else
+            bh = mid - 1;
+    }
+
+    for (; n > 0; bl++) {
+        b = &mk->boxes[bl];
+        sp = b->ms->sp;
+        k = first - b->cum;
+        take = b->count - k < n ? b->count - k : n;
+        n -= take;
+        first += take;
+
+        for (p = sp->len; p > 0; p--) {
+            wk_mk_range(b, p-1, &lo[p-1], &hi[p-1]);
+            rank[p-1] = lo[p-1] + (size_t)(k % (hi[p-1] - lo[p-1]));
+            k /= hi[p-1] - lo[p-1];
+        }
+
+        for (;;) {
+            for (p = 0; p < sp->len; p++) {
+                row = b->ms->cond && p ? digit[p-1] : 0;
+                digit[p] = b->ms->ord[p][row * sp->pos[p].radix + rank[p]];
+            }
+            if (!mk->checkdups || !wk_space_dupes(sp, digit)) {
+                for (p = 0; p < sp->len; p++) {
+                    e = &sp->pos[p];
+                    memcpy(out, e->enc[digit[p]], e->elen[digit[p]]);
+                    out += e->elen[digit[p]];
+                }
+                *out++ = wk_eol;
+                (*nrec)++;
+            }
+            if (--take == 0)
+                break;
+
+            for (p = sp->len; p > 0; p--) {
+                if (++rank[p-1] < hi[p-1])
+                    break;
+                rank[p-1] = lo[p-1];
+            }
+        }
+    }
+    return (size_t)(out - buf);
+}
+
+/* a partly built source too */
+static void wk_markov_free(struct wk_markov *mk) {
+    size_t s, p;
+
+    if (mk == NULL)
+        return;
+    for (s = 0; mk->spaces != NULL && s < mk->nspaces; s++) {
+        if (mk->spaces[s].ord == NULL)
+            continue;
+        for (p = 0; p < mk->spaces[s].sp->len; p++)
+            free(mk->spaces[s].ord[p]);
+        free(mk->spaces[s].ord);
+    }
+    free(mk->spaces);
+    free(mk->boxes);
+    free(mk);
+}
+
+/*
+ * Order the compiled mask by the stats named in spec, [prev:|pos:]file.
+ * Only levels up to maxlevel are generated, 0 for all of them.
+ */
+int wk_markov_source(const struct wk_mask *mask, const char *spec, size_t maxlevel,
+                     struct wk_source *src) {
+    struct wk_mkstats st;
+    struct wk_markov *mk = NULL;
+    struct wk_mkspace *ms;
+    struct wk_mkbox *b;
+    size_t s, p, j, level, nlevels = 0, npos = 0, lo, hi;
+    uint64_t cnt, total = 0, ltotal;
+    int cond = 1;
+
+    if (strncmp(spec, "prev:", 5) == 0) {
+        spec += 5;
+    } else if (strncmp(spec, "pos:", 4) == 0) {
+        spec += 4;
+        cond = 0;
+    }
+    if (wk_mk_load(spec, &st) == -1)
+        return -1;
+
+    mk = calloc(1, sizeof(*mk));
+    if (mk == NULL)
+        goto nomem;
+    mk->checkdups = mask->checkdups;
+    mk->nspaces = mask->nspaces;
+    mk->spaces = calloc(mask->nspaces, sizeof(*mk->spaces));
+    if (mk->spaces == NULL)
+        goto nomem;
+
+    for (s = 0; s < mask->nspaces; s++) {
+        ms = &mk->spaces[s];
+        ms->sp = &mask->spaces[s];
+        ms->cond = cond;
+        ms->ord = calloc(ms->sp->len ? ms->sp->len : 1, sizeof(*ms->ord));
+        if (ms->ord == NULL)
+            goto nomem;
+        for (p = 0; p < ms->sp->len; p++) {
+            if (wk_mk_order(&st, ms, p) == -1)
+                goto err;
+            if (ms->sp->pos[p].radix > nlevels)
+                nlevels = ms->sp->pos[p].radix;
+        }
+        npos += ms->sp->len ? ms->sp->len : 1;
+    }
+    if (nlevels == 0)
+        nlevels = 1;
+    if (maxlevel > 0 && maxlevel < nlevels)
+        nlevels = maxlevel;
+
+    /* boxes in output order: level, length, position of the top rank */
+    mk->boxes = calloc(nlevels * npos, sizeof(*mk->boxes));
+    if (mk->boxes == NULL)
+        goto nomem;
+
+    for (level = 1; level <= nlevels; level++) {
+        ltotal = 0;
+        for (s = 0; s < mask->nspaces; s++) {
+            ms = &mk->spaces[s];
+            for (j = 0; j < ms->sp->len || (j == 0 && level == 1); j++) {
+                b = &mk->boxes[mk->nboxes];
+                b->ms = ms;
+                b->level = level;
+                b->j = j;
+                cnt = 1;
+                for (p = 0; p < ms->sp->len; p++) {
+                    wk_mk_range(b, p, &lo, &hi);
+                    if (cnt != 0 && hi - lo > UINT64_MAX / cnt) {
+                        fprintf(stderr,"markov: the keyspace has more than 2^64 candidates\n");
+                        goto err;
+                    }
+                    cnt *= hi - lo;
+                }
+                if (cnt == 0)
+                    continue;
+                if (total > UINT64_MAX - cnt) {
+                    fprintf(stderr,"markov: the keyspace has more than 2^64 candidates\n");
+                    goto err;
+                }
+                b->count = cnt;
+                b->cum = total;
+                total += cnt;
+                ltotal += cnt;
+                mk->nboxes++;
+            }
+        }
+        fprintf(stderr,"markov: level %lu has %llu candidates\n",
+                (unsigned long)level, (unsigned long long)ltotal);
+    }
+    if (mk->nboxes == 0) {
+        fprintf(stderr,"markov: nothing to generate\n");
+        goto err;
+    }
+
+    free(st.e);
+    free(st.tot);
+    src->total = total;
+    src->maxrec = mask->maxrec;
+    src->fill = wk_markov_fill;
+    src->priv = mk;
+    return 0;
+
+nomem:
+    fprintf(stderr,"markov: can't allocate memory\n");
+err:
+    wk_markov_free(mk);
+    free(st.e);
+    free(st.tot);
+    return -1;
+}
@@ -0,0 +1,432 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+static size_t wk_dup_limit(const options_type *op, wchar_t c);
+static int wk_fill_epos(const options_type *op, size_t i, struct wk_epos *e);
+static uint64_t wk_space_rank(const struct wk_space *sp, const size_t *digit);
+static void wk_space_unrank(const struct wk_space *sp, uint64_t idx, size_t *digit);
+static size_t wk_space_runs(const struct wk_space *sp, size_t *digit, uint64_t n,
+                            char *buf, size_t *nrec);
+static size_t wk_space_fill(const struct wk_space *sp, uint64_t idx, uint64_t n,
+                            int checkdups, char *buf, size_t *nrec);
+static size_t wk_mask_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                           char *buf, size_t *nrec);
+static size_t wk_space_maxrec(const struct wk_space *sp);
+
+/* multibyte encoding of one char, chars the locale can't encode are written as raw bytes */
+size_t wk_encode_char(wchar_t wc, char *out) {
+    char tmp[MB_LEN_MAX];
+    mbstate_t state;
+    size_t n;
+
+    memset(&state, 0, sizeof(state));
+    n = wcrtomb(tmp, wc, &state);
+    if (n == NPOS || n > WK_MBMAX) {
+        out[0] = (char)wc;
+        return 1;
+    }
+    memcpy(out, tmp, n);
+    return n;
+}
+
+/* same rule as wk_too_many_duplicates: the smallest limit of any charset holding c */
+static size_t wk_dup_limit(const options_type *op, wchar_t c) {
+    size_t id = wk_cindex_id(&op->cindex, c);
+
+    return id != NPOS ? op->cindex.dlim[id] : NPOS;
+}
+
+static int wk_fill_epos(const options_type *op, size_t i, struct wk_epos *e) {
+    const struct pinfo *p = &op->pattern_info[i];
+    size_t k;
+
+    if (p->is_fixed) {
+        e->radix = 1;
+        e->wcs = &op->pchars[i];
+    } else {
+        e->radix = p->clen;
+        e->wcs = p->cset;
+    }
+
+    e->enc = calloc(e->radix, sizeof(*e->enc));
+    e->elen = calloc(e->radix, sizeof(*e->elen));
+    e->dlim = calloc(e->radix, sizeof(*e->dlim));
+    if (e->enc == NULL || e->elen == NULL || e->dlim == NULL) {
+        fprintf(stderr,"mask_compile: can't allocate memory for position %lu\n", (unsigned long)i+1);
+        return -1;
+    }
+
+    for (k = 0; k < e->radix; k++) {
+        e->elen[k] = (unsigned char)wk_encode_char(e->wcs[k], e->enc[k]);
+        e->dlim[k] = wk_dup_limit(op, e->wcs[k]);
+    }
+    return 0;
+}
+
+static uint64_t wk_space_rank(const struct wk_space *sp, const size_t *digit) {
+    uint64_t r = 0;
+    size_t k;
+
+    for (k = sp->len; k > 0; k--)
+        r = r * sp->pos[sp->order[k-1]].radix + digit[sp->order[k-1]];
+    return r;
+}
+
+static void wk_space_unrank(const struct wk_space *sp, uint64_t idx, size_t *digit) {
+    size_t k, p;
+
+    for (k = 0; k < sp->len; k++) {
+        p = sp->order[k];
+        digit[p] = (size_t)(idx % sp->pos[p].radix);
+        idx /= sp->pos[p].radix;
+    }
+}
+
+/*
+ * Compile the validated options to one space per length.  Lengths other
+ * than min and max run over every candidate, the startstring only bounds
+ * length min and the endstring only bounds length max.
+ */
+int wk_mask_compile(const options_type *op, int inverted, struct wk_mask *mask) {
+    struct wk_space *sp;
+    size_t digit[MAXSTRING];
+    size_t i, len;
+    uint64_t total;
+
+    memset(mask, 0, sizeof(*mask));
+    mask->nspaces = op->max - op->min + 1;
+    mask->spaces = calloc(mask->nspaces, sizeof(struct wk_space));
+    if (mask->spaces == NULL) {
+        fprintf(stderr,"mask_compile: can't allocate memory for mask\n");
+        return -1;
+    }
+
+    for (i = 0; i < WK_NCHARSETS; i++) {
+        if (op->charsets[i].duplicates != NPOS)
+            mask->checkdups = 1;
+    }
+
+    for (len = op->min; len <= op->max; len++) {
+        sp = &mask->spaces[len - op->min];
+        sp->len = len;
+        sp->single = 1;
+        sp->pos = calloc(len ? len : 1, sizeof(struct wk_epos));
+        sp->order = calloc(len ? len : 1, sizeof(size_t));
+        if (sp->pos == NULL || sp->order == NULL) {
+            fprintf(stderr,"mask_compile: can't allocate memory for mask\n");
+            return -1;
+        }
+
+        total = 1;
+        for (i = 0; i < len; i++) {
+            if (wk_fill_epos(op, i, &sp->pos[i]) == -1)
+                return -1;
+            for (size_t k = 0; k < sp->pos[i].radix; k++) {
+                if (sp->pos[i].elen[k] != 1)
+                    sp->single = 0;
+            }
+            if (total > UINT64_MAX / sp->pos[i].radix) {
+                fprintf(stderr,"mask_compile: the keyspace of length %lu has more than 2^64 candidates\n",
+                        (unsigned long)len);
+                return -1;
+            }
+            total *= sp->pos[i].radix;
+            sp->order[i] = inverted ? i : len - 1 - i;
+        }
+        /* picked once per length, the fill only checks for it */
+        sp->kernel = sp->single ? wk_kernel_for(len) : NULL;
+        if (len * WK_MBMAX + 1 > mask->maxrec)
+            mask->maxrec = len * WK_MBMAX + 1;
+
+        sp->first = 0;
+        sp->count = total;
+
+        if (len == op->min && op->startstring != NULL) {
+            for (i = 0; i < len; i++)
+                digit[i] = op->pattern_info[i].is_fixed ? 0 : op->pattern_info[i].start_index;
+            sp->first = wk_space_rank(sp, digit);
+            sp->count = total - sp->first;
+        }
+
+        if (len == op->max && op->endstring != NULL) {
+            for (i = 0; i < len; i++)
+                digit[i] = op->pattern_info[i].is_fixed ? 0 : op->pattern_info[i].end_index;
+            total = wk_space_rank(sp, digit) + 1;
+            if (total <= sp->first) {
+                fprintf(stderr,"End string must be greater than start string\n");
+                return -1;
+            }
+            sp->count = total - sp->first;
+        }
+    }
+    return 0;
+}
+
+void wk_mask_free(struct wk_mask *mask) {
+    size_t s, i;
+
+    for (s = 0; s < mask->nspaces; s++) {
+        for (i = 0; i < mask->spaces[s].len; i++) {
+            free(mask->spaces[s].pos[i].enc);
+            free(mask->spaces[s].pos[i].elen);
+            free(mask->spaces[s].pos[i].dlim);
+        }
+        free(mask->spaces[s].pos);
+        free(mask->spaces[s].order);
+    }
+    free(mask->spaces);
+    memset(mask, 0, sizeof(*mask));
+}
+
+/* return 1 if a run of equal characters is longer than its charset allows */
+int wk_space_dupes(const struct wk_space *sp, const size_t *digit) {
+    size_t i, run = 1;
+
+    for (i = 1; i < sp->len; i++) {
+        if (sp->pos[i].wcs[digit[i]] == sp->pos[i-1].wcs[digit[i-1]]) {
+            if (++run > sp->pos[i].dlim[digit[i]])
+                return 1;
+        } else {
+            run = 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Candidates that differ only in the fastest changing position come in
+ * runs of its radix.  The rest of the line is encoded once per run and
+ * every candidate is that line with one choice put in.  In normal order
+ * the run shares a prefix, with -i it shares the whole suffix.
+ */
+static size_t wk_space_runs(const struct wk_space *sp, size_t *digit, uint64_t n,
+                            char *buf, size_t *nrec) {
+    const size_t p0 = sp->order[0], len = sp->len;
+    const struct wk_epos *e0 = &sp->pos[p0];
+    char line[MAXSTRING*WK_MBMAX+1], *out = buf;
+    size_t i, k, p, d, hlen, tlen;
+
+    for (;;) {
+        if (sp->single) {
+            for (i = 0; i < len; i++)
+                line[i] = sp->pos[i].enc[digit[i]][0];
+            line[len] = wk_eol;
+            for (d = digit[p0]; d < e0->radix && n > 0; d++, n--) {
+                memcpy(out, line, len + 1);
+                out[p0] = e0->enc[d][0];
+                out += len + 1;
+            }
+        } else {
+            /* line holds the bytes before p0, then the ones after it */
+            for (i = 0, hlen = 0; i < p0; i++) {
+                memcpy(line + hlen, sp->pos[i].enc[digit[i]], sp->pos[i].elen[digit[i]]);
+                hlen += sp->pos[i].elen[digit[i]];
+            }
+            for (i = p0 + 1, tlen = hlen; i < len; i++) {
+                memcpy(line + tlen, sp->pos[i].enc[digit[i]], sp->pos[i].elen[digit[i]]);
+                tlen += sp->pos[i].elen[digit[i]];
+            }
+            line[tlen++] = wk_eol;
+            tlen -= hlen;
+            for (d = digit[p0]; d < e0->radix && n > 0; d++, n--) {
+                memcpy(out, line, hlen);
+                out += hlen;
+                memcpy(out, e0->enc[d], e0->elen[d]);
+                out += e0->elen[d];
+                memcpy(out, line + hlen, tlen);
+                out += tlen;
+            }
+        }
+        *nrec += d - digit[p0];
+        if (n == 0)
+            break;
+
+        digit[p0] = 0;
+        for (k = 1; k < len; k++) {
+            p = sp->order[k];
+            if (++digit[p] < sp->pos[p].radix)
+                break;
+            digit[p] = 0;
+        }
+    }
+    return (size_t)(out - buf);
+}
+
+/* write candidates [idx, idx+n) of one space, idx counts from the start of the space */
+static size_t wk_space_fill(const struct wk_space *sp, uint64_t idx, uint64_t n,
+                            int checkdups, char *buf, size_t *nrec) {
+    size_t digit[MAXSTRING];
+    char cur[MAXSTRING];
+    const struct wk_epos *e;
+    char *out = buf;
+    size_t i, k, p;
+
+    if (n == 0)
+        return 0;
+
+    wk_space_unrank(sp, idx, digit);
+    if (!checkdups && sp->kernel != NULL)
+        return sp->kernel(sp, digit, n, buf, nrec);
+    if (!checkdups && sp->len > 0)
+        return wk_space_runs(sp, digit, n, buf, nrec);
+
+    if (sp->single) {
+        /* one byte per position: keep the current line and patch what changed */
+        for (i = 0; i < sp->len; i++)
+            cur[i] = sp->pos[i].enc[digit[i]][0];
+
+        for (;;) {
+            if (!checkdups || !wk_space_dupes(sp, digit)) {
+                memcpy(out, cur, sp->len);
+                out[sp->len] = wk_eol;
+                out += sp->len + 1;
+                (*nrec)++;
+            }
+            if (--n == 0)
+                break;
+
+            for (k = 0; k < sp->len; k++) {
+                p = sp->order[k];
+                e = &sp->pos[p];
+                if (++digit[p] < e->radix) {
+                    cur[p] = e->enc[digit[p]][0];
+                    break;
+                }
+                digit[p] = 0;
+                cur[p] = e->enc[0][0];
+            }
+        }
+        return (size_t)(out - buf);
+    }
+
+    for (;;) {
+        if (!checkdups || !wk_space_dupes(sp, digit)) {
+            for (i = 0; i < sp->len; i++) {
+                e = &sp->pos[i];
+                memcpy(out, e->enc[digit[i]], e->elen[digit[i]]);
+                out += e->elen[digit[i]];
+            }
+            *out++ = wk_eol;
+            (*nrec)++;
+        }
+        if (--n == 0)
+            break;
+
+        for (k = 0; k < sp->len; k++) {
+            p = sp->order[k];
+            if (++digit[p] < sp->pos[p].radix)
+                break;
+            digit[p] = 0;
+        }
+    }
+    return (size_t)(out - buf);
+}
+
+static size_t wk_mask_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                           char *buf, size_t *nrec) {
+    const struct wk_mask *mask = src->priv;
+    const struct wk_space *sp;
+    size_t s, len = 0;
+    uint64_t take;
+
+    *nrec = 0;
+    for (s = 0; s < mask->nspaces && n > 0; s++) {
+        sp = &mask->spaces[s];
+        if (first >= sp->count) {
+            first -= sp->count;
+            continue;
+        }
+        take = sp->count - first < n ? sp->count - first : n;
+        len += wk_space_fill(sp, sp->first + first, take, mask->checkdups, buf + len, nrec);
+        n -= take;
+        first = 0;
+    }
+    return len;
+}
+
+void wk_mask_source(struct wk_mask *mask, struct wk_source *src) {
+    size_t s;
+
+    /* exact, the fixed width output format is sized from it */
+    src->total = 0;
+    src->maxrec = 1;
+    for (s = 0; s < mask->nspaces; s++) {
+        src->total += mask->spaces[s].count;
+        if (wk_space_maxrec(&mask->spaces[s]) > src->maxrec)
+            src->maxrec = wk_space_maxrec(&mask->spaces[s]);
+    }
+    src->fill = wk_mask_fill;
+    src->priv = mask;
+}
+
+/* largest record of one space in bytes */
+static size_t wk_space_maxrec(const struct wk_space *sp) {
+    size_t i, k, m, rec = 1;
+
+    if (sp->single)
+        return sp->len + 1;
+    for (i = 0; i < sp->len; i++) {
+        for (k = 0, m = 0; k < sp->pos[i].radix; k++)
+            if (sp->pos[i].elen[k] > m)
+                m = sp->pos[i].elen[k];
+        rec += m;
+    }
+    return rec;
+}
+
+/*
+ * Cut candidates [first, first+count) of the mask source src into one
+ * segment per length, with chunks of about chunkbytes of that length's
+ * records.  Runs of lengths with less than a chunk of output each share a
+ * segment.  segs needs room for mask->nspaces, returns the number used.
+ */
+size_t wk_mask_segments(const struct wk_mask *mask, struct wk_source *src, uint64_t first,
+                        uint64_t count, size_t chunkbytes, struct wk_segment *segs) {
+    struct wk_segment *seg = NULL;
+    const struct wk_space *sp;
+    uint64_t base = 0, lo, hi;
+    size_t s, rec, nsegs = 0;
+    int batch = 0;
+
+    for (s = 0; s < mask->nspaces && count > 0; base += sp->count, s++) {
+        sp = &mask->spaces[s];
+        if (first >= base + sp->count)
+            continue;
+        lo = first;
+        hi = base + sp->count - first < count ? base + sp->count : first + count;
+        rec = wk_space_maxrec(sp);
+
+        if (batch && hi - lo < chunkbytes / rec) {
+            seg->count += hi - lo;
+            if (rec > seg->maxrec)
+                seg->maxrec = rec;
+        } else {
+            seg = &segs[nsegs++];
+            memset(seg, 0, sizeof(*seg));
+            seg->src = src;
+            seg->first = lo;
+            seg->count = hi - lo;
+            seg->maxrec = rec;
+            batch = hi - lo < chunkbytes / rec;
+        }
+        seg->chunk = chunkbytes / seg->maxrec ? chunkbytes / seg->maxrec : 1;
+
+        count -= hi - lo;
+        first = hi;
+    }
+    return nsegs;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _GNU_SOURCE
+#include "wkey.h"
+#include <sched.h>
+
+/*
+ * Worker placement (-a) and output buffers.
+ *
+ * The topology is read from /sys/devices/system/node.  Workers are pinned
+ * to CPUs before they allocate their buffers, and the buffers are touched
+ * by their worker first, so the kernel places them on the worker's node.
+ * A chunk is written to the sink by the worker that generated it, from
+ * that buffer, so the write path stays on the node too.
+ *
+ * Buffers are anonymous mappings advised for transparent huge pages, or
+ * with -g taken from the explicit huge page pool, falling back to normal
+ * pages when the pool is empty.
+ */
+
+#define WK_HUGEPAGE     (2UL << 20)
+
+static int wk_parse_cpulist(const char *s, int *cpus, int max);
+static int wk_read_cpulist(const char *path, int *cpus, int max);
+static int wk_read_nodes(int (*node)[WK_MAXCPUS], int *nnode, int maxnodes);
+
+/* "0-3,8,10-11" into cpus, returns the count or -1 */
+static int wk_parse_cpulist(const char *s, int *cpus, int max) {
+    long a, b;
+    char *end;
+    int n = 0;
+
+    while (*s != '\0' && *s != '\n') {
+        a = strtol(s, &end, 10);
+        if (end == s || a < 0)
+            return -1;
+        b = a;
+        if (*end == '-') {
+            s = end + 1;
+            b = strtol(s, &end, 10);
+            if (end == s || b < a)
+                return -1;
+        }
+        for (; a <= b; a++) {
+            if (a >= CPU_SETSIZE || n == max)
+                return -1;
+            cpus[n++] = (int)a;
+        }
+        s = end;
+        if (*s == ',')
+            s++;
+        else if (*s != '\0' && *s != '\n')
+            return -1;
+    }
+    return n;
+}
+
+static int wk_read_cpulist(const char *path, int *cpus, int max) {
+    char line[4096];
+    FILE *fp;
+    int n = -1;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    if (fgets(line, sizeof(line), fp) != NULL)
+        n = wk_parse_cpulist(line, cpus, max);
+    (void)fclose(fp);
+    return n;
+}
+
+/* cpus of every node, one node of all online cpus without NUMA support */
+static int wk_read_nodes(int (*node)[WK_MAXCPUS], int *nnode, int maxnodes) {
+    char path[64];
+    int nodes = 0, id, n;
+
+    for (id = 0; id < 1024 && nodes < maxnodes; id++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        if (access(path, R_OK) != 0)
+            continue;
+        n = wk_read_cpulist(path, node[nodes], WK_MAXCPUS);
+        if (n > 0)
+            nnode[nodes++] = n;
+    }
+    if (nodes == 0) {
+        n = wk_read_cpulist("/sys/devices/system/cpu/online", node[0], WK_MAXCPUS);
+        if (n <= 0) {
+            for (n = 0; n < sysconf(_SC_NPROCESSORS_ONLN) && n < WK_MAXCPUS; n++)
+                node[0][n] = n;
+        }
+        nnode[0] = n;
+        nodes = 1;
+    }
+    return nodes;
+}
+
+/*
+ * spec is "spread" (workers round robin over the nodes), "compact" (fill
+ * a node before the next) or a cpu list such as 0-7,16-23.
+ */
+int wk_placement_parse(const char *spec, struct wk_placement *pl) {
+    static int node[WK_MAXNODES][WK_MAXCPUS];
+    int nnode[WK_MAXNODES];
+    int nodes, i, j, more;
+
+    pl->ncpus = 0;
+    if (strcmp(spec, "spread") == 0 || strcmp(spec, "compact") == 0) {
+        nodes = wk_read_nodes(node, nnode, WK_MAXNODES);
+        if (spec[0] == 'c') {
+            for (i = 0; i < nodes; i++)
+                for (j = 0; j < nnode[i]; j++)
+                    pl->cpu[pl->ncpus++] = node[i][j];
+        } else {
+            for (j = 0, more = 1; more; j++) {
+                for (i = 0, more = 0; i < nodes; i++) {
+                    if (j < nnode[i]) {
+                        pl->cpu[pl->ncpus++] = node[i][j];
+                        more = 1;
+                    }
+                }
+            }
+        }
+    } else if ((pl->ncpus = wk_parse_cpulist(spec, pl->cpu, WK_MAXCPUS)) <= 0) {
+        fprintf(stderr,"-a must be spread, compact or a cpu list such as 0-3,8\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* pin the calling thread, worker t, to its cpu */
+int wk_placement_bind(const struct wk_placement *pl, int t) {
+    cpu_set_t set;
+    int rc;
+
+    if (pl == NULL || pl->ncpus == 0)
+        return 0;
+    CPU_ZERO(&set);
+    CPU_SET(pl->cpu[t % pl->ncpus], &set);
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+        fprintf(stderr,"pool: can't pin worker %d to cpu %d: %s\n", t,
+                pl->cpu[t % pl->ncpus], strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+/* nodes, where the workers run and what backs their buffers, to stderr */
+void wk_placement_report(const struct wk_placement *pl, int nthreads) {
+    static int node[WK_MAXNODES][WK_MAXCPUS];
+    int nnode[WK_MAXNODES];
+    char thp[128] = "unavailable";
+    FILE *fp;
+    int nodes, i, j, t, cpu;
+
+    nodes = wk_read_nodes(node, nnode, WK_MAXNODES);
+    fprintf(stderr, "Topology: %d node%s\n", nodes, nodes == 1 ? "" : "s");
+    for (i = 0; i < nodes; i++) {
+        fprintf(stderr, "  node %d: %d cpus\n", i, nnode[i]);
+    }
+
+    for (t = 0; t < nthreads; t++) {
+        if (pl->ncpus == 0) {
+            fprintf(stderr, "  worker %d: not pinned\n", t);
+            continue;
+        }
+        cpu = pl->cpu[t % pl->ncpus];
+        for (i = 0; i < nodes; i++) {
+            for (j = 0; j < nnode[i] && node[i][j] != cpu; j++)
+                ;
+            if (j < nnode[i])
+                break;
+        }
+        if (i < nodes)
+            fprintf(stderr, "  worker %d: cpu %d, node %d\n", t, cpu, i);
+        else
+            fprintf(stderr, "  worker %d: cpu %d, no node\n", t, cpu);
+    }
+
+    if ((fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r")) != NULL) {
+        if (fgets(thp, sizeof(thp), fp) != NULL)
+            thp[strcspn(thp, "\n")] = '\0';
+        (void)fclose(fp);
+    }
+    fprintf(stderr, "  buffers: %s, transparent huge pages %s\n\n",
+            pl->huge ? "explicit huge pages" : "node local", thp);
+}
+
+/* output buffer of at least size bytes, first touched by the caller */
+void *wk_buf_alloc(const struct wk_placement *pl, size_t size, size_t *mapped) {
+    void *p = MAP_FAILED;
+    size_t len;
+
+    if (pl != NULL && pl->huge) {
+        len = (size + WK_HUGEPAGE - 1) & ~(WK_HUGEPAGE - 1);
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+        len = size;
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        if (len >= WK_HUGEPAGE)
+            (void)madvise(p, len, MADV_HUGEPAGE);
+    }
+    /* fault the pages in on this thread's node */
+    memset(p, 0, len);
+    *mapped = len;
+    return p;
+}
+
+void wk_buf_free(void *p, size_t mapped) {
+    if (p != NULL)
+        (void)munmap(p, mapped);
+}
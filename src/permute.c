@@ -0,0 +1,303 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Permute mode (-p/-q) and its k of n forms (-A, -C).  Candidates are the
+ * chosen words concatenated, for every k of the range in turn, each k in
+ * lexicographic order of the (sorted) word indexes:
+ *
+ *   arrangements  ordered picks of k distinct words, k = n is plain permute
+ *   combinations  unordered picks, indexes increasing
+ *
+ * Index i of an arrangement is its Lehmer code, digit j counting in base
+ * n-j which of the words not picked yet comes next.  Index i of a
+ * combination is its rank in the combinatorial number system.  A chunk
+ * unranks its first candidate once and steps to the next one in place.
+ */
+
+struct wk_permk {
+    size_t k;
+    uint64_t count, cum;                /* cum counts the candidates of smaller k */
+};
+
+struct wk_permute {
+    const struct wk_words *words;
+    size_t n;
+    int mode;                           /* WK_PERM_ARRANGE or WK_PERM_COMBINE */
+    struct wk_permk *ks;
+    size_t nk;
+};
+
+static int wk_binom(uint64_t n, uint64_t k, uint64_t *r);
+static size_t wk_nth_unused(const size_t *sorted, size_t nused, size_t d);
+static void wk_arr_place(size_t k, const size_t *digit, size_t from, size_t *elem,
+                         size_t *sorted);
+static void wk_arr_unrank(const struct wk_permute *pm, size_t k, uint64_t idx, size_t *digit);
+static int wk_perm_next(size_t *perm, size_t n);
+static void wk_comb_unrank(const struct wk_permute *pm, size_t k, uint64_t idx, size_t *elem);
+static int wk_comb_next(size_t *elem, size_t k, size_t n);
+static size_t wk_permk_fill(const struct wk_permute *pm, size_t k, uint64_t idx, uint64_t n,
+                            char *buf, size_t *nrec);
+static size_t wk_perm_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                           char *buf, size_t *nrec);
+
+/* n choose k, -1 if it doesn't fit in 64 bits */
+static int wk_binom(uint64_t n, uint64_t k, uint64_t *r) {
+    unsigned __int128 c = 1;
+    uint64_t i;
+
+    if (k > n) {
+        *r = 0;
+        return 0;
+    }
+    if (k > n - k)
+        k = n - k;
+    for (i = 0; i < k; i++) {
+        c = c * (n - i) / (i + 1);
+        if (c > UINT64_MAX)
+            return -1;
+    }
+    *r = (uint64_t)c;
+    return 0;
+}
+
+/* the d-th (from 0) index not in the nused sorted indexes */
+static size_t wk_nth_unused(const size_t *sorted, size_t nused, size_t d) {
+    size_t i;
+
+    for (i = 0; i < nused && sorted[i] <= d; i++)
+        d++;
+    return d;
+}
+
+/* words of positions from..k-1 of an arrangement, sorted[] holds the picks before from */
+static void wk_arr_place(size_t k, const size_t *digit, size_t from, size_t *elem,
+                         size_t *sorted) {
+    size_t i, j;
+
+    for (i = from; i < k; i++) {
+        elem[i] = wk_nth_unused(sorted, i, digit[i]);
+        for (j = i; j > 0 && sorted[j-1] > elem[i]; j--)
+            sorted[j] = sorted[j-1];
+        sorted[j] = elem[i];
+    }
+}
+
+/* Lehmer digits, digit j in base n-j, the last one least significant */
+static void wk_arr_unrank(const struct wk_permute *pm, size_t k, uint64_t idx, size_t *digit) {
+    size_t j;
+
+    for (j = k; j > 0; j--) {
+        digit[j-1] = (size_t)(idx % (pm->n - (j-1)));
+        idx /= pm->n - (j-1);
+    }
+}
+
+/* next permutation in lexicographic order, 0 after the last one */
+static int wk_perm_next(size_t *perm, size_t n) {
+    size_t i, j, t;
+
+    if (n < 2)
+        return 0;
+    for (i = n - 1; i > 0 && perm[i-1] > perm[i]; i--)
+        ;
+    if (i == 0)
+        return 0;
+    for (j = n - 1; perm[j] < perm[i-1]; j--)
+        ;
+    t = perm[i-1];
+    perm[i-1] = perm[j];
+    perm[j] = t;
+    for (j = n - 1; i < j; i++, j--) {
+        t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+    return 1;
+}
+
+/*
+ * Position j takes the smallest x whose combinations cover idx.  The
+ * combinations with elem[j] in (prev, x] number C(n-1-prev, m+1) -
+ * C(n-1-x, m+1) with m = k-1-j, so x is found by binary search.
+ */
+static void wk_comb_unrank(const struct wk_permute *pm, size_t k, uint64_t idx, size_t *elem) {
+    uint64_t all, rest, below;
+    size_t j, lo, hi, mid, m, start = 0;
+
+    for (j = 0; j < k; j++) {
+        m = k - 1 - j;
+        (void)wk_binom(pm->n - start, m + 1, &all);
+        lo = start;
+        hi = pm->n - 1 - m;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            (void)wk_binom(pm->n - 1 - mid, m + 1, &rest);
+            if (all - rest > idx)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        elem[j] = lo;
+        (void)wk_binom(pm->n - lo, m + 1, &below);
+        idx -= all - below;
+        start = lo + 1;
+    }
+}
+
+static int wk_comb_next(size_t *elem, size_t k, size_t n) {
+    size_t i, j;
+
+    for (i = k; i > 0 && elem[i-1] == n - k + i - 1; i--)
+        ;
+    if (i == 0)
+        return 0;
+    elem[i-1]++;
+    for (j = i; j < k; j++)
+        elem[j] = elem[j-1] + 1;
+    return 1;
+}
+
+/* candidates [idx, idx+n) of one k */
+static size_t wk_permk_fill(const struct wk_permute *pm, size_t k, uint64_t idx, uint64_t n,
+                            char *buf, size_t *nrec) {
+    const struct wk_words *w = pm->words;
+    size_t elem[MAXSTRING], digit[MAXSTRING], sorted[MAXSTRING];
+    char *out = buf;
+    size_t i, j, c;
+
+    if (pm->mode == WK_PERM_COMBINE) {
+        wk_comb_unrank(pm, k, idx, elem);
+    } else {
+        wk_arr_unrank(pm, k, idx, digit);
+        wk_arr_place(k, digit, 0, elem, sorted);
+    }
+
+    for (;;) {
+        for (i = 0; i < k; i++) {
+            memcpy(out, w->arena + w->off[elem[i]], w->len[elem[i]]);
+            out += w->len[elem[i]];
+        }
+        *out++ = wk_eol;
+        (*nrec)++;
+        if (--n == 0)
+            break;
+
+        if (pm->mode == WK_PERM_COMBINE) {
+            (void)wk_comb_next(elem, k, pm->n);
+        } else if (k == pm->n) {
+            (void)wk_perm_next(elem, k);
+        } else {
+            for (c = k; c > 0; c--) {
+                if (++digit[c-1] < pm->n - (c-1))
+                    break;
+                digit[c-1] = 0;
+            }
+            /* the picks before the changed position, sorted */
+            for (i = 0; i + 1 < c; i++) {
+                for (j = i; j > 0 && sorted[j-1] > elem[i]; j--)
+                    sorted[j] = sorted[j-1];
+                sorted[j] = elem[i];
+            }
+            wk_arr_place(k, digit, c - 1, elem, sorted);
+        }
+    }
+    return (size_t)(out - buf);
+}
+
+static size_t wk_perm_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                           char *buf, size_t *nrec) {
+    const struct wk_permute *pm = src->priv;
+    size_t s, len = 0;
+    uint64_t take;
+
+    *nrec = 0;
+    for (s = 0; s < pm->nk && n > 0; s++) {
+        if (first >= pm->ks[s].cum + pm->ks[s].count)
+            continue;
+        take = pm->ks[s].cum + pm->ks[s].count - first;
+        if (take > n)
+            take = n;
+        len += wk_permk_fill(pm, pm->ks[s].k, first - pm->ks[s].cum, take, buf + len, nrec);
+        first += take;
+        n -= take;
+    }
+    return len;
+}
+
+/* every arrangement or combination of kmin..kmax of the words */
+int wk_permute_source(const struct wk_words *words, int mode, size_t kmin, size_t kmax,
+                      struct wk_source *src) {
+    struct wk_permute *pm;
+    uint64_t total = 0, cnt;
+    size_t k, i;
+
+    if (words->n == 0) {
+        fprintf(stderr,"permute: nothing to permute\n");
+        return -1;
+    }
+    if (kmin < 1 || kmax < kmin || kmax > words->n || kmax > MAXSTRING) {
+        fprintf(stderr,"permute: k must be between 1 and the number of words (%lu)\n",
+                (unsigned long)words->n);
+        return -1;
+    }
+
+    pm = calloc(1, sizeof(*pm));
+    if (pm != NULL)
+        pm->ks = calloc(kmax - kmin + 1, sizeof(*pm->ks));
+    if (pm == NULL || pm->ks == NULL) {
+        fprintf(stderr,"permute: can't allocate memory\n");
+        free(pm);
+        return -1;
+    }
+    pm->words = words;
+    pm->n = words->n;
+    pm->mode = mode;
+
+    for (k = kmin; k <= kmax; k++) {
+        if (mode == WK_PERM_COMBINE) {
+            if (wk_binom(pm->n, k, &cnt) == -1)
+                goto overflow;
+        } else {
+            for (cnt = 1, i = 0; i < k; i++) {
+                if (cnt > UINT64_MAX / (pm->n - i))
+                    goto overflow;
+                cnt *= pm->n - i;
+            }
+        }
+        if (total > UINT64_MAX - cnt)
+            goto overflow;
+        pm->ks[pm->nk].k = k;
+        pm->ks[pm->nk].count = cnt;
+        pm->ks[pm->nk].cum = total;
+        pm->nk++;
+        total += cnt;
+    }
+
+    src->total = total;
+    src->maxrec = words->maxlen * kmax + 1;
+    src->fill = wk_perm_fill;
+    src->priv = pm;
+    return 0;
+
+overflow:
+    fprintf(stderr,"permute: %lu of %lu words have more than 2^64 candidates\n",
+            (unsigned long)k, (unsigned long)pm->n);
+    free(pm->ks);
+    free(pm);
+    return -1;
+}
@@ -0,0 +1,351 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Worker pool.  The segments are cut into chunks numbered in output order,
+ * every worker takes the next chunk, generates it into its own buffer and
+ * then waits for its turn to hand the buffer to the sink.  Generation runs
+ * in parallel while the output stays in the same order as a single thread.
+ * The turn is what keeps the sink to one writer, the lock is not held
+ * while it writes so a slow sink doesn't hold up the other workers.
+ * Filtering, the binary output formats and the compression of seekable
+ * output are applied in the workers too.
+ * Workers are pinned by the placement before they allocate their buffers.
+ */
+struct wk_pool {
+    struct wk_segment *segs;
+    size_t nsegs;
+    uint64_t *segchunk;         /* first chunk of every segment, nsegs+1 entries */
+    size_t bufsize;
+    size_t obufsize;            /* filter output, 0 without a filter */
+    size_t ebufsize;            /* binary records, 0 for the text formats */
+    size_t zbufsize;            /* seekable frames, 0 without --seekable */
+    struct wk_sink *sink;
+    const struct wk_placement *place;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t next;              /* next chunk to generate */
+    uint64_t written;           /* next chunk to write */
+    int stop;
+    int error;
+};
+
+struct wk_worker {
+    struct wk_pool *pool;
+    int id;
+};
+
+static size_t wk_seg_maxrec(const struct wk_segment *seg);
+static uint64_t wk_seg_chunk(const struct wk_pool *pool, const struct wk_segment *seg);
+static size_t wk_find_segment(const struct wk_pool *pool, uint64_t c);
+static void *wk_pool_worker(void *arg);
+
+static size_t wk_seg_maxrec(const struct wk_segment *seg) {
+    return seg->maxrec ? seg->maxrec : seg->src->maxrec;
+}
+
+/* a filter that turns one line into many gets proportionally fewer per chunk */
+static uint64_t wk_seg_chunk(const struct wk_pool *pool, const struct wk_segment *seg) {
+    const struct wk_filter *filter = pool->sink->filter;
+    uint64_t chunk = seg->chunk;
+
+    if (chunk == 0)
+        chunk = WK_CHUNKBYTES / wk_seg_maxrec(seg);
+    if (filter != NULL && filter->mult > 1)
+        chunk /= filter->mult;
+    return chunk ? chunk : 1;
+}
+
+static size_t wk_find_segment(const struct wk_pool *pool, uint64_t c) {
+    size_t lo = 0, hi = pool->nsegs - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (pool->segchunk[mid] <= c)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+static void *wk_pool_worker(void *arg) {
+    struct wk_worker *w = arg;
+    struct wk_pool *pool = w->pool;
+    struct wk_segment *seg;
+    const struct wk_filter *filter = pool->sink->filter;
+    struct wk_wstats *st = pool->sink->stats ? &pool->sink->stats->w[w->id] : NULL;
+    char *buf, *obuf = NULL, *ebuf = NULL, *zbuf = NULL, *out;
+    struct wk_framer *fr = NULL;
+    struct wk_frame frame;
+    uint64_t c, chunk, first, n, t0 = 0;
+    size_t s, len, zlen = 0, nrec, nrec0, bufmap = 0, obufmap = 0, ebufmap = 0, zbufmap = 0;
+    int rc;
+
+    (void)wk_placement_bind(pool->place, w->id);
+    buf = wk_buf_alloc(pool->place, pool->bufsize, &bufmap);
+    if (filter != NULL)
+        obuf = wk_buf_alloc(pool->place, pool->obufsize, &obufmap);
+    if (pool->ebufsize > 0)
+        ebuf = wk_buf_alloc(pool->place, pool->ebufsize, &ebufmap);
+    if (pool->zbufsize > 0) {
+        zbuf = wk_buf_alloc(pool->place, pool->zbufsize, &zbufmap);
+        fr = wk_framer_new();
+    }
+    if (buf == NULL || (filter != NULL && obuf == NULL) || (pool->ebufsize > 0 && ebuf == NULL)
+        || (pool->zbufsize > 0 && (zbuf == NULL || fr == NULL))) {
+        wk_buf_free(buf, bufmap);
+        wk_buf_free(obuf, obufmap);
+        wk_buf_free(ebuf, ebufmap);
+        wk_buf_free(zbuf, zbufmap);
+        wk_framer_free(fr);
+        fprintf(stderr,"pool: can't allocate memory for output buffer\n");
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = pool->error = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->stop || pool->next >= pool->segchunk[pool->nsegs]) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        c = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        s = wk_find_segment(pool, c);
+        seg = &pool->segs[s];
+        chunk = wk_seg_chunk(pool, seg);
+        first = (c - pool->segchunk[s]) * chunk;
+        n = seg->count - first < chunk ? seg->count - first : chunk;
+
+        WK_PROBE2(gen_start, w->id, c);
+        if (st != NULL)
+            t0 = wk_now_ns();
+        nrec = 0;
+        len = n ? seg->src->fill(seg->src, seg->first + first, n, buf, &nrec) : 0;
+        if (st != NULL) {
+            st->gen_ns += wk_now_ns() - t0;
+            st->cands += n;
+            st->rejected += n - nrec;
+        }
+        if (len == NPOS) {
+            pthread_mutex_lock(&pool->lock);
+            pool->stop = pool->error = 1;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        WK_PROBE4(gen_done, w->id, c, nrec, len);
+
+        out = buf;
+        if (filter != NULL && len > 0) {
+            nrec0 = nrec;
+            if (st != NULL)
+                t0 = wk_now_ns();
+            len = filter->run(filter, buf, len, obuf, &nrec);
+            out = obuf;
+            if (st != NULL) {
+                st->filter_ns += wk_now_ns() - t0;
+                st->filtered += nrec0 > nrec ? nrec0 - nrec : 0;
+            }
+            WK_PROBE4(filter_done, w->id, c, nrec, len);
+        }
+        if (ebuf != NULL && len > 0) {
+            if (st != NULL)
+                t0 = wk_now_ns();
+            len = wk_sink_encode(pool->sink, out, len, ebuf);
+            out = ebuf;
+            if (st != NULL)
+                st->encode_ns += wk_now_ns() - t0;
+            if (len == NPOS) {
+                fprintf(stderr,"pool: a record is longer than the fixed width %lu\n",
+                        (unsigned long)pool->sink->width);
+                pthread_mutex_lock(&pool->lock);
+                pool->stop = pool->error = 1;
+                pthread_cond_broadcast(&pool->cond);
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+        }
+
+        if (fr != NULL && len > 0) {
+            frame.first = seg->first + first;
+            frame.ncand = n;
+            frame.nrec = nrec;
+            if (st != NULL)
+                t0 = wk_now_ns();
+            zlen = wk_frame_pack(fr, out, len, frame.first, n, nrec, zbuf);
+            if (st != NULL)
+                st->compress_ns += wk_now_ns() - t0;
+            if (zlen == 0) {
+                fprintf(stderr,"pool: can't compress a frame\n");
+                pthread_mutex_lock(&pool->lock);
+                pool->stop = pool->error = 1;
+                pthread_cond_broadcast(&pool->cond);
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (st != NULL) {
+            t0 = wk_now_ns();
+            st->stalls += pool->written != c;
+        }
+        while (pool->written != c && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (st != NULL) {
+            st->chunks++;
+            st->wait_ns += wk_now_ns() - t0;
+        }
+        if (!pool->stop) {
+            /* no other worker writes before written moves on, dispatch goes on meanwhile */
+            pthread_mutex_unlock(&pool->lock);
+            WK_PROBE2(write_start, w->id, c);
+            if (st != NULL)
+                t0 = wk_now_ns();
+            rc = 0;
+            if (fr != NULL ? len > 0 && wk_sink_frame(pool->sink, zbuf, zlen, out, len, &frame) == -1
+                           : wk_sink_write(pool->sink, out, len, nrec) == -1)
+                rc = pool->sink->broken ? 1 : -1;
+            else if (c + 1 == pool->segchunk[s+1] && seg->done != NULL && seg->done(seg, pool->sink) == -1)
+                rc = -1;
+            if (st != NULL) {
+                st->write_ns += wk_now_ns() - t0;
+                st->records += nrec;
+                st->bytes += len;
+            }
+            WK_PROBE4(write_done, w->id, c, nrec, len);
+            pthread_mutex_lock(&pool->lock);
+            if (rc != 0) {
+                pool->stop = 1;
+                pool->error |= rc == -1;
+            }
+            pool->written++;
+        }
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    wk_buf_free(buf, bufmap);
+    wk_buf_free(obuf, obufmap);
+    wk_buf_free(ebuf, ebufmap);
+    wk_buf_free(zbuf, zbufmap);
+    wk_framer_free(fr);
+    return NULL;
+}
+
+/* generate every segment in order to the sink, returns -1 on error */
+int wk_pool_run(struct wk_segment *segs, size_t nsegs, struct wk_sink *sink, int nthreads,
+                const struct wk_placement *place) {
+    struct wk_pool pool;
+    struct wk_worker workers[WK_MAXTHREADS];
+    pthread_t tid[WK_MAXTHREADS];
+    uint64_t chunk, nchunks;
+    size_t s, obufsize = 0, ebufsize;
+    int t, started;
+
+    if (nsegs == 0)
+        return 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.segs = segs;
+    pool.nsegs = nsegs;
+    pool.sink = sink;
+    pool.place = place;
+    pool.segchunk = calloc(nsegs+1, sizeof(uint64_t));
+    if (pool.segchunk == NULL) {
+        fprintf(stderr,"pool: can't allocate memory for segments\n");
+        return -1;
+    }
+
+    /* an empty segment still gets one chunk so its done callback runs */
+    for (s = 0; s < nsegs; s++) {
+        chunk = wk_seg_chunk(&pool, &segs[s]);
+        nchunks = segs[s].count / chunk + (segs[s].count % chunk != 0);
+        pool.segchunk[s+1] = pool.segchunk[s] + (nchunks ? nchunks : 1);
+        if (chunk * wk_seg_maxrec(&segs[s]) > pool.bufsize)
+            pool.bufsize = chunk * wk_seg_maxrec(&segs[s]);
+        if (sink->filter != NULL) {
+            obufsize = chunk * ((sink->filter->mult > 1 ? sink->filter->mult : 1)
+                                * wk_seg_maxrec(&segs[s]) + sink->filter->extra);
+            if (obufsize > pool.obufsize)
+                pool.obufsize = obufsize;
+        }
+        if (sink->format >= WK_FMT_VARINT) {
+            ebufsize = wk_sink_encbound(sink, sink->filter ? obufsize : chunk * wk_seg_maxrec(&segs[s]),
+                                        chunk * (sink->filter && sink->filter->mult > 1
+                                                 ? sink->filter->mult : 1));
+            if (ebufsize > pool.ebufsize)
+                pool.ebufsize = ebufsize;
+        }
+        if (sink->seekable) {
+            obufsize = wk_frame_bound(sink->filter ? obufsize : chunk * wk_seg_maxrec(&segs[s]));
+            if (obufsize > pool.zbufsize)
+                pool.zbufsize = obufsize;
+        }
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > WK_MAXTHREADS)
+        nthreads = WK_MAXTHREADS;
+
+    /* -m, bfc lease and autotune run the pool several times on one set of counters */
+    if (sink->stats != NULL) {
+        if (nthreads > sink->stats->nthreads)
+            sink->stats->nthreads = nthreads;
+        if (sink->stats->start_ns == 0)
+            sink->stats->start_ns = wk_now_ns();
+    }
+    for (t = 0; t < nthreads; t++) {
+        workers[t].pool = &pool;
+        workers[t].id = t;
+    }
+
+    if (nthreads == 1) {
+        wk_pool_worker(&workers[0]);
+    } else {
+        for (t = 0, started = 0; t < nthreads; t++) {
+            if (pthread_create(&tid[t], NULL, wk_pool_worker, &workers[t]) != 0) {
+                fprintf(stderr,"pool: can't create worker thread\n");
+                break;
+            }
+            started++;
+        }
+        if (started == 0)
+            wk_pool_worker(&workers[0]);
+        for (t = 0; t < started; t++)
+            pthread_join(tid[t], NULL);
+    }
+
+    if (sink->stats != NULL)
+        sink->stats->end_ns = wk_now_ns();
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.segchunk);
+
+    return pool.error ? -1 : 0;
+}
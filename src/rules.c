@@ -0,0 +1,532 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Word mangling rules (--rules, --word-rules), the hashcat rule syntax for
+ * the functions below.  A rule file has one rule per line, every line
+ * applied to every candidate in file order.  Blank lines and lines
+ * starting with # are skipped, spaces between functions are ignored.
+ *
+ *   :        nothing                 l u t    lower, upper, toggle case
+ *   c C      capitalize, invert it   TN       toggle case at N
+ *   r        reverse                 d f q    duplicate, reflect, double chars
+ *   { }      rotate left, right      $X ^X    append, prepend X
+ *   [ ]      delete first, last      DN 'N    delete at N, truncate at N
+ *   iNX oNX  insert, overwrite X     sXY @X   replace X with Y, purge X
+ *   zN ZN    repeat first, last N    <N >N    reject unless shorter, longer
+ *   !X /X    reject if X is in the word, unless X is in it
+ *
+ * N is 0-9 or A-Z for 10-35.  Case works on ASCII letters.  Runs of the
+ * byte to byte functions (l u t s) are folded into one 256 entry table
+ * when the rule is compiled, so they cost one pass over the word.
+ * Mangled words that come out empty or longer than the line limit are
+ * dropped.
+ */
+
+#define WK_RULE_MAXLINE     (MAXSTRING * WK_MBMAX)
+#define WK_ROP_MAP          'M'         /* folded byte table, a indexes maps */
+
+struct wk_rop {
+    unsigned char op, a, b;
+};
+
+struct wk_rule {
+    struct wk_rop *ops;
+    size_t nops;
+};
+
+struct wk_rules {
+    struct wk_rule *rules;
+    size_t n;
+    unsigned char (*maps)[256];
+    size_t nmaps;
+};
+
+static int wk_rule_pos(unsigned char c);
+static int wk_rule_ismap(unsigned char op);
+static void wk_rule_map(unsigned char *map, const struct wk_rop *o);
+static int wk_rule_compile(struct wk_rules *rs, const char *line, const char *filename,
+                           unsigned long lineno, size_t *mult, size_t *grow);
+static size_t wk_rule_apply(const struct wk_rules *rs, const struct wk_rule *rule,
+                            const char *in, size_t len, char *out);
+static size_t wk_rules_run(const struct wk_filter *f, const char *in, size_t len,
+                           char *out, size_t *nrec);
+static int wk_word_cmp(const void *a, const void *b);
+
+static const struct wk_words *wk_sort_words;
+
+/* position argument, -1 if c isn't one */
+static int wk_rule_pos(unsigned char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int wk_rule_ismap(unsigned char op) {
+    return op == 'l' || op == 'u' || op == 't' || op == 's';
+}
+
+/* apply one byte to byte function to every entry of map */
+static void wk_rule_map(unsigned char *map, const struct wk_rop *o) {
+    size_t i;
+
+    for (i = 0; i < 256; i++) {
+        switch (o->op) {
+        case 'l':
+            if (map[i] >= 'A' && map[i] <= 'Z')
+                map[i] |= 0x20;
+            break;
+        case 'u':
+            if (map[i] >= 'a' && map[i] <= 'z')
+                map[i] &= ~0x20;
+            break;
+        case 't':
+            if ((map[i] | 0x20) >= 'a' && (map[i] | 0x20) <= 'z')
+                map[i] ^= 0x20;
+            break;
+        case 's':
+            if (map[i] == o->a)
+                map[i] = o->b;
+            break;
+        }
+    }
+}
+
+/*
+ * Compile one line into rs.  The longest result is at most mult times the
+ * word plus grow bytes, both are raised to cover this rule.
+ */
+static int wk_rule_compile(struct wk_rules *rs, const char *line, const char *filename,
+                           unsigned long lineno, size_t *mult, size_t *grow) {
+    struct wk_rule *rule;
+    struct wk_rop *o, *ops;
+    const unsigned char *p = (const unsigned char *)line;
+    size_t m = 1, g = 0, nargs, k;
+    void *tmp;
+    unsigned char (*maps)[256];
+
+    ops = calloc(strlen(line) + 1, sizeof(*ops));
+    tmp = realloc(rs->rules, (rs->n + 1) * sizeof(*rs->rules));
+    if (ops == NULL || tmp == NULL) {
+        free(ops);
+        fprintf(stderr,"rules: can't allocate memory\n");
+        return -1;
+    }
+    rs->rules = tmp;
+    rule = &rs->rules[rs->n];
+    rule->ops = ops;
+    rule->nops = 0;
+
+    while (*p != '\0') {
+        if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        o = &ops[rule->nops];
+        o->op = *p++;
+        switch (o->op) {
+        case ':': case 'l': case 'u': case 't': case 'c': case 'C': case 'r':
+        case '{': case '}': case '[': case ']':
+            nargs = 0;
+            break;
+        case 'd': case 'f': case 'q':
+            nargs = 0;
+            m *= 2;
+            g *= 2;
+            break;
+        case '$': case '^': case '@': case '!': case '/':
+        case 'T': case 'D': case '\'': case '<': case '>': case 'z': case 'Z':
+            nargs = 1;
+            break;
+        case 's': case 'i': case 'o':
+            nargs = 2;
+            break;
+        default:
+            fprintf(stderr,"%s:%lu: unknown rule function %c\n", filename, lineno, o->op);
+            return -1;
+        }
+        for (k = 0; k < nargs; k++) {
+            if (*p == '\0') {
+                fprintf(stderr,"%s:%lu: rule function %c needs %lu argument%s\n", filename,
+                        lineno, o->op, (unsigned long)nargs, nargs == 1 ? "" : "s");
+                return -1;
+            }
+            if (k == 0)
+                o->a = *p++;
+            else
+                o->b = *p++;
+        }
+        /* the argument of these is a position */
+        if (strchr("TD'<>zZio", o->op) != NULL) {
+            if (wk_rule_pos(o->a) == -1) {
+                fprintf(stderr,"%s:%lu: %c needs a position 0-9 or A-Z\n", filename, lineno, o->op);
+                return -1;
+            }
+            o->a = (unsigned char)wk_rule_pos(o->a);
+        }
+        if (o->op == '$' || o->op == '^' || o->op == 'i')
+            g++;
+        if (o->op == 'z' || o->op == 'Z')
+            g += o->a;
+
+        /* fold l u t s into the table of the map before them */
+        if (wk_rule_ismap(o->op)) {
+            if (rule->nops == 0 || ops[rule->nops-1].op != WK_ROP_MAP) {
+                if (rs->nmaps == 0x10000) {
+                    fprintf(stderr,"%s: too many rules\n", filename);
+                    return -1;
+                }
+                maps = realloc(rs->maps, (rs->nmaps + 1) * sizeof(*rs->maps));
+                if (maps == NULL) {
+                    fprintf(stderr,"rules: can't allocate memory\n");
+                    return -1;
+                }
+                rs->maps = maps;
+                for (k = 0; k < 256; k++)
+                    rs->maps[rs->nmaps][k] = (unsigned char)k;
+                wk_rule_map(rs->maps[rs->nmaps], o);
+                /* the table index is kept in a (low byte) and b */
+                o->op = WK_ROP_MAP;
+                o->a = (unsigned char)(rs->nmaps & 0xff);
+                o->b = (unsigned char)(rs->nmaps >> 8);
+                rs->nmaps++;
+            } else {
+                o = &ops[rule->nops-1];
+                wk_rule_map(rs->maps[o->a | (size_t)o->b << 8], &ops[rule->nops]);
+                continue;
+            }
+        }
+        rule->nops++;
+    }
+
+    rs->n++;
+    if (m > *mult)
+        *mult = m;
+    if (g > *grow)
+        *grow = g;
+    return 0;
+}
+
+/* mangle the len bytes of in into out, returns the new length or 0 to drop the word */
+static size_t wk_rule_apply(const struct wk_rules *rs, const struct wk_rule *rule,
+                            const char *in, size_t len, char *out) {
+    unsigned char *w = (unsigned char *)out;
+    const unsigned char *map;
+    const struct wk_rop *o;
+    size_t n = len, i, j, k;
+    unsigned char t;
+
+    if (n > WK_RULE_MAXLINE)
+        return 0;
+    memcpy(w, in, n);
+
+    for (k = 0; k < rule->nops; k++) {
+        o = &rule->ops[k];
+        switch (o->op) {
+        case ':':
+            break;
+        case WK_ROP_MAP:
+            map = rs->maps[o->a | (size_t)o->b << 8];
+            for (i = 0; i < n; i++)
+                w[i] = map[w[i]];
+            break;
+        case 'c':
+        case 'C':
+            for (i = 0; i < n; i++) {
+                if ((i == 0) == (o->op == 'c')) {
+                    if (w[i] >= 'a' && w[i] <= 'z')
+                        w[i] &= ~0x20;
+                } else if (w[i] >= 'A' && w[i] <= 'Z') {
+                    w[i] |= 0x20;
+                }
+            }
+            break;
+        case 'T':
+            if (o->a < n && (w[o->a] | 0x20) >= 'a' && (w[o->a] | 0x20) <= 'z')
+                w[o->a] ^= 0x20;
+            break;
+        case 'r':
+            for (i = 0, j = n; i + 1 < j; i++, j--) {
+                t = w[i];
+                w[i] = w[j-1];
+                w[j-1] = t;
+            }
+            break;
+        case 'd':
+            if (2 * n > WK_RULE_MAXLINE)
+                return 0;
+            memcpy(w + n, w, n);
+            n *= 2;
+            break;
+        case 'f':
+            if (2 * n > WK_RULE_MAXLINE)
+                return 0;
+            for (i = 0; i < n; i++)
+                w[n + i] = w[n - 1 - i];
+            n *= 2;
+            break;
+        case 'q':
+            if (2 * n > WK_RULE_MAXLINE)
+                return 0;
+            for (i = n; i > 0; i--)
+                w[2*i-1] = w[2*i-2] = w[i-1];
+            n *= 2;
+            break;
+        case '{':
+            if (n > 1) {
+                t = w[0];
+                memmove(w, w + 1, n - 1);
+                w[n-1] = t;
+            }
+            break;
+        case '}':
+            if (n > 1) {
+                t = w[n-1];
+                memmove(w + 1, w, n - 1);
+                w[0] = t;
+            }
+            break;
+        case '$':
+            if (n == WK_RULE_MAXLINE)
+                return 0;
+            w[n++] = o->a;
+            break;
+        case '^':
+            if (n == WK_RULE_MAXLINE)
+                return 0;
+            memmove(w + 1, w, n++);
+            w[0] = o->a;
+            break;
+        case '[':
+            if (n > 0)
+                memmove(w, w + 1, --n);
+            break;
+        case ']':
+            if (n > 0)
+                n--;
+            break;
+        case 'D':
+            if (o->a < n) {
+                memmove(w + o->a, w + o->a + 1, n - o->a - 1);
+                n--;
+            }
+            break;
+        case '\'':
+            if (o->a < n)
+                n = o->a;
+            break;
+        case 'i':
+            if (o->a <= n) {
+                if (n == WK_RULE_MAXLINE)
+                    return 0;
+                memmove(w + o->a + 1, w + o->a, n - o->a);
+                w[o->a] = o->b;
+                n++;
+            }
+            break;
+        case 'o':
+            if (o->a < n)
+                w[o->a] = o->b;
+            break;
+        case '@':
+            for (i = 0, j = 0; i < n; i++)
+                if (w[i] != o->a)
+                    w[j++] = w[i];
+            n = j;
+            break;
+        case 'z':
+        case 'Z':
+            if (n == 0)
+                break;
+            if (n + o->a > WK_RULE_MAXLINE)
+                return 0;
+            if (o->op == 'z') {
+                memmove(w + o->a, w, n);
+                memset(w, w[o->a], o->a);
+            } else {
+                memset(w + n, w[n-1], o->a);
+            }
+            n += o->a;
+            break;
+        case '<':
+            if (n >= o->a)
+                return 0;
+            break;
+        case '>':
+            if (n <= o->a)
+                return 0;
+            break;
+        case '!':
+            if (memchr(w, o->a, n) != NULL)
+                return 0;
+            break;
+        case '/':
+            if (memchr(w, o->a, n) == NULL)
+                return 0;
+            break;
+        }
+    }
+    return n;
+}
+
+/* every rule over every line of in */
+static size_t wk_rules_run(const struct wk_filter *f, const char *in, size_t len,
+                           char *out, size_t *nrec) {
+    const struct wk_rules *rs = f->priv;
+    const char *end = in + len, *nl;
+    char *o = out;
+    size_t r, n, count = 0;
+
+    for (; in < end; in = nl + 1) {
+        nl = memchr(in, wk_eol, (size_t)(end - in));
+        for (r = 0; r < rs->n; r++) {
+            n = wk_rule_apply(rs, &rs->rules[r], in, (size_t)(nl - in), o);
+            if (n > 0) {
+                o[n] = wk_eol;
+                o += n + 1;
+                count++;
+            }
+        }
+    }
+    *nrec = count;
+    return (size_t)(o - out);
+}
+
+/* compile the rule file into a filter for the sink */
+int wk_rules_filter(const char *filename, struct wk_filter *filter) {
+    struct wk_rules *rs;
+    char line[4096];
+    unsigned long lineno = 0;
+    size_t mult = 1, grow = 0, l;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr,"rules: File %s could not be opened: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    rs = calloc(1, sizeof(*rs));
+    if (rs == NULL) {
+        fprintf(stderr,"rules: can't allocate memory\n");
+        (void)fclose(fp);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        l = strcspn(line, "\r\n");
+        line[l] = '\0';
+        if (l == 0 || line[0] == '#')
+            continue;
+        if (wk_rule_compile(rs, line, filename, lineno, &mult, &grow) == -1) {
+            (void)fclose(fp);
+            return -1;
+        }
+    }
+    (void)fclose(fp);
+    if (rs->n == 0) {
+        fprintf(stderr,"rules: %s has no rules\n", filename);
+        return -1;
+    }
+
+    /* a record of maxrec bytes turns into at most n lines of mult*maxrec+grow */
+    filter->mult = rs->n * mult;
+    filter->extra = rs->n * grow;
+    filter->run = wk_rules_run;
+    filter->priv = rs;
+    return 0;
+}
+
+static int wk_word_cmp(const void *a, const void *b) {
+    const struct wk_words *w = wk_sort_words;
+    size_t i = *(const size_t *)a, j = *(const size_t *)b;
+    size_t li = w->len[i], lj = w->len[j];
+    int c = memcmp(w->arena + w->off[i], w->arena + w->off[j], li < lj ? li : lj);
+
+    return c ? c : (li > lj) - (li < lj);
+}
+
+/* every rule of the filter over every word of in, sorted and without duplicates */
+int wk_rules_words(const struct wk_filter *filter, const struct wk_words *in, struct wk_words *out) {
+    const struct wk_rules *rs = filter->priv;
+    struct wk_words all;
+    size_t *idx = NULL, cap, i, r, n, k;
+
+    memset(&all, 0, sizeof(all));
+    memset(out, 0, sizeof(*out));
+    cap = in->n * rs->n;
+    n = 1 << 20;                        /* arena size, doubled as the words come in */
+    all.off = malloc(cap * sizeof(*all.off));
+    all.len = malloc(cap * sizeof(*all.len));
+    all.arena = malloc(n);
+    idx = malloc(cap * sizeof(*idx));
+    if (all.off == NULL || all.len == NULL || all.arena == NULL || idx == NULL)
+        goto nomem;
+
+    k = 0;
+    for (i = 0; i < in->n; i++) {
+        for (r = 0; r < rs->n; r++) {
+            if (k + WK_RULE_MAXLINE > n) {
+                char *arena = realloc(all.arena, 2 * n);
+                if (arena == NULL)
+                    goto nomem;
+                all.arena = arena;
+                n *= 2;
+            }
+            all.len[all.n] = (uint32_t)wk_rule_apply(rs, &rs->rules[r], in->arena + in->off[i],
+                                                     in->len[i], all.arena + k);
+            if (all.len[all.n] == 0)
+                continue;
+            all.off[all.n] = k;
+            k += all.len[all.n];
+            idx[all.n] = all.n;
+            all.n++;
+        }
+    }
+
+    wk_sort_words = &all;
+    qsort(idx, all.n, sizeof(*idx), wk_word_cmp);
+
+    out->off = malloc((all.n ? all.n : 1) * sizeof(*out->off));
+    out->len = malloc((all.n ? all.n : 1) * sizeof(*out->len));
+    out->arena = malloc(k ? k : 1);
+    if (out->off == NULL || out->len == NULL || out->arena == NULL)
+        goto nomem;
+    for (i = 0, k = 0; i < all.n; i++) {
+        if (i > 0 && wk_word_cmp(&idx[i], &idx[i-1]) == 0)
+            continue;
+        out->off[out->n] = k;
+        out->len[out->n] = all.len[idx[i]];
+        memcpy(out->arena + k, all.arena + all.off[idx[i]], all.len[idx[i]]);
+        k += all.len[idx[i]];
+        if (all.len[idx[i]] > out->maxlen)
+            out->maxlen = all.len[idx[i]];
+        out->n++;
+    }
+
+    free(idx);
+    wk_words_free(&all);
+    return 0;
+
+nomem:
+    fprintf(stderr,"rules: can't allocate memory for the mangled words\n");
+    free(idx);
+    wk_words_free(&all);
+    wk_words_free(out);
+    return -1;
+}
@@ -0,0 +1,473 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+#include <zlib.h>
+
+/*
+ * Seekable gzip output (-z gzip --seekable).  Every chunk of the pool is
+ * compressed by its worker into a gzip member of its own, a frame, whose
+ * extra field holds the candidates and lines it covers and its size:
+ *
+ *   1f 8b 08 04 mtime xfl os  xlen=32  'B' 'F' 28  first ncand nrec size
+ *   deflate data  crc32 isize
+ *
+ * When the file is closed the frame list follows as empty members with
+ * extra fields 'B' 'I' of up to WK_SEEK_PERMEMBER entries of first, ncand,
+ * nrec and offset, and a last empty member 'B' 'X' gives the offset and
+ * the number of entries.  gzip -d sees a plain multi member file.
+ *
+ * A file that was not closed has no index, the frames are then walked by
+ * their sizes, which is also how a partly written last frame is found.
+ * All numbers are little endian.
+ */
+
+#define WK_FRAME_HEAD       44
+#define WK_FRAME_TAIL       8
+#define WK_SEEK_ENTRY       32
+#define WK_SEEK_PERMEMBER   2047        /* entries that fit an extra field */
+#define WK_SEEK_FOOTER      42
+
+struct wk_framer {
+    z_stream zs;
+};
+
+static void wk_put16(unsigned char *p, unsigned v);
+static void wk_put32(unsigned char *p, uint32_t v);
+static void wk_put64(unsigned char *p, uint64_t v);
+static uint64_t wk_get(const unsigned char *p, int n);
+static size_t wk_empty_member(unsigned char *p, char si2, size_t len);
+static int wk_frame_read(int fd, const struct wk_frame *f, uint64_t size, char **out, size_t *len);
+static size_t wk_frame_find(const struct wk_frame *f, size_t n, uint64_t cand);
+
+static void wk_put16(unsigned char *p, unsigned v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void wk_put32(unsigned char *p, uint32_t v) {
+    wk_put16(p, v & 0xffff);
+    wk_put16(p + 2, v >> 16);
+}
+
+static void wk_put64(unsigned char *p, uint64_t v) {
+    wk_put32(p, (uint32_t)v);
+    wk_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t wk_get(const unsigned char *p, int n) {
+    uint64_t v = 0;
+
+    while (n-- > 0)
+        v = v << 8 | p[n];
+    return v;
+}
+
+struct wk_framer *wk_framer_new(void) {
+    struct wk_framer *fr = calloc(1, sizeof(*fr));
+
+    if (fr == NULL || deflateInit2(&fr->zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr,"seek: can't set up the compressor\n");
+        free(fr);
+        return NULL;
+    }
+    return fr;
+}
+
+void wk_framer_free(struct wk_framer *fr) {
+    if (fr == NULL)
+        return;
+    (void)deflateEnd(&fr->zs);
+    free(fr);
+}
+
+/* largest frame of len bytes */
+size_t wk_frame_bound(size_t len) {
+    return compressBound((uLong)len) + WK_FRAME_HEAD + WK_FRAME_TAIL;
+}
+
+/* compress len bytes holding nrec lines of candidates [first, first+ncand) to one frame */
+size_t wk_frame_pack(struct wk_framer *fr, const char *in, size_t len, uint64_t first,
+                     uint64_t ncand, size_t nrec, char *out) {
+    unsigned char *o = (unsigned char *)out;
+    size_t size;
+
+    (void)deflateReset(&fr->zs);
+    fr->zs.next_in = (unsigned char *)in;
+    fr->zs.avail_in = (uInt)len;
+    fr->zs.next_out = o + WK_FRAME_HEAD;
+    fr->zs.avail_out = (uInt)(wk_frame_bound(len) - WK_FRAME_HEAD - WK_FRAME_TAIL);
+    if (deflate(&fr->zs, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    size = WK_FRAME_HEAD + fr->zs.total_out + WK_FRAME_TAIL;
+
+    memcpy(o, "\x1f\x8b\x08\x04\0\0\0\0\0\xff", 10);
+    wk_put16(o + 10, 32);
+    o[12] = 'B';
+    o[13] = 'F';
+    wk_put16(o + 14, 28);
+    wk_put64(o + 16, first);
+    wk_put64(o + 24, ncand);
+    wk_put64(o + 32, nrec);
+    wk_put32(o + 40, (uint32_t)size);
+    wk_put32(o + size - 8, (uint32_t)crc32(0, (const unsigned char *)in, (uInt)len));
+    wk_put32(o + size - 4, (uint32_t)len);
+    return size;
+}
+
+/* header of an empty member with a len byte extra field 'B' si2, the field goes after it */
+static size_t wk_empty_member(unsigned char *p, char si2, size_t len) {
+    memcpy(p, "\x1f\x8b\x08\x04\0\0\0\0\0\xff", 10);
+    wk_put16(p + 10, (unsigned)(len + 4));
+    p[12] = 'B';
+    p[13] = (unsigned char)si2;
+    wk_put16(p + 14, (unsigned)len);
+    return 16;
+}
+
+/* the index and footer members for the n frames of a file, in a malloc'd buffer */
+size_t wk_seek_index(const struct wk_frame *f, size_t n, uint64_t off, char **buf) {
+    /* an empty final deflate block, crc32 and isize of nothing */
+    static const unsigned char tail[10] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    unsigned char *p;
+    size_t i, k, m, len = 0;
+
+    p = malloc((n / WK_SEEK_PERMEMBER + 1) * (16 + sizeof(tail)) + n * WK_SEEK_ENTRY + WK_SEEK_FOOTER);
+    if (p == NULL) {
+        fprintf(stderr,"seek: can't allocate memory for the index\n");
+        return 0;
+    }
+    for (i = 0; i < n; i += m) {
+        m = n - i < WK_SEEK_PERMEMBER ? n - i : WK_SEEK_PERMEMBER;
+        len += wk_empty_member(p + len, 'I', m * WK_SEEK_ENTRY);
+        for (k = i; k < i + m; k++, len += WK_SEEK_ENTRY) {
+            wk_put64(p + len, f[k].first);
+            wk_put64(p + len + 8, f[k].ncand);
+            wk_put64(p + len + 16, f[k].nrec);
+            wk_put64(p + len + 24, f[k].off);
+        }
+        memcpy(p + len, tail, sizeof(tail));
+        len += sizeof(tail);
+    }
+    len += wk_empty_member(p + len, 'X', 16);
+    wk_put64(p + len, off);
+    wk_put64(p + len + 8, n);
+    memcpy(p + len + 16, tail, sizeof(tail));
+    len += 16 + sizeof(tail);
+    *buf = (char *)p;
+    return len;
+}
+
+/*
+ * Frames of the file open on fd.  *end is where the last complete frame
+ * ends, the index and anything after it can be cut off there.  Returns 1
+ * if they came from the index, 0 if the frames were walked.
+ */
+int wk_seek_load(int fd, struct wk_frame **frames, size_t *nframes, uint64_t *end) {
+    unsigned char h[WK_FRAME_HEAD], *ix = NULL;
+    struct wk_frame *f = NULL, *tmp;
+    uint64_t size, off, ioff, n = 0, i, cap = 0;
+    struct stat st;
+    size_t k, m;
+
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr,"seek: can't stat the file: %s\n", strerror(errno));
+        return -1;
+    }
+    size = (uint64_t)st.st_size;
+
+    /* a closed file ends in its footer */
+    if (size >= WK_SEEK_FOOTER && pread(fd, h, WK_SEEK_FOOTER, (off_t)(size - WK_SEEK_FOOTER)) == WK_SEEK_FOOTER
+        && memcmp(h, "\x1f\x8b\x08\x04", 4) == 0 && wk_get(h + 10, 2) == 20 && h[12] == 'B' && h[13] == 'X') {
+        ioff = wk_get(h + 16, 8);
+        n = wk_get(h + 24, 8);
+        if (ioff <= size && n <= (size - ioff) / WK_SEEK_ENTRY
+            && (f = malloc((n ? n : 1) * sizeof(*f))) != NULL
+            && (ix = malloc((size_t)(size - ioff))) != NULL
+            && pread(fd, ix, (size_t)(size - ioff), (off_t)ioff) == (ssize_t)(size - ioff)) {
+            for (i = 0, off = 0; i < n; i += m) {
+                if (off + 16 > size - ioff || memcmp(ix + off, "\x1f\x8b\x08\x04", 4) != 0
+                    || ix[off+12] != 'B' || ix[off+13] != 'I')
+                    break;
+                m = (size_t)wk_get(ix + off + 14, 2) / WK_SEEK_ENTRY;
+                if (m == 0 || off + 16 + m * WK_SEEK_ENTRY + 10 > size - ioff)
+                    break;
+                for (k = 0; k < m && i + k < n; k++) {
+                    f[i+k].first = wk_get(ix + off + 16 + k * WK_SEEK_ENTRY, 8);
+                    f[i+k].ncand = wk_get(ix + off + 24 + k * WK_SEEK_ENTRY, 8);
+                    f[i+k].nrec = wk_get(ix + off + 32 + k * WK_SEEK_ENTRY, 8);
+                    f[i+k].off = wk_get(ix + off + 40 + k * WK_SEEK_ENTRY, 8);
+                }
+                off += 16 + m * WK_SEEK_ENTRY + 10;
+            }
+            free(ix);
+            if (i >= n) {
+                *frames = f;
+                *nframes = (size_t)n;
+                *end = ioff;
+                return 1;
+            }
+        } else {
+            free(ix);
+        }
+        free(f);
+        f = NULL;
+        n = 0;
+    }
+
+    /* walk the frames by their sizes */
+    for (off = 0; off + WK_FRAME_HEAD <= size; off += wk_get(h + 40, 4)) {
+        if (pread(fd, h, WK_FRAME_HEAD, (off_t)off) != WK_FRAME_HEAD
+            || memcmp(h, "\x1f\x8b\x08\x04", 4) != 0 || h[12] != 'B' || h[13] != 'F'
+            || wk_get(h + 40, 4) < WK_FRAME_HEAD + WK_FRAME_TAIL || off + wk_get(h + 40, 4) > size)
+            break;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            if ((tmp = realloc(f, cap * sizeof(*f))) == NULL) {
+                fprintf(stderr,"seek: can't allocate memory for the index\n");
+                free(f);
+                return -1;
+            }
+            f = tmp;
+        }
+        f[n].first = wk_get(h + 16, 8);
+        f[n].ncand = wk_get(h + 24, 8);
+        f[n].nrec = wk_get(h + 32, 8);
+        f[n].off = off;
+        n++;
+    }
+    *frames = f;
+    *nframes = (size_t)n;
+    *end = off;
+    return 0;
+}
+
+/* decompress frame f of a file of size bytes into a malloc'd buffer */
+static int wk_frame_read(int fd, const struct wk_frame *f, uint64_t size, char **out, size_t *len) {
+    unsigned char h[WK_FRAME_HEAD], *z = NULL;
+    z_stream zs;
+    uint32_t msize;
+    int rc = -1;
+
+    *out = NULL;
+    if (pread(fd, h, WK_FRAME_HEAD, (off_t)f->off) != WK_FRAME_HEAD
+        || (msize = (uint32_t)wk_get(h + 40, 4)) < WK_FRAME_HEAD + WK_FRAME_TAIL
+        || f->off + msize > size)
+        goto bad;
+    if ((z = malloc(msize)) == NULL || pread(fd, z, msize, (off_t)f->off) != (ssize_t)msize)
+        goto bad;
+    *len = (size_t)wk_get(z + msize - 4, 4);
+    if ((*out = malloc(*len ? *len : 1)) == NULL)
+        goto bad;
+
+    /* the gzip wrapper of zlib checks the crc */
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 31) != Z_OK)
+        goto bad;
+    zs.next_in = z;
+    zs.avail_in = msize;
+    zs.next_out = (unsigned char *)*out;
+    zs.avail_out = (uInt)*len;
+    if (inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == *len)
+        rc = 0;
+    (void)inflateEnd(&zs);
+
+bad:
+    if (rc == -1) {
+        fprintf(stderr,"seek: frame at offset %llu is damaged\n", (unsigned long long)f->off);
+        free(*out);
+        *out = NULL;
+    }
+    free(z);
+    return rc;
+}
+
+/* last frame starting at or before candidate cand */
+static size_t wk_frame_find(const struct wk_frame *f, size_t n, uint64_t cand) {
+    size_t lo = 0, hi = n, mid;
+
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (f[mid].first <= cand)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Continue the seekable file at path: the index and a partly written
+ * frame are cut off and the frames are kept for the new index.  *next is
+ * the candidate after the last one in the file.
+ */
+int wk_seek_resume(struct wk_sink *sink, const char *path, uint64_t *next) {
+    struct wk_frame *f;
+    uint64_t end;
+    size_t n, len, i;
+    struct stat st;
+    char *buf;
+    int fd;
+
+    if ((fd = open(path, O_RDWR)) == -1) {
+        fprintf(stderr,"resume: can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (wk_seek_load(fd, &f, &n, &end) == -1) {
+        (void)close(fd);
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)end) == -1) {
+        fprintf(stderr,"resume: can't truncate %s: %s\n", path, strerror(errno));
+        (void)close(fd);
+        free(f);
+        return -1;
+    }
+
+    sink->frames = f;
+    sink->nframes = sink->cframes = n;
+    sink->first[0] = sink->last[0] = '\0';
+    sink->lines = 0;
+    for (i = 0; i < n; i++)
+        sink->lines += f[i].nrec;
+    sink->flines = sink->lines;
+    sink->bytes = sink->fbytes = end;
+    *next = n > 0 ? f[n-1].first + f[n-1].ncand : 0;
+
+    /* the first line names the file once it is complete */
+    if (n > 0 && fstat(fd, &st) == 0 && wk_frame_read(fd, &f[0], (uint64_t)st.st_size, &buf, &len) == 0) {
+        for (i = 0; i < len && buf[i] != '\n'; i++)
+            ;
+        memcpy(sink->first, buf, i < MAXSTRING*WK_MBMAX ? i : MAXSTRING*WK_MBMAX);
+        sink->first[i < MAXSTRING*WK_MBMAX ? i : MAXSTRING*WK_MBMAX] = '\0';
+        free(buf);
+    }
+    (void)close(fd);
+    fprintf(stderr,"Resuming %s after candidate %llu, %lu frames kept\n", path,
+            (unsigned long long)*next, (unsigned long)n);
+    return 0;
+}
+
+/*
+ * bfc extract: write candidates [first, first+count) of a seekable file to
+ * stdout.  Lines map to candidates only in frames without dropped ones,
+ * other frames must lie inside the range.
+ */
+int wk_seek_extract(const char *path, uint64_t first, uint64_t count) {
+    struct wk_frame *f = NULL;
+    uint64_t end, last = count > UINT64_MAX - first ? UINT64_MAX : first + count;
+    struct stat st;
+    size_t n, i, len, a, b, line;
+    char *buf, *p, *q;
+    int fd, rc = -1;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        fprintf(stderr,"extract: can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || wk_seek_load(fd, &f, &n, &end) == -1)
+        goto out;
+
+    for (i = n ? wk_frame_find(f, n, first) : 0; i < n && f[i].first < last; i++) {
+        if (f[i].first + f[i].ncand <= first)
+            continue;
+        if (f[i].nrec != f[i].ncand && (f[i].first < first || f[i].first + f[i].ncand > last)) {
+            fprintf(stderr,"extract: frame at offset %llu dropped candidates, "
+                    "its lines can't be matched to a part of the range\n",
+                    (unsigned long long)f[i].off);
+            goto out;
+        }
+        if (wk_frame_read(fd, &f[i], (uint64_t)st.st_size, &buf, &len) == -1)
+            goto out;
+
+        /* lines a..b of the frame */
+        a = f[i].first < first ? (size_t)(first - f[i].first) : 0;
+        b = f[i].first + f[i].ncand > last ? (size_t)(last - f[i].first) : (size_t)f[i].nrec;
+        for (p = buf, line = 0; line < a && p < buf + len; line++)
+            p = (char *)memchr(p, '\n', (size_t)(buf + len - p)) + 1;
+        for (q = p; line < b && q < buf + len; line++)
+            q = (char *)memchr(q, '\n', (size_t)(buf + len - q)) + 1;
+        if (fwrite(p, 1, (size_t)(q - p), stdout) != (size_t)(q - p)) {
+            free(buf);
+            goto out;
+        }
+        free(buf);
+    }
+    rc = fflush(stdout) == 0 ? 0 : -1;
+
+out:
+    free(f);
+    (void)close(fd);
+    return rc;
+}
+
+/* bfc verify: decompress every frame and check it against its header and the index */
+int wk_seek_verify(const char *path) {
+    unsigned char h[WK_FRAME_HEAD];
+    struct wk_frame *f = NULL;
+    uint64_t end, lines = 0, cands = 0;
+    struct stat st;
+    size_t n, i, len, k, nl;
+    char *buf;
+    int fd, indexed, bad = 0;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        fprintf(stderr,"verify: can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (indexed = wk_seek_load(fd, &f, &n, &end)) == -1) {
+        (void)close(fd);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (pread(fd, h, WK_FRAME_HEAD, (off_t)f[i].off) != WK_FRAME_HEAD
+            || memcmp(h, "\x1f\x8b\x08\x04", 4) != 0 || h[12] != 'B' || h[13] != 'F'
+            || wk_get(h + 16, 8) != f[i].first || wk_get(h + 24, 8) != f[i].ncand
+            || wk_get(h + 32, 8) != f[i].nrec) {
+            fprintf(stderr,"verify: frame %lu does not match the index\n", (unsigned long)i);
+            bad = 1;
+            continue;
+        }
+        if (i > 0 && f[i].first < f[i-1].first + f[i-1].ncand) {
+            fprintf(stderr,"verify: frame %lu overlaps the one before\n", (unsigned long)i);
+            bad = 1;
+        }
+        if (wk_frame_read(fd, &f[i], (uint64_t)st.st_size, &buf, &len) == -1) {
+            bad = 1;
+            continue;
+        }
+        for (k = 0, nl = 0; k < len; k++)
+            nl += buf[k] == '\n';
+        if (nl != f[i].nrec) {
+            fprintf(stderr,"verify: frame %lu has %lu lines, %llu expected\n", (unsigned long)i,
+                    (unsigned long)nl, (unsigned long long)f[i].nrec);
+            bad = 1;
+        }
+        free(buf);
+        lines += f[i].nrec;
+        cands += f[i].ncand;
+    }
+    if (!indexed && end != (uint64_t)st.st_size) {
+        fprintf(stderr,"verify: %llu bytes of a partly written frame at the end\n",
+                (unsigned long long)((uint64_t)st.st_size - end));
+        bad = 1;
+    }
+    fprintf(stderr,"%s: %lu frames, %llu candidates, %llu lines, %s%s\n", path, (unsigned long)n,
+            (unsigned long long)cands, (unsigned long long)lines,
+            indexed ? "" : "no index, ", bad ? "damaged" : "ok");
+    free(f);
+    (void)close(fd);
+    return bad ? -1 : 0;
+}
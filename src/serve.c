@@ -0,0 +1,454 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+/*
+ * Lease daemon (bfc serve).  The candidate range of the job is cut into
+ * blocks of --lease-size candidates that are leased to the consumers
+ * connected to a UNIX socket, see lease.c for the protocol.  A lease that
+ * is not completed within --lease-ttl seconds, or whose consumer hangs up,
+ * goes back to the pending blocks.
+ *
+ * Completed blocks are appended to the journal next to the socket and
+ * synced before they are acknowledged.  A restarted daemon replays it and
+ * hands out every block that was not completed, the leases outstanding at
+ * the time of the crash included.
+ */
+
+#define WK_SERVE_MAXCLIENTS     256
+
+struct wk_client {
+    int fd;
+    char in[WK_LEASE_LINE];
+    size_t len;
+};
+
+struct wk_held {
+    uint64_t block;
+    time_t expiry;
+    int fd;                     /* consumer holding the lease */
+};
+
+struct wk_server {
+    const char *key;
+    uint64_t first, count, size;
+    unsigned ttl;
+    uint64_t nblocks;
+    uint64_t next;              /* blocks below this were handed out at least once */
+    uint64_t ndone;
+    uint64_t *pending;          /* handed out before but not completed */
+    size_t npending, cpending;
+    struct wk_held *held;
+    size_t nheld, cheld;
+    int journal;
+};
+
+static volatile sig_atomic_t wk_serve_stop;
+
+static void wk_serve_signal(int sig);
+static int wk_push_pending(struct wk_server *sv, uint64_t block);
+static int wk_journal_open(struct wk_server *sv, const char *path);
+static int wk_journal_add(struct wk_server *sv, char kind, uint64_t block);
+static int wk_u64_cmp(const void *a, const void *b);
+static void wk_expire(struct wk_server *sv, int fd);
+static int wk_complete(struct wk_server *sv, uint64_t block);
+static int wk_reply(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static int wk_serve_line(struct wk_server *sv, int fd, char *line);
+
+static void wk_serve_signal(int sig) {
+    (void)sig;
+    wk_serve_stop = 1;
+}
+
+static int wk_push_pending(struct wk_server *sv, uint64_t block) {
+    uint64_t *p;
+
+    if (sv->npending == sv->cpending) {
+        sv->cpending = sv->cpending ? sv->cpending * 2 : 64;
+        if ((p = realloc(sv->pending, sv->cpending * sizeof(uint64_t))) == NULL) {
+            fprintf(stderr,"serve: can't allocate memory for pending leases\n");
+            return -1;
+        }
+        sv->pending = p;
+    }
+    sv->pending[sv->npending++] = block;
+    return 0;
+}
+
+static int wk_u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * "bfc-journal 1 key first count size" and then a line per event,
+ * "D block" for a completed block and "E block" for an expired lease.
+ */
+static int wk_journal_open(struct wk_server *sv, const char *path) {
+    char line[WK_LEASE_LINE], head[WK_LEASE_LINE];
+    uint64_t *done = NULL, *p, b, last;
+    size_t ndone = 0, cdone = 0, i;
+    unsigned long long v;
+    FILE *fp;
+    int rc = -1;
+
+    snprintf(head, sizeof(head), "bfc-journal 1 %s %llu %llu %llu\n", sv->key,
+             (unsigned long long)sv->first, (unsigned long long)sv->count,
+             (unsigned long long)sv->size);
+
+    if ((fp = fopen(path, "r")) != NULL) {
+        if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, head) != 0) {
+            fprintf(stderr,"serve: %s belongs to another job, remove it to start over\n", path);
+            goto out;
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (line[0] != 'D' || sscanf(line + 1, "%llu", &v) != 1 || v >= sv->nblocks)
+                continue;
+            if (ndone == cdone) {
+                cdone = cdone ? cdone * 2 : 1024;
+                if ((p = realloc(done, cdone * sizeof(uint64_t))) == NULL) {
+                    fprintf(stderr,"serve: can't allocate memory for the journal\n");
+                    goto out;
+                }
+                done = p;
+            }
+            done[ndone++] = v;
+        }
+
+        /* blocks below the last completed one that are missing were lost */
+        qsort(done, ndone, sizeof(uint64_t), wk_u64_cmp);
+        for (i = 0, last = 0, b = 0; i < ndone; i++) {
+            if (i > 0 && done[i] == done[i-1])
+                continue;
+            for (; b < done[i]; b++)
+                if (wk_push_pending(sv, b) == -1)
+                    goto out;
+            b = done[i] + 1;
+            last = b;
+            sv->ndone++;
+        }
+        sv->next = last;
+        if (sv->ndone > 0)
+            fprintf(stderr,"Journal %s: %llu of %llu blocks done, %lu to redo\n", path,
+                    (unsigned long long)sv->ndone, (unsigned long long)sv->nblocks,
+                    (unsigned long)sv->npending);
+        (void)fclose(fp);
+        fp = NULL;
+    }
+
+    sv->journal = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (sv->journal == -1) {
+        fprintf(stderr,"serve: can't open journal %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    if (lseek(sv->journal, 0, SEEK_END) == 0
+        && (write(sv->journal, head, strlen(head)) != (ssize_t)strlen(head)
+            || fdatasync(sv->journal) == -1)) {
+        fprintf(stderr,"serve: can't write journal %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    rc = 0;
+
+out:
+    if (fp != NULL)
+        (void)fclose(fp);
+    free(done);
+    return rc;
+}
+
+/* completions are synced before they are acknowledged */
+static int wk_journal_add(struct wk_server *sv, char kind, uint64_t block) {
+    char line[32];
+    int n;
+
+    n = snprintf(line, sizeof(line), "%c %llu\n", kind, (unsigned long long)block);
+    if (write(sv->journal, line, (size_t)n) != n || (kind == 'D' && fdatasync(sv->journal) == -1)) {
+        fprintf(stderr,"serve: can't write journal: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* leases past their expiry, or all those of fd if it is not -1, go back to pending */
+static void wk_expire(struct wk_server *sv, int fd) {
+    time_t now = time(NULL);
+    size_t i;
+
+    for (i = 0; i < sv->nheld; ) {
+        if (fd != -1 ? sv->held[i].fd == fd : sv->held[i].expiry <= now) {
+            if (wk_push_pending(sv, sv->held[i].block) == 0)
+                (void)wk_journal_add(sv, 'E', sv->held[i].block);
+            sv->held[i] = sv->held[--sv->nheld];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* a block is done once, whoever completes it first */
+static int wk_complete(struct wk_server *sv, uint64_t block) {
+    size_t i;
+    int found = 0;
+
+    if (block >= sv->next)
+        return -1;
+    for (i = 0; i < sv->nheld; ) {
+        if (sv->held[i].block == block) {
+            sv->held[i] = sv->held[--sv->nheld];
+            found = 1;
+        } else {
+            i++;
+        }
+    }
+    for (i = 0; i < sv->npending; i++) {
+        if (sv->pending[i] == block) {
+            sv->pending[i] = sv->pending[--sv->npending];
+            found = 1;
+            break;
+        }
+    }
+    if (!found)
+        return 0;
+    if (wk_journal_add(sv, 'D', block) == -1)
+        return -1;
+    sv->ndone++;
+    return 0;
+}
+
+static int wk_reply(int fd, const char *fmt, ...) {
+    char line[WK_LEASE_LINE];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    return send(fd, line, (size_t)n, MSG_NOSIGNAL) == n ? 0 : -1;
+}
+
+/* one request of a consumer, -1 hangs up on it */
+static int wk_serve_line(struct wk_server *sv, int fd, char *line) {
+    char key[WK_LEASE_LINE];
+    unsigned long long a, b;
+    struct wk_held *h;
+    uint64_t block, first;
+
+    if (sscanf(line, "HELLO %s %llu %llu", key, &a, &b) == 3) {
+        if (strcmp(key, sv->key) != 0 || a != sv->first || b != sv->count) {
+            (void)wk_reply(fd, "ERR the job of the server is %s %llu %llu\n", sv->key,
+                           (unsigned long long)sv->first, (unsigned long long)sv->count);
+            return -1;
+        }
+        return wk_reply(fd, "OK %llu %llu\n", (unsigned long long)sv->nblocks,
+                        (unsigned long long)sv->size);
+    }
+
+    if (strcmp(line, "LEASE") == 0) {
+        if (sv->npending > 0) {
+            block = sv->pending[--sv->npending];
+        } else if (sv->next < sv->nblocks) {
+            block = sv->next++;
+        } else if (sv->nheld > 0) {
+            return wk_reply(fd, "WAIT 1\n");
+        } else {
+            return wk_reply(fd, "DONE\n");
+        }
+        if (sv->nheld == sv->cheld) {
+            sv->cheld = sv->cheld ? sv->cheld * 2 : 64;
+            if ((h = realloc(sv->held, sv->cheld * sizeof(struct wk_held))) == NULL) {
+                fprintf(stderr,"serve: can't allocate memory for leases\n");
+                (void)wk_push_pending(sv, block);
+                return wk_reply(fd, "WAIT 1\n");
+            }
+            sv->held = h;
+        }
+        sv->held[sv->nheld].block = block;
+        sv->held[sv->nheld].expiry = time(NULL) + sv->ttl;
+        sv->held[sv->nheld].fd = fd;
+        sv->nheld++;
+        first = block * sv->size;
+        return wk_reply(fd, "RANGE %llu %llu %llu %u\n", (unsigned long long)block,
+                        (unsigned long long)(sv->first + first),
+                        (unsigned long long)(sv->count - first < sv->size ? sv->count - first : sv->size),
+                        sv->ttl);
+    }
+
+    if (sscanf(line, "RENEW %llu", &a) == 1) {
+        for (h = sv->held; h < sv->held + sv->nheld; h++) {
+            if (h->block == a && h->fd == fd) {
+                h->expiry = time(NULL) + sv->ttl;
+                return wk_reply(fd, "OK\n");
+            }
+        }
+        return wk_reply(fd, "ERR lease %llu expired\n", a);
+    }
+
+    if (sscanf(line, "COMPLETE %llu", &a) == 1) {
+        if (wk_complete(sv, a) == -1)
+            return wk_reply(fd, "ERR lease %llu can't be completed\n", a);
+        return wk_reply(fd, "OK\n");
+    }
+
+    (void)wk_reply(fd, "ERR unknown request\n");
+    return -1;
+}
+
+/*
+ * Serve the blocks of [first, first+count) on the socket path until all of
+ * them are completed and the consumers have hung up, or until a signal.
+ */
+int wk_serve(const char *path, const char *key, uint64_t first, uint64_t count,
+             uint64_t size, unsigned ttl) {
+    struct wk_server sv;
+    struct wk_client *cl[WK_SERVE_MAXCLIENTS];
+    struct pollfd pfd[WK_SERVE_MAXCLIENTS + 1];
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    char journal[PATH_MAX];
+    char *nl, *line;
+    size_t ncl = 0, npolled, c, k;
+    ssize_t n;
+    int lfd = -1, fd, rc = -1;
+
+    memset(&sv, 0, sizeof(sv));
+    sv.key = key;
+    sv.first = first;
+    sv.count = count;
+    sv.size = size ? size : WK_LEASE_SIZE;
+    sv.ttl = ttl ? ttl : WK_LEASE_TTL;
+    sv.nblocks = count / sv.size + (count % sv.size != 0);
+    sv.journal = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"serve: socket path too long: %s\n", path);
+        return -1;
+    }
+    if ((size_t)snprintf(journal, sizeof(journal), "%s.journal", path) >= sizeof(journal)) {
+        fprintf(stderr,"serve: socket path too long: %s\n", path);
+        return -1;
+    }
+    if (wk_journal_open(&sv, journal) == -1)
+        goto out;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    (void)unlink(path);
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+        || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, 64) == -1) {
+        fprintf(stderr,"serve: can't listen on %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wk_serve_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fprintf(stderr,"Serving %llu candidates on %s in %llu leases of %llu\n",
+            (unsigned long long)count, path, (unsigned long long)sv.nblocks,
+            (unsigned long long)sv.size);
+
+    while (!wk_serve_stop && (sv.ndone < sv.nblocks || ncl > 0)) {
+        pfd[0].fd = lfd;
+        pfd[0].events = POLLIN;
+        for (c = 0; c < ncl; c++) {
+            pfd[c+1].fd = cl[c]->fd;
+            pfd[c+1].events = POLLIN;
+        }
+        if (poll(pfd, ncl + 1, 1000) == -1) {
+            /* revents still hold the last round, look at wk_serve_stop first */
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr,"serve: poll failed: %s\n", strerror(errno));
+            goto out;
+        }
+        wk_expire(&sv, -1);
+
+        /* a consumer accepted below has no revents of this round yet */
+        npolled = ncl;
+        if (pfd[0].revents & POLLIN) {
+            if ((fd = accept(lfd, NULL, NULL)) != -1) {
+                if (ncl == WK_SERVE_MAXCLIENTS || (cl[ncl] = calloc(1, sizeof(struct wk_client))) == NULL) {
+                    (void)wk_reply(fd, "ERR too many consumers\n");
+                    (void)close(fd);
+                } else {
+                    /* one stuck consumer must not block the others */
+                    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    cl[ncl++]->fd = fd;
+                }
+            }
+        }
+
+        for (c = npolled; c-- > 0; ) {
+            if (!(pfd[c+1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            fd = cl[c]->fd;
+            n = read(fd, cl[c]->in + cl[c]->len, sizeof(cl[c]->in) - cl[c]->len);
+            if (n > 0) {
+                cl[c]->len += (size_t)n;
+                for (line = cl[c]->in; (nl = memchr(line, '\n', cl[c]->len - (size_t)(line - cl[c]->in))) != NULL;
+                     line = nl + 1) {
+                    *nl = '\0';
+                    if (wk_serve_line(&sv, fd, line) == -1) {
+                        n = 0;
+                        break;
+                    }
+                }
+                k = cl[c]->len - (size_t)(line - cl[c]->in);
+                memmove(cl[c]->in, line, k);
+                cl[c]->len = k;
+                if (k == sizeof(cl[c]->in))
+                    n = 0;
+            }
+            if (n <= 0 && !(n == -1 && (errno == EINTR || errno == EAGAIN))) {
+                /* its leases can be handed out again right away */
+                wk_expire(&sv, fd);
+                (void)close(fd);
+                free(cl[c]);
+                cl[c] = cl[--ncl];
+            }
+        }
+    }
+
+    if (sv.ndone == sv.nblocks)
+        fprintf(stderr,"All %llu leases done\n", (unsigned long long)sv.nblocks);
+    else
+        fprintf(stderr,"Stopped with %llu of %llu leases done\n", (unsigned long long)sv.ndone,
+                (unsigned long long)sv.nblocks);
+    rc = 0;
+
+out:
+    for (c = 0; c < ncl; c++) {
+        (void)close(cl[c]->fd);
+        free(cl[c]);
+    }
+    if (lfd != -1) {
+        (void)close(lfd);
+        (void)unlink(path);
+    }
+    if (sv.journal != -1)
+        (void)close(sv.journal);
+    free(sv.pending);
+    free(sv.held);
+    return rc;
+}
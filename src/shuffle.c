@@ -0,0 +1,121 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Keyed pseudo-random order (-R key).  Output index i is candidate
+ * perm(i) of the wrapped source, perm being a bijection of [0, total).
+ * It is a balanced Feistel network over the smallest even number of bits
+ * that covers total, and indexes that land outside [0, total) are fed
+ * through it again (cycle walking) until they land inside.  The domain is
+ * less than four times total, so that takes under four rounds on average.
+ * Nothing is stored per candidate, and any index range can be generated
+ * on its own, so -j and -r work as for the plain order.
+ */
+
+#define WK_FEISTEL_ROUNDS   8
+
+struct wk_shuffle {
+    struct wk_source *inner;
+    uint64_t key[WK_FEISTEL_ROUNDS];
+    unsigned half;                      /* bits of each Feistel half */
+    uint64_t mask;                      /* (1 << half) - 1 */
+};
+
+static uint64_t wk_mix64(uint64_t x);
+static uint64_t wk_feistel(const struct wk_shuffle *sh, uint64_t x);
+static size_t wk_shuffle_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                              char *buf, size_t *nrec);
+
+/* splitmix64 finalizer */
+static uint64_t wk_mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t wk_feistel(const struct wk_shuffle *sh, uint64_t x) {
+    uint64_t l = (x >> sh->half) & sh->mask, r = x & sh->mask, t;
+    int i;
+
+    for (i = 0; i < WK_FEISTEL_ROUNDS; i++) {
+        t = r;
+        r = l ^ (wk_mix64(r ^ sh->key[i]) & sh->mask);
+        l = t;
+    }
+    return (l << sh->half) | r;
+}
+
+static size_t wk_shuffle_fill(struct wk_source *src, uint64_t first, uint64_t n,
+                              char *buf, size_t *nrec) {
+    const struct wk_shuffle *sh = src->priv;
+    uint64_t total = sh->inner->total, x;
+    size_t len = 0, r, step;
+
+    *nrec = 0;
+    for (; n > 0; n--, first++) {
+        x = first;
+        do {
+            x = wk_feistel(sh, x);
+        } while (x >= total);
+
+        r = 0;
+        if ((step = sh->inner->fill(sh->inner, x, 1, buf + len, &r)) == NPOS)
+            return NPOS;
+        len += step;
+        *nrec += r;
+    }
+    return len;
+}
+
+/* wrap inner so its candidates come out in the order keyed by key */
+int wk_shuffle_source(struct wk_source *inner, const char *key, struct wk_source *src) {
+    struct wk_shuffle *sh;
+    uint64_t h = 0xcbf29ce484222325ULL;     /* FNV-1a of the key */
+    const unsigned char *p;
+    unsigned bits = 0;
+    int i;
+
+    sh = calloc(1, sizeof(*sh));
+    if (sh == NULL) {
+        fprintf(stderr,"shuffle: can't allocate memory\n");
+        return -1;
+    }
+
+    for (p = (const unsigned char *)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    for (i = 0; i < WK_FEISTEL_ROUNDS; i++)
+        sh->key[i] = wk_mix64(h + (uint64_t)i * 0x9e3779b97f4a7c15ULL);
+
+    while (bits < 64 && (inner->total - 1) >> bits != 0)
+        bits++;
+    sh->half = (bits + 1) / 2;
+    if (sh->half == 0)
+        sh->half = 1;
+    sh->mask = sh->half == 32 ? 0xffffffffULL : (1ULL << sh->half) - 1;
+    sh->inner = inner;
+
+    src->total = inner->total;
+    src->maxrec = inner->maxrec;
+    src->fill = wk_shuffle_fill;
+    src->priv = sh;
+    return 0;
+}
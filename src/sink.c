@@ -0,0 +1,424 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/* delimiter the generators end their records with, NUL for the binary formats */
+char wk_eol = '\n';
+
+static int wk_sink_openfile(struct wk_sink *sink, int append);
+static int wk_sink_closefile(struct wk_sink *sink);
+static int wk_write_all(struct wk_sink *sink, const char *buf, size_t len);
+static int wk_write_header(struct wk_sink *sink);
+static int wk_seek_finish(struct wk_sink *sink);
+static void wk_copy_line(char *dst, const char *rec, size_t len);
+static size_t wk_next_rec(const struct wk_sink *sink, const char *p, const char *end,
+                          const char **text, size_t *tlen);
+
+/* fixed width files start with a header, counted in the size of the file */
+static int wk_write_header(struct wk_sink *sink) {
+    unsigned char h[WK_FIX_HEADER];
+    uint32_t w = (uint32_t)sink->width;
+
+    if (sink->format != WK_FMT_FIXED)
+        return 0;
+    memcpy(h, WK_FIX_MAGIC, 8);
+    h[8] = (unsigned char)w;
+    h[9] = (unsigned char)(w >> 8);
+    h[10] = (unsigned char)(w >> 16);
+    h[11] = (unsigned char)(w >> 24);
+    h[12] = WK_FIX_HEADER;
+    h[13] = h[14] = h[15] = 0;
+    if (wk_write_all(sink, (const char *)h, sizeof(h)) == -1)
+        return -1;
+    sink->bytes += sizeof(h);
+    sink->fbytes += sizeof(h);
+    return 0;
+}
+
+/* text, nul, varint or fixed[:width], a width of 0 is left to the caller */
+int wk_format_parse(const char *spec, int *format, size_t *width) {
+    char *end;
+
+    *width = 0;
+    if (strcmp(spec, "text") == 0) {
+        *format = WK_FMT_TEXT;
+    } else if (strcmp(spec, "nul") == 0) {
+        *format = WK_FMT_NUL;
+    } else if (strcmp(spec, "varint") == 0) {
+        *format = WK_FMT_VARINT;
+    } else if (strncmp(spec, "fixed", 5) == 0 && (spec[5] == '\0' || spec[5] == ':')) {
+        *format = WK_FMT_FIXED;
+        if (spec[5] == ':') {
+            errno = 0;
+            *width = strtoul(spec + 6, &end, 10);
+            if (errno != 0 || end == spec + 6 || *end != '\0' || *width == 0
+                || *width > 0x10000) {
+                fprintf(stderr,"sink: bad fixed width: %s\n", spec + 6);
+                return -1;
+            }
+        }
+    } else {
+        fprintf(stderr,"sink: unknown format %s, use text, nul, varint or fixed[:width]\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+/* room wk_sink_encode needs for len bytes holding at most nrec records */
+size_t wk_sink_encbound(const struct wk_sink *sink, size_t len, size_t nrec) {
+    if (sink->format == WK_FMT_FIXED)
+        return nrec * sink->width;
+    /* records are far below 2^21 bytes, so a length takes at most 3 bytes */
+    return len + 2 * nrec;
+}
+
+/*
+ * Rewrite len bytes of NUL terminated records to the binary format of the
+ * sink, runs in the workers.  Returns the bytes written to out, or NPOS if
+ * a record does not fit the fixed width.
+ */
+size_t wk_sink_encode(const struct wk_sink *sink, const char *in, size_t len, char *out) {
+    const char *p = in, *end = in + len, *nul;
+    char *o = out;
+    size_t rlen, v;
+
+    while (p < end) {
+        nul = memchr(p, '\0', (size_t)(end - p));
+        rlen = (size_t)(nul - p);
+        if (sink->format == WK_FMT_FIXED) {
+            if (rlen > sink->width)
+                return NPOS;
+            memcpy(o, p, rlen);
+            memset(o + rlen, 0, sink->width - rlen);
+            o += sink->width;
+        } else {
+            for (v = rlen; v >= 0x80; v >>= 7)
+                *o++ = (char)(v | 0x80);
+            *o++ = (char)v;
+            memcpy(o, p, rlen);
+            o += rlen;
+        }
+        p = nul + 1;
+    }
+    return (size_t)(o - out);
+}
+
+/* size of the record at p, its text goes to *text and *tlen */
+static size_t wk_next_rec(const struct wk_sink *sink, const char *p, const char *end,
+                          const char **text, size_t *tlen) {
+    const unsigned char *u = (const unsigned char *)p;
+    size_t v = 0, n = 0;
+    int shift = 0;
+
+    switch (sink->format) {
+    case WK_FMT_VARINT:
+        do {
+            v |= (size_t)(u[n] & 0x7f) << shift;
+            shift += 7;
+        } while (u[n++] & 0x80);
+        *text = p + n;
+        *tlen = v;
+        return n + v;
+    case WK_FMT_FIXED:
+        *text = p;
+        *tlen = strnlen(p, sink->width);
+        return sink->width;
+    default:
+        *text = p;
+        *tlen = (size_t)((const char *)memchr(p, wk_eol, (size_t)(end - p)) - p);
+        return *tlen + 1;
+    }
+}
+
+const char *wk_compress_ext(const char *algo) {
+    if (algo == NULL) return "";
+    if (strcmp(algo, "gzip") == 0) return ".gz";
+    if (strcmp(algo, "bzip2") == 0) return ".bz2";
+    if (strcmp(algo, "lzma") == 0) return ".lzma";
+    if (strcmp(algo, "7z") == 0) return ".7z";
+    return "";
+}
+
+/* shell command that compresses its standard input with algo into path */
+void wk_compress_cmd(const char *algo, const char *path, char *cmd, size_t size) {
+    if (strcmp(algo, "7z") == 0)
+        snprintf(cmd, size, "7z a -si -bd '%s' > /dev/null", path);
+    else
+        snprintf(cmd, size, "%s -c > '%s'", algo, path);
+}
+
+static int wk_sink_openfile(struct wk_sink *sink, int append) {
+    char path[PATH_MAX];
+    char cmd[PATH_MAX + 64];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s%s", sink->fpath, wk_compress_ext(sink->compressalgo));
+    /* a resumed seekable file was set up by wk_seek_resume */
+    if (!(append && sink->seekable)) {
+        sink->fbytes = 0;
+        sink->flines = 0;
+        sink->first[0] = '\0';
+        sink->last[0] = '\0';
+    }
+
+    if (sink->compressalgo != NULL && !sink->seekable) {
+        wk_compress_cmd(sink->compressalgo, path, cmd, sizeof(cmd));
+        if ((sink->pipe = popen(cmd, "w")) == NULL) {
+            fprintf(stderr,"sink: can't start %s: %s\n", sink->compressalgo, strerror(errno));
+            return -1;
+        }
+        sink->fd = fileno(sink->pipe);
+        return wk_write_header(sink);
+    }
+
+    if (append && !sink->seekable) {
+        /* the first line names the file once it is complete */
+        if ((fp = fopen(path, "r")) != NULL) {
+            if (fgets(sink->first, (int)sizeof(sink->first), fp) != NULL)
+                sink->first[strcspn(sink->first, "\n")] = '\0';
+            (void)fclose(fp);
+        }
+    }
+
+    sink->fd = open(path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+    if (sink->fd == -1) {
+        fprintf(stderr,"sink: File %s could not be opened\n", path);
+        fprintf(stderr,"The problem is = %s\n", strerror(errno));
+        return -1;
+    }
+    return wk_write_header(sink);
+}
+
+/*
+ * Close the current file and give it its final name, either the -o
+ * filename or firstline-lastline.txt when -o START or -b/-c is used.
+ */
+static int wk_sink_closefile(struct wk_sink *sink) {
+    char from[PATH_MAX], to[PATH_MAX];
+    const char *ext = wk_compress_ext(sink->compressalgo);
+    const char *base;
+    size_t dirlen;
+    int rc = 0;
+
+    if (sink->pipe != NULL) {
+        if (pclose(sink->pipe) != 0) {
+            fprintf(stderr,"sink: %s failed\n", sink->compressalgo);
+            rc = -1;
+        }
+        sink->pipe = NULL;
+    } else if (close(sink->fd) != 0) {
+        fprintf(stderr,"sink: close returned error number = %d\n", errno);
+        fprintf(stderr,"The problem is = %s\n", strerror(errno));
+        rc = -1;
+    }
+    sink->fd = -1;
+
+    base = strrchr(sink->outputf, '/');
+    base = base ? base + 1 : sink->outputf;
+    dirlen = strlen(sink->fpath) - strlen("START");
+
+    snprintf(from, sizeof(from), "%s%s", sink->fpath, ext);
+    if (sink->bytelimit || sink->linelimit || strcmp(base, "START") == 0)
+        snprintf(to, sizeof(to), "%.*s%s-%s.txt%s", (int)dirlen, sink->fpath, sink->first, sink->last, ext);
+    else
+        snprintf(to, sizeof(to), "%s%s", sink->outputf, ext);
+
+    if (strcmp(from, to) != 0 && rename(from, to) != 0) {
+        fprintf(stderr,"sink: can't rename %s to %s: %s\n", from, to, strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+static int wk_write_all(struct wk_sink *sink, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(sink->fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EPIPE) {
+                sink->broken = 1;
+                return -1;
+            }
+            fprintf(stderr,"sink: write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void wk_copy_line(char *dst, const char *rec, size_t len) {
+    if (len > MAXSTRING*WK_MBMAX)
+        len = MAXSTRING*WK_MBMAX;
+    memcpy(dst, rec, len);
+    dst[len] = '\0';
+}
+
+/*
+ * fpath NULL writes to stdout.  The caller zeroes the sink and sets
+ * bytelimit/linelimit before opening it.
+ */
+int wk_sink_open(struct wk_sink *sink, const char *fpath, const char *outputf,
+                 const char *compressalgo, int append) {
+    sink->fd = STDOUT_FILENO;
+    sink->pipe = NULL;
+    sink->fpath = fpath;
+    sink->outputf = outputf;
+    sink->compressalgo = compressalgo;
+
+    if (fpath == NULL)
+        return wk_write_header(sink);
+    return wk_sink_openfile(sink, append);
+}
+
+/* write nrec complete records, the file is split on record boundaries if -b or -c was given */
+int wk_sink_write(struct wk_sink *sink, const char *buf, size_t len, size_t nrec) {
+    const char *end = buf + len;
+    const char *p, *text, *span, *lastrec = NULL;
+    size_t reclen, tlen, lastlen = 0;
+
+    if (len == 0)
+        return 0;
+    if (sink->tee != NULL && wk_tee_write(sink->tee, buf, len, nrec) == -1)
+        return -1;
+
+    if (sink->fpath == NULL || (sink->bytelimit == 0 && sink->linelimit == 0)) {
+        if (sink->fpath != NULL) {
+            if (sink->flines == 0) {
+                (void)wk_next_rec(sink, buf, end, &text, &tlen);
+                wk_copy_line(sink->first, text, tlen);
+            }
+            if (sink->format == WK_FMT_VARINT) {
+                /* lengths only read forwards */
+                for (p = buf; p < end; p += reclen)
+                    reclen = wk_next_rec(sink, p, end, &text, &tlen);
+            } else if (sink->format == WK_FMT_FIXED) {
+                (void)wk_next_rec(sink, end - sink->width, end, &text, &tlen);
+            } else {
+                for (p = end - 1; p > buf && p[-1] != wk_eol; p--)
+                    ;
+                text = p;
+                tlen = (size_t)(end - 1 - p);
+            }
+            wk_copy_line(sink->last, text, tlen);
+        }
+        if (wk_write_all(sink, buf, len) == -1)
+            return -1;
+        sink->bytes += len;
+        sink->lines += nrec;
+        sink->fbytes += len;
+        sink->flines += nrec;
+        return 0;
+    }
+
+    for (span = p = buf; p < end; p += reclen) {
+        reclen = wk_next_rec(sink, p, end, &text, &tlen);
+
+        if (sink->flines > 0
+            && ((sink->bytelimit && sink->fbytes + reclen > sink->bytelimit)
+                || (sink->linelimit && sink->flines >= sink->linelimit))) {
+            if (lastrec != NULL)
+                wk_copy_line(sink->last, lastrec, lastlen);
+            if (wk_write_all(sink, span, (size_t)(p - span)) == -1)
+                return -1;
+            if (wk_sink_closefile(sink) == -1 || wk_sink_openfile(sink, 0) == -1)
+                return -1;
+            span = p;
+        }
+
+        if (sink->flines == 0)
+            wk_copy_line(sink->first, text, tlen);
+        lastrec = text;
+        lastlen = tlen;
+        sink->fbytes += reclen;
+        sink->flines++;
+        sink->bytes += reclen;
+        sink->lines++;
+    }
+
+    if (lastrec != NULL)
+        wk_copy_line(sink->last, lastrec, lastlen);
+    return wk_write_all(sink, span, (size_t)(end - span));
+}
+
+/* one frame of seekable output, buf holds its lines for the file name */
+int wk_sink_frame(struct wk_sink *sink, const char *frame, size_t flen, const char *buf,
+                  size_t len, const struct wk_frame *f) {
+    struct wk_frame *tmp;
+    const char *p;
+
+    if (sink->nframes == sink->cframes) {
+        sink->cframes = sink->cframes ? sink->cframes * 2 : 1024;
+        if ((tmp = realloc(sink->frames, sink->cframes * sizeof(*tmp))) == NULL) {
+            fprintf(stderr,"sink: can't allocate memory for the frame index\n");
+            return -1;
+        }
+        sink->frames = tmp;
+    }
+    if (sink->tee != NULL && wk_tee_write(sink->tee, buf, len, f->nrec) == -1)
+        return -1;
+    if (sink->fpath != NULL && len > 0) {
+        if (sink->flines == 0)
+            wk_copy_line(sink->first, buf, (size_t)((const char *)memchr(buf, '\n', len) - buf));
+        for (p = buf + len - 1; p > buf && p[-1] != '\n'; p--)
+            ;
+        wk_copy_line(sink->last, p, (size_t)(buf + len - 1 - p));
+    }
+    if (wk_write_all(sink, frame, flen) == -1)
+        return -1;
+    sink->frames[sink->nframes] = *f;
+    sink->frames[sink->nframes++].off = sink->fbytes;
+    sink->bytes += flen;
+    sink->fbytes += flen;
+    sink->lines += f->nrec;
+    sink->flines += f->nrec;
+    return 0;
+}
+
+/* the frame index goes at the end of seekable output */
+static int wk_seek_finish(struct wk_sink *sink) {
+    char *buf;
+    size_t len;
+    int rc = -1;
+
+    if (sink->broken)
+        return 0;
+    if ((len = wk_seek_index(sink->frames, sink->nframes, sink->fbytes, &buf)) > 0) {
+        rc = wk_write_all(sink, buf, len);
+        free(buf);
+    }
+    free(sink->frames);
+    sink->frames = NULL;
+    sink->nframes = sink->cframes = 0;
+    return rc;
+}
+
+int wk_sink_close(struct wk_sink *sink) {
+    int rc = 0;
+
+    if (sink->seekable && sink->fd != -1 && wk_seek_finish(sink) == -1)
+        rc = -1;
+    if (wk_tee_close(sink->tee) == -1)
+        rc = -1;
+    sink->tee = NULL;
+    if (sink->fpath == NULL || sink->fd == -1)
+        return rc;
+    return wk_sink_closefile(sink) == -1 ? -1 : rc;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+#include <time.h>
+
+/*
+ * Pipeline counters (--stats).  Every pool worker adds to its own slot
+ * once per chunk, so counting costs two clock reads per stage per chunk
+ * and no shared cache lines.  The summary goes to stderr at the end.
+ */
+
+static double wk_pct(uint64_t part, uint64_t whole);
+static double wk_rate(uint64_t count, uint64_t ns);
+
+uint64_t wk_now_ns(void) {
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static double wk_pct(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+/* count per second of ns */
+static double wk_rate(uint64_t count, uint64_t ns) {
+    return ns ? (double)count * 1e9 / (double)ns : 0.0;
+}
+
+void wk_stats_report(const struct wk_stats *st) {
+    struct wk_wstats sum;
+    const struct wk_wstats *w;
+    uint64_t busy, wall = st->end_ns - st->start_ns;
+    int t;
+
+    memset(&sum, 0, sizeof(sum));
+    for (t = 0; t < st->nthreads; t++) {
+        w = &st->w[t];
+        sum.chunks += w->chunks;
+        sum.cands += w->cands;
+        sum.rejected += w->rejected;
+        sum.filtered += w->filtered;
+        sum.records += w->records;
+        sum.bytes += w->bytes;
+        sum.stalls += w->stalls;
+        sum.gen_ns += w->gen_ns;
+        sum.filter_ns += w->filter_ns;
+        sum.encode_ns += w->encode_ns;
+        sum.compress_ns += w->compress_ns;
+        sum.wait_ns += w->wait_ns;
+        sum.write_ns += w->write_ns;
+    }
+    busy = sum.gen_ns + sum.filter_ns + sum.encode_ns + sum.compress_ns + sum.wait_ns + sum.write_ns;
+
+    fprintf(stderr, "\nStats: %d worker%s, %.3f s, %llu lines, %.1f MB (%.1f MB/s)\n",
+            st->nthreads, st->nthreads == 1 ? "" : "s", (double)wall / 1e9,
+            (unsigned long long)sum.records, (double)sum.bytes / 1e6,
+            wk_rate(sum.bytes, wall) / 1e6);
+    fprintf(stderr, "  time: generate %.1f%%, filter %.1f%%, encode %.1f%%, compress %.1f%%, "
+            "write %.1f%%, waiting for turn %.1f%%\n",
+            wk_pct(sum.gen_ns, busy), wk_pct(sum.filter_ns, busy), wk_pct(sum.encode_ns, busy),
+            wk_pct(sum.compress_ns, busy), wk_pct(sum.write_ns, busy), wk_pct(sum.wait_ns, busy));
+    fprintf(stderr, "  chunks: %llu, %llu stalled with a full buffer waiting for the writer\n",
+            (unsigned long long)sum.chunks, (unsigned long long)sum.stalls);
+    fprintf(stderr, "  candidates: %llu, %llu rejected by -d, %llu dropped by the filter\n",
+            (unsigned long long)sum.cands, (unsigned long long)sum.rejected,
+            (unsigned long long)sum.filtered);
+
+    fprintf(stderr, "  %6s %8s %12s %12s %10s %8s\n",
+            "worker", "chunks", "candidates", "gen c/s", "write MB/s", "stalls");
+    for (t = 0; t < st->nthreads; t++) {
+        w = &st->w[t];
+        fprintf(stderr, "  %6d %8llu %12llu %12.0f %10.1f %8llu\n", t,
+                (unsigned long long)w->chunks, (unsigned long long)w->cands,
+                wk_rate(w->cands, w->gen_ns), wk_rate(w->bytes, w->write_ns) / 1e6,
+                (unsigned long long)w->stalls);
+    }
+}
@@ -0,0 +1,562 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Extra outputs of one generation pass (--tee kind[,opt...]:target).
+ *
+ *   file:path           the records as the sink writes them
+ *   gzip|bzip2|lzma|7z:path   the same, through the compressor
+ *   pipe:command        to the standard input of a shell command
+ *   shm:name            to a shared memory ring read by bfc ring name
+ *
+ * Options: block (the default) or drop for what happens when the output
+ * falls behind, buf=size for how far it may fall behind (default 64m),
+ * and size=size for the capacity of a shm ring (default 16m).
+ *
+ * Every chunk the sink writes is copied once into a block shared by all
+ * the outputs, each of which holds a reference until its own thread has
+ * written it.  An output at its buf limit either makes the sink wait for
+ * it (block) or misses whole chunks (drop), so records are never cut.
+ * An output whose reader goes away is dropped from the rest of the run.
+ *
+ * The ring is a header followed by the data.  head and tail count every
+ * byte ever written and read, the writer only moves head and the reader
+ * only moves tail, so neither takes a lock.  The reader removes the
+ * segment once it has read everything after done is set.
+ */
+
+#define WK_TEE_BUF      (64ULL << 20)   /* default bytes an output may fall behind */
+#define WK_RING_SIZE    (16ULL << 20)   /* default capacity of a shm ring */
+#define WK_RING_MAGIC   "BFCRING1"
+#define WK_RING_POLL    100000          /* ns between looks at a full or empty ring */
+
+#define WK_TEE_FILE     0
+#define WK_TEE_COMPRESS 1
+#define WK_TEE_PIPE     2
+#define WK_TEE_SHM      3
+
+struct wk_ring {
+    char magic[8];
+    uint64_t size;                      /* bytes of data after the header */
+    uint64_t head;                      /* written so far */
+    uint64_t tail;                      /* read so far */
+    uint32_t done;                      /* no more is written */
+    int32_t reader;                     /* pid of the reader, 0 until one attaches */
+    char pad[24];
+};
+
+/* one chunk, shared by every output that queued it */
+struct wk_tblock {
+    size_t len, nrec;
+    size_t refs;
+    char data[];
+};
+
+struct wk_tout {
+    const char *spec;
+    int kind;
+    const char *target;
+    int drop;                           /* miss chunks instead of waiting */
+    size_t limit;                       /* bytes queued at most */
+    size_t ringsize;
+    int fd;
+    FILE *pipe;
+    struct wk_ring *ring;
+    size_t mapsize;
+    pthread_t tid;
+    int started;
+    struct wk_tblock **q;               /* circular, qhead is the oldest */
+    size_t qcap, qhead, qlen;
+    size_t queued;                      /* bytes in q */
+    uint64_t lines, dropped;
+    int broken, error;
+    pthread_cond_t avail, space;
+};
+
+struct wk_tee {
+    struct wk_tout out[WK_MAXTEES];
+    size_t n;
+    pthread_mutex_t lock;
+    int closing;
+};
+
+static int wk_tee_size(const char *s, size_t len, size_t *v);
+static int wk_tee_parse(const char *spec, struct wk_tout *o);
+static int wk_tee_start(struct wk_tout *o);
+static int wk_tee_put(struct wk_tee *tee, struct wk_tout *o, const char *buf, size_t len);
+static int wk_ring_put(struct wk_tee *tee, struct wk_tout *o, const char *buf, size_t len);
+static void *wk_tee_thread(void *arg);
+
+struct wk_targ {
+    struct wk_tee *tee;
+    struct wk_tout *o;
+};
+
+/* a number with an optional k, m or g */
+static int wk_tee_size(const char *s, size_t len, size_t *v) {
+    char num[32], *end;
+    unsigned long long n;
+
+    if (len == 0 || len >= sizeof(num))
+        return -1;
+    memcpy(num, s, len);
+    num[len] = '\0';
+    errno = 0;
+    n = strtoull(num, &end, 10);
+    if (errno != 0 || end == num)
+        return -1;
+    switch (tolower((unsigned char)*end)) {
+    case 'k': n <<= 10; end++; break;
+    case 'm': n <<= 20; end++; break;
+    case 'g': n <<= 30; end++; break;
+    }
+    if (*end != '\0' || n == 0)
+        return -1;
+    *v = (size_t)n;
+    return 0;
+}
+
+static int wk_tee_parse(const char *spec, struct wk_tout *o) {
+    const char *colon = strchr(spec, ':'), *p, *q;
+    size_t klen;
+
+    memset(o, 0, sizeof(*o));
+    o->spec = spec;
+    o->fd = -1;
+    o->limit = WK_TEE_BUF;
+    o->ringsize = WK_RING_SIZE;
+    if (colon == NULL || colon[1] == '\0') {
+        fprintf(stderr,"tee: %s must be kind[,option...]:target\n", spec);
+        return -1;
+    }
+    o->target = colon + 1;
+
+    klen = strcspn(spec, ",:");
+    if (klen == 4 && strncmp(spec, "file", 4) == 0) {
+        o->kind = WK_TEE_FILE;
+    } else if (klen == 4 && strncmp(spec, "pipe", 4) == 0) {
+        o->kind = WK_TEE_PIPE;
+    } else if (klen == 3 && strncmp(spec, "shm", 3) == 0) {
+        o->kind = WK_TEE_SHM;
+        if (strchr(o->target, '/') != NULL || strlen(o->target) > NAME_MAX - 1) {
+            fprintf(stderr,"tee: the name of a shm ring can not contain a /\n");
+            return -1;
+        }
+    } else if ((klen == 4 && strncmp(spec, "gzip", 4) == 0)
+               || (klen == 5 && strncmp(spec, "bzip2", 5) == 0)
+               || (klen == 4 && strncmp(spec, "lzma", 4) == 0)
+               || (klen == 2 && strncmp(spec, "7z", 2) == 0)) {
+        o->kind = WK_TEE_COMPRESS;
+    } else {
+        fprintf(stderr,"tee: unknown kind in %s, use file, pipe, shm, gzip, bzip2, lzma or 7z\n",
+                spec);
+        return -1;
+    }
+
+    for (p = spec + klen; p < colon; p = q) {
+        p++;
+        q = p + strcspn(p, ",:");
+        if (q - p == 5 && strncmp(p, "block", 5) == 0) {
+            o->drop = 0;
+        } else if (q - p == 4 && strncmp(p, "drop", 4) == 0) {
+            o->drop = 1;
+        } else if (strncmp(p, "buf=", 4) == 0) {
+            if (wk_tee_size(p + 4, (size_t)(q - p - 4), &o->limit) == -1)
+                goto bad;
+        } else if (strncmp(p, "size=", 5) == 0 && o->kind == WK_TEE_SHM) {
+            if (wk_tee_size(p + 5, (size_t)(q - p - 5), &o->ringsize) == -1)
+                goto bad;
+        } else {
+            goto bad;
+        }
+    }
+    return 0;
+
+bad:
+    fprintf(stderr,"tee: bad option in %s, use block, drop, buf=size or, for shm, size=size\n",
+            spec);
+    return -1;
+}
+
+/* open the target of one output */
+static int wk_tee_start(struct wk_tout *o) {
+    char cmd[PATH_MAX + 64], name[NAME_MAX + 1];
+    struct wk_ring *r;
+    size_t kl;
+    int fd;
+
+    switch (o->kind) {
+    case WK_TEE_FILE:
+        o->fd = open(o->target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        break;
+    case WK_TEE_COMPRESS:
+        kl = strcspn(o->spec, ",:");
+        snprintf(name, sizeof(name), "%.*s", (int)kl, o->spec);
+        wk_compress_cmd(name, o->target, cmd, sizeof(cmd));
+        if ((o->pipe = popen(cmd, "w")) != NULL)
+            o->fd = fileno(o->pipe);
+        break;
+    case WK_TEE_PIPE:
+        if ((o->pipe = popen(o->target, "w")) != NULL)
+            o->fd = fileno(o->pipe);
+        break;
+    case WK_TEE_SHM:
+        /* a ring left over from an earlier run is replaced */
+        snprintf(name, sizeof(name), "/%s", o->target);
+        (void)shm_unlink(name);
+        o->mapsize = sizeof(*r) + o->ringsize;
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1 || ftruncate(fd, (off_t)o->mapsize) == -1) {
+            if (fd != -1)
+                (void)close(fd);
+            break;
+        }
+        r = mmap(NULL, o->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        (void)close(fd);
+        if (r == MAP_FAILED)
+            break;
+        r->size = o->ringsize;
+        memcpy(r->magic, WK_RING_MAGIC, 8);
+        o->ring = r;
+        return 0;
+    }
+    if (o->fd == -1) {
+        fprintf(stderr,"tee: can't open %s: %s\n", o->spec, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* 0 once written, 1 if a drop output skipped it, -1 if the output is gone */
+static int wk_tee_put(struct wk_tee *tee, struct wk_tout *o, const char *buf, size_t len) {
+    ssize_t n;
+
+    if (o->ring != NULL)
+        return wk_ring_put(tee, o, buf, len);
+    while (len > 0) {
+        n = write(o->fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE) {
+                fprintf(stderr,"tee: write to %s failed: %s\n", o->spec, strerror(errno));
+                o->error = 1;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Copy into the ring as the reader makes room.  A drop output skips a
+ * block it can't start on, and the ring is given up if its reader dies
+ * or if the run is over and nobody ever attached to a full ring.
+ */
+static int wk_ring_put(struct wk_tee *tee, struct wk_tout *o, const char *buf, size_t len) {
+    struct wk_ring *r = o->ring;
+    char *data = (char *)(r + 1);
+    struct timespec ts = { 0, WK_RING_POLL };
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED), tail;
+    size_t n, at, total = len;
+    int32_t pid;
+
+    while (len > 0) {
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head - tail == r->size) {
+            pid = __atomic_load_n(&r->reader, __ATOMIC_RELAXED);
+            if (pid != 0 && kill(pid, 0) == -1 && errno == ESRCH)
+                return -1;
+            if (pid == 0 && __atomic_load_n(&tee->closing, __ATOMIC_ACQUIRE))
+                return -1;
+            /* a record is never cut, so only a block not yet started is skipped */
+            if (o->drop && len == total)
+                return 1;
+            (void)nanosleep(&ts, NULL);
+            continue;
+        }
+        at = (size_t)(head % r->size);
+        n = (size_t)(r->size - (head - tail));
+        if (n > r->size - at)
+            n = r->size - at;
+        if (n > len)
+            n = len;
+        memcpy(data + at, buf, n);
+        head += n;
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *wk_tee_thread(void *arg) {
+    struct wk_targ *a = arg;
+    struct wk_tee *tee = a->tee;
+    struct wk_tout *o = a->o;
+    struct wk_tblock *b;
+    int broken, rc = -1;
+
+    pthread_mutex_lock(&tee->lock);
+    for (;;) {
+        while (o->qlen == 0 && !tee->closing)
+            pthread_cond_wait(&o->avail, &tee->lock);
+        if (o->qlen == 0)
+            break;
+        b = o->q[o->qhead];
+        broken = o->broken;
+        pthread_mutex_unlock(&tee->lock);
+
+        if (!broken && (rc = wk_tee_put(tee, o, b->data, b->len)) == -1)
+            broken = 1;
+
+        pthread_mutex_lock(&tee->lock);
+        o->qhead = (o->qhead + 1) % o->qcap;
+        o->qlen--;
+        o->queued -= b->len;
+        if (broken)
+            o->broken = 1;
+        if (broken || rc == 1)
+            o->dropped += b->nrec;
+        else
+            o->lines += b->nrec;
+        if (--b->refs == 0)
+            free(b);
+        pthread_cond_broadcast(&o->space);
+    }
+    pthread_mutex_unlock(&tee->lock);
+    free(a);
+    return NULL;
+}
+
+/* open every output of specs and start its writer */
+struct wk_tee *wk_tee_open(char **specs, size_t n) {
+    struct wk_tee *tee;
+    struct wk_tout *o;
+    struct wk_targ *a;
+    size_t i;
+
+    if (n > WK_MAXTEES) {
+        fprintf(stderr,"tee: at most %d outputs\n", WK_MAXTEES);
+        return NULL;
+    }
+    tee = calloc(1, sizeof(*tee));
+    if (tee == NULL) {
+        fprintf(stderr,"tee: can't allocate memory\n");
+        return NULL;
+    }
+    pthread_mutex_init(&tee->lock, NULL);
+    for (i = 0; i < n; i++) {
+        if (wk_tee_parse(specs[i], &tee->out[i]) == -1)
+            goto err;
+    }
+    for (i = 0; i < n; i++) {
+        o = &tee->out[i];
+        if (wk_tee_start(o) == -1)
+            goto err;
+        tee->n++;
+        pthread_cond_init(&o->avail, NULL);
+        pthread_cond_init(&o->space, NULL);
+        a = malloc(sizeof(*a));
+        if (a == NULL) {
+            fprintf(stderr,"tee: can't allocate memory\n");
+            goto err;
+        }
+        a->tee = tee;
+        a->o = o;
+        if (pthread_create(&o->tid, NULL, wk_tee_thread, a) != 0) {
+            fprintf(stderr,"tee: can't create the writer of %s\n", o->spec);
+            free(a);
+            goto err;
+        }
+        o->started = 1;
+    }
+    return tee;
+
+err:
+    (void)wk_tee_close(tee);
+    return NULL;
+}
+
+/* queue nrec records to every output, called in output order */
+int wk_tee_write(struct wk_tee *tee, const char *buf, size_t len, size_t nrec) {
+    struct wk_tblock *b, **q;
+    struct wk_tout *o;
+    size_t i, k, cap;
+
+    if (len == 0)
+        return 0;
+    b = malloc(sizeof(*b) + len);
+    if (b == NULL) {
+        fprintf(stderr,"tee: can't allocate memory for a block\n");
+        return -1;
+    }
+    memcpy(b->data, buf, len);
+    b->len = len;
+    b->nrec = nrec;
+    b->refs = 0;
+
+    pthread_mutex_lock(&tee->lock);
+    for (i = 0; i < tee->n; i++) {
+        o = &tee->out[i];
+        /* an empty queue always takes the block, however large */
+        while (!o->broken && !o->drop && o->queued > 0 && o->queued + len > o->limit)
+            pthread_cond_wait(&o->space, &tee->lock);
+        if (o->broken || (o->queued > 0 && o->queued + len > o->limit)) {
+            o->dropped += nrec;
+            continue;
+        }
+        if (o->qlen == o->qcap) {
+            cap = o->qcap ? 2 * o->qcap : 16;
+            q = malloc(cap * sizeof(*q));
+            if (q == NULL) {
+                o->dropped += nrec;
+                continue;
+            }
+            for (k = 0; k < o->qlen; k++)
+                q[k] = o->q[(o->qhead + k) % o->qcap];
+            free(o->q);
+            o->q = q;
+            o->qcap = cap;
+            o->qhead = 0;
+        }
+        o->q[(o->qhead + o->qlen) % o->qcap] = b;
+        o->qlen++;
+        o->queued += len;
+        b->refs++;
+        pthread_cond_signal(&o->avail);
+    }
+    if (b->refs == 0)
+        free(b);
+    pthread_mutex_unlock(&tee->lock);
+    return 0;
+}
+
+/* drain and close every output, -1 if one of them failed */
+int wk_tee_close(struct wk_tee *tee) {
+    struct wk_tout *o;
+    char name[NAME_MAX + 1];
+    size_t i;
+    int rc = 0;
+
+    if (tee == NULL)
+        return 0;
+    pthread_mutex_lock(&tee->lock);
+    /* read without the lock by a writer waiting on a full ring */
+    __atomic_store_n(&tee->closing, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < tee->n; i++)
+        pthread_cond_broadcast(&tee->out[i].avail);
+    pthread_mutex_unlock(&tee->lock);
+
+    for (i = 0; i < tee->n; i++) {
+        o = &tee->out[i];
+        if (o->started)
+            pthread_join(o->tid, NULL);
+        if (o->ring != NULL) {
+            __atomic_store_n(&o->ring->done, 1, __ATOMIC_RELEASE);
+            (void)munmap(o->ring, o->mapsize);
+        } else if (o->pipe != NULL) {
+            if (pclose(o->pipe) != 0 && !o->broken) {
+                fprintf(stderr,"tee: %s failed\n", o->spec);
+                rc = -1;
+            }
+        } else if (o->fd != -1 && close(o->fd) != 0) {
+            fprintf(stderr,"tee: close of %s failed: %s\n", o->spec, strerror(errno));
+            rc = -1;
+        }
+        if (o->error)
+            rc = -1;
+        if (o->broken || o->dropped > 0)
+            fprintf(stderr,"tee: %s got %llu lines, dropped %llu%s\n", o->spec,
+                    (unsigned long long)o->lines, (unsigned long long)o->dropped,
+                    o->broken ? ", its reader went away or never came" : "");
+        if (o->ring != NULL && o->broken) {
+            snprintf(name, sizeof(name), "/%s", o->target);
+            (void)shm_unlink(name);
+        }
+        pthread_cond_destroy(&o->avail);
+        pthread_cond_destroy(&o->space);
+        free(o->q);
+    }
+    pthread_mutex_destroy(&tee->lock);
+    free(tee);
+    return rc;
+}
+
+/* bfc ring name: copy a shm ring to stdout until its writer is done */
+int wk_ring_read(const char *target) {
+    char name[NAME_MAX + 1];
+    struct timespec ts = { 0, WK_RING_POLL };
+    struct wk_ring *r;
+    struct stat st;
+    uint64_t head, tail;
+    size_t n, at;
+    ssize_t w;
+    char *data;
+    int fd;
+
+    snprintf(name, sizeof(name), "/%s", target);
+    /* the writer may not have created it yet */
+    while ((fd = shm_open(name, O_RDWR, 0)) == -1 && errno == ENOENT)
+        (void)nanosleep(&ts, NULL);
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*r)) {
+        fprintf(stderr,"ring: can't open %s: %s\n", target, strerror(errno));
+        if (fd != -1)
+            (void)close(fd);
+        return -1;
+    }
+    r = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (r == MAP_FAILED || memcmp(r->magic, WK_RING_MAGIC, 8) != 0
+        || r->size != (uint64_t)st.st_size - sizeof(*r)) {
+        fprintf(stderr,"ring: %s is not a bfc ring\n", target);
+        return -1;
+    }
+    data = (char *)(r + 1);
+    __atomic_store_n(&r->reader, (int32_t)getpid(), __ATOMIC_RELAXED);
+
+    tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)
+                && __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+                break;
+            (void)nanosleep(&ts, NULL);
+            continue;
+        }
+        at = (size_t)(tail % r->size);
+        n = (size_t)(head - tail);
+        if (n > r->size - at)
+            n = r->size - at;
+        w = write(STDOUT_FILENO, data + at, n);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE)
+                fprintf(stderr,"ring: write failed: %s\n", strerror(errno));
+            break;
+        }
+        tail += (uint64_t)w;
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    (void)munmap(r, (size_t)st.st_size);
+    (void)shm_unlink(name);
+    return head == tail ? 0 : -1;
+}
@@ -15,35 +15,33 @@
  */
 #include "wkey.h"
 
-
-#define MAXSTRING   128             /* largest output string */
-#define MAXCSET     256             /* longest character set */
-#define NPOS        ((size_t)-1)    /* invalid index for size_t's */
+#define MAXMASKTOKENS   32              /* options and mask on one line of a mask file */
 
 static const wchar_t def_low_charset[] = L"abcdefghijklmnopqrstuvwxyz";
 static const wchar_t def_upp_charset[] = L"ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 static const wchar_t def_num_charset[] = L"0123456789";
 static const wchar_t def_sym_charset[] = L"!@#$%^&*()-_+=~`[]{}|\\:;\"'<>,.?/ ";
 
-static size_t inc[128];
 static size_t numofelements = 0;
 static size_t inverted = 0;                 /* 0 for normal output 1 for aaa,baa,caa,etc */
 static unsigned long long bytecount = 0;    /* user specified break output into size */
 static unsigned long long linecount = 0;    /* user specified break output into count lines */
 static options_type options;                /* store validated parameters passed to the program */
+static struct wk_arena setup;               /* option and pattern state of options and the -m masks */
 static struct thread_data my_thread;
 
-/*
- * Need a largish global buffer for converting wide chars to multibyte
- * to avoid doing an alloc on every single output line
- * leading to heap frag.  Only alloc'd once at startup.
- * Size is MAXSTRING*MB_CUR_MAX+1
- */
-static char *gconvbuffer = NULL;
-static size_t gconvlen = 0;
+/* one line of a mask file (-m) */
+struct wk_maskjob {
+    options_type op;
+    struct wk_mask mask;
+    struct wk_source src;
+    size_t lineno;
+    size_t index;               /* number of the mask in the file, used by the checkpoint */
+    const char *ckpt;           /* checkpoint file */
+};
 
 static wchar_t *wk_dupwcs(const wchar_t *s);
-static void wk_copy_without_dupes(wchar_t *dest, wchar_t *src);
+static void wk_copy_without_dupes(wchar_t *dest, const wchar_t *src);
 static size_t wk_force_wide_string(wchar_t *wout, const char *s, size_t n);
 static size_t wk_make_wide_string(wchar_t *wout, 
                                 const char *s, 
@@ -52,32 +50,59 @@ static size_t wk_make_wide_string(wchar_t *wout,
 static int wk_copy(wchar_t *dest, const char *src, int *is_unicode);
 static int wk_parse_size(char *s, size_t *calc);
 static int wk_parse_number(const char *s, size_t max, size_t *calc);
+static int wk_parse_range(const char *s, uint64_t *first, uint64_t *last);
+static int wk_parse_krange(const char *s, size_t *kmin, size_t *kmax);
 static int wk_dupskip(const char *s, options_type *op);
 static wchar_t *wk_endstring(const char *s, int *is_unicode);
 static wchar_t *wk_alloc_wide_string(const char *s, int *is_unicode);
 static int wk_file(const char *s, char **fpath, char **tmpf, char **outputf);
 static int wk_wordarray(const char *s, wchar_t ***warray, char **argv, int i, int *is_unicode);
-static wchar_t **wk_readpermute(const char *filename, int *is_unicode);
 static int wk_copy_charset(int argc, char **argv, int *i, wchar_t **c, int *is_unicode);
 static int wk_check_member(const wchar_t *string1, const options_type *options);
-static int wk_check_start_end(wchar_t *cset, wchar_t *start, wchar_t *end);
 static int wk_default_literalstring(size_t max, wchar_t **wstr);
-static size_t wk_find_index(const wchar_t *cset, size_t clen, wchar_t tofind);
-static int wk_too_many_duplicates(const wchar_t *block, const options_type options);
+static int wk_too_many_duplicates(const wchar_t *block, const options_type *options);
 static int wk_fill_minmax_strings(options_type *options);
 static int wcstring_cmp(const void *a, const void *b);
-static void wk_fill_pattern_info(options_type *options);
-static wchar_t *wk_resumesession(const char *fpath, const wchar_t *charset);
+static int wk_fill_pattern_info(options_type *options);
+static wchar_t *wk_resumesession(const char *fpath);
+static int wk_resumeindex(const char *fpath);
+static int wk_mode_words(const char *wordfile, wchar_t **wordarray, const char *wordrules,
+                         int nthreads, struct wk_words *w);
+static int wk_class_of(wchar_t c);
+static int wk_user_charset(const char *s, struct wk_charset *cs, int *is_unicode);
+static int wk_compile_charset(struct wk_charset *cs);
+static int wk_compile_pattern(options_type *op);
+static int wk_split_line(char *line, char **tok, int maxtok);
+static int wk_readmasks(const char *filename, const options_type *base, size_t min, size_t max,
+                        struct wk_maskjob **jobs, size_t *njobs, int *is_unicode);
+static int wk_mask_done(struct wk_segment *seg, struct wk_sink *sink);
+static int wk_run_range(struct wk_segment *seg, const struct wk_mask *mask, struct wk_sink *sink,
+                        int nthreads, const struct wk_placement *place);
+static int wk_lease_loop(const char *path, const char *key, struct wk_segment *seg,
+                         const struct wk_mask *mask, struct wk_sink *sink, int nthreads,
+                         const struct wk_placement *place);
+static uint64_t wk_fnv(uint64_t h, const void *p, size_t n);
+static uint64_t wk_job_hash(const options_type *op, const struct wk_words *w, size_t nw,
+                            char *const *strs, size_t nstrs);
+static int wk_maskqueue(struct wk_maskjob *jobs, size_t njobs, const char *ckpt, int resume,
+                        struct wk_sink *sink, const char *fpath, const char *outputf,
+                        const char *compressalgo, int nthreads,
+                        const struct wk_placement *place);
 
 /*
  * init validated parameters passed to the program
  */
 void wk_init_option(options_type *op) {
-    op->low_charset = NULL;
-    op->upp_charset = NULL;
-    op->num_charset = NULL;
-    op->sym_charset = NULL;
+    for (int i = 0; i < WK_NCHARSETS; i++) {
+        op->charsets[i].cset = NULL;
+        op->charsets[i].clen = 0;
+        op->charsets[i].duplicates = NPOS;
+    }
+    memset(&op->cindex, 0, sizeof(op->cindex));
     op->pattern = NULL;
+    op->plen = 0;
+    op->pclass = NULL;
+    op->pchars = NULL;
     op->literalstring = NULL;
     op->startstring = NULL;
     op->endstring = NULL;
@@ -86,9 +111,6 @@ void wk_init_option(options_type *op) {
     op->min_string = NULL;
     op->max_string = NULL;
     op->pattern_info = NULL;
-
-    for (int i = 0; i < 4; i++)
-        op->duplicates[i] = NPOS;
 }
 
 int main(int argc, char **argv) {
@@ -98,7 +120,7 @@ int main(int argc, char **argv) {
     wchar_t *endstr = NULL;         /* hold -e option */
     wchar_t *literalstring = NULL;  /* user passed something using -l */
     int is_unicode = 0;
-    size_t flag = 0;                /* 0 for chunk 1 for permute */
+    size_t flag = 0;                /* 0 chunk, 1 permute, 2 hybrid, 3 combinator */
     size_t flag4 = 0;               /* 0 don't create thread, 1 create print % done thread */
     size_t resume = 0;              /* 0 new session 1 for resume */
     char *outputf = NULL;           /* user specified filename to write output to */
@@ -108,42 +130,132 @@ int main(int argc, char **argv) {
     wchar_t *startblock = NULL;     /* user specified starting point */
     wchar_t *pattern = NULL;        /* user specified pattern */
     char *compressalgo = NULL;      /* user specified compression program */
-    char *tempfilename = NULL;
-    wchar_t *charset;               /* character set */
-    wchar_t *upp_charset = NULL;
-    wchar_t *num_charset = NULL;
-    wchar_t *sym_charset = NULL;
+    char *maskfile = NULL;          /* user specified file of masks */
+    char *ckpt = NULL;              /* checkpoint of the mask file */
+    struct wk_charset *charset;     /* character set registry */
+    struct wk_maskjob *jobs = NULL; /* masks read from maskfile */
+    size_t njobs = 0;
+    struct wk_mask mask;
+    struct wk_source src;           /* mask expansions */
+    struct wk_source hsrc;          /* hybrid of words and mask */
+    struct wk_words words;
+    int hybrid = -1;                /* -y order, -1 if not in hybrid mode */
+    char *klist[WK_MAXLISTS];       /* word lists of the combinator */
+    size_t nklist = 0;
+    char *ksep = NULL;              /* separator between combined words */
+    struct wk_words lists[WK_MAXLISTS];
+    char *hashspec = NULL;          /* -H algo:file */
+    char *rulesfile = NULL;         /* --rules, mangle every candidate */
+    char *wordrules = NULL;         /* --word-rules, mangle the -p/-q words */
+    struct wk_filter rfilter;
+    char *markov = NULL;            /* -M [prev:|pos:]statsfile */
+    char *wordfile = NULL;          /* -q word list, sorted by wk_words_sorted */
+    char *trainfile = NULL;         /* -T word list to train markov stats from */
+    size_t mklevel = 0;             /* -v highest markov level, 0 for all */
+    struct wk_source msrc;          /* mask in markov order */
+    char *xrules[WK_MAXEXCLUDE];    /* --exclude forbidden substrings */
+    char *xfiles[WK_MAXEXCLUDE];    /* --exclude-file files of them */
+    size_t nxrules = 0, nxfiles = 0;
+    struct wk_source xsrc;          /* mask without the excluded candidates */
+    int gray = 0;                   /* --gray order, 2 with --delta records */
+    struct wk_source gsrc;          /* mask in gray code order */
+    char *shufkey = NULL;           /* -R key of the random order */
+    struct wk_source rsrc;          /* any of the above in random order */
+    struct wk_source psrc;          /* permutations of the words */
+    int permmode = -1;              /* -A or -C, -1 to permute all the words */
+    size_t kmin = 0, kmax = 0;      /* words picked by -A or -C */
+    uint64_t xfirst = 0, xlast = UINT64_MAX;    /* -x index range */
+    int byindex;                    /* resume and -x count candidates by index */
+    struct wk_filter hfilter;
+    struct wk_segment seg;
+    struct wk_sink sink;
+    uint64_t skip = 0;              /* candidates already written by a resumed session */
+    long nthreads;                  /* number of generator threads */
+    struct wk_placement place;      /* -a worker cpus, -g huge page buffers */
+    char *placespec = NULL;
+    struct wk_stats stats;          /* --stats pipeline counters */
+    int showstats = 0;
+    int autotune = 0;               /* --autotune calibrates and exits */
+    int jset = 0;                   /* -j given, the tuned profile is not used */
+    char shape[128];                /* profile key of the job */
+    int format = WK_FMT_TEXT;       /* --format of the records */
+    size_t width = 0;               /* record width of --format fixed, 0 to size it */
+    char *servepath = NULL;         /* bfc serve socket, hand out leases of the job */
+    char *leasepath = NULL;         /* bfc lease socket, generate the leases of a server */
+    uint64_t leasesize = 0;         /* --lease-size candidates per lease, 0 for the default */
+    unsigned long leasettl = 0;     /* --lease-ttl seconds, 0 for the default */
+    char key[128];                  /* keyspace a server and its consumers agree on */
+    char *kstrs[4 + 2*WK_MAXEXCLUDE];   /* options that change the candidates, for the key */
+    size_t nkstrs;
+    char kmode[32];
+    int seekable = 0;               /* --seekable gzip frames with an index */
+    char seekpath[PATH_MAX];        /* the file a seekable session resumes */
+    char *tees[WK_MAXTEES];         /* --tee outputs fed the same records, see tee.c */
+    size_t ntees = 0;
+    uint64_t next;                  /* candidate it resumes from */
+    const char *base;
+    int n, rc;
+
+    /* bfc extract file first [count], bfc verify file: seekable output */
+    if (argc >= 3 && strcmp(argv[1], "verify") == 0)
+        return wk_seek_verify(argv[2]) == -1 ? EXIT_FAILURE : 0;
+    if (argc >= 4 && strcmp(argv[1], "extract") == 0)
+        return wk_seek_extract(argv[2], strtoull(argv[3], NULL, 10),
+                               argc >= 5 ? strtoull(argv[4], NULL, 10) : UINT64_MAX) == -1 ? EXIT_FAILURE : 0;
+    /* bfc ring name: the reader of a --tee shm:name ring */
+    if (argc >= 3 && strcmp(argv[1], "ring") == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        return wk_ring_read(argv[2]) == -1 ? EXIT_FAILURE : 0;
+    }
 
-    wk_init_option(&options);
+    /* bfc serve|lease socket min max ... */
+    if (argc >= 3 && (strcmp(argv[1], "serve") == 0 || strcmp(argv[1], "lease") == 0)) {
+        if (argv[1][0] == 's')
+            servepath = argv[2];
+        else
+            leasepath = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
 
-    gconvlen = MAXSTRING * MB_CUR_MAX + 1;
-    gconvbuffer = (char*)malloc(gconvlen);
-    if (gconvbuffer == NULL) {
-        fprintf(stderr,"Error: Failed to allocate memory\n");
-        goto err;
+    if (setlocale(LC_ALL, "") == NULL) {
+        fprintf(stderr,"Error: setlocale() failed\n");
+        exit(EXIT_FAILURE);
     }
 
-    charset = wk_dupwcs(def_low_charset);
-    if (charset == NULL) {
+    wk_init_option(&options);
+    memset(&place, 0, sizeof(place));
+    signal(SIGPIPE, SIG_IGN);
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > WK_MAXTHREADS)
+        nthreads = WK_MAXTHREADS;
+
+    charset = options.charsets;
+
+    charset[WK_CS_LOW].cset = wk_dupwcs(def_low_charset);
+    if (charset[WK_CS_LOW].cset == NULL) {
         fprintf(stderr,"bfc: can't allocate memory for default charset\n");
         goto err;
     }
 
-    upp_charset = wk_dupwcs(def_upp_charset);
-    if (upp_charset == NULL) {
+    charset[WK_CS_UPP].cset = wk_dupwcs(def_upp_charset);
+    if (charset[WK_CS_UPP].cset == NULL) {
         fprintf(stderr,"bfc: can't allocate memory for default upp_charset\n");
         goto err;
     }
 
-    num_charset = wk_dupwcs(def_num_charset);
-    if (num_charset == NULL) {
+    charset[WK_CS_NUM].cset = wk_dupwcs(def_num_charset);
+    if (charset[WK_CS_NUM].cset == NULL) {
         fprintf(stderr,"bfc: can't allocate memory for default num_charset\n");
         goto err;
     }
 
-    sym_charset = wk_dupwcs(def_sym_charset);
-    if (sym_charset == NULL) {
-        fprintf(stderr,"crunch: can't allocate memory for default sym_charset\n");
+    charset[WK_CS_SYM].cset = wk_dupwcs(def_sym_charset);
+    if (charset[WK_CS_SYM].cset == NULL) {
+        fprintf(stderr,"bfc: can't allocate memory for default sym_charset\n");
         goto err;
     }
 
@@ -152,10 +264,10 @@ int main(int argc, char **argv) {
     my_thread.linetotal = 0;
 
     if (argc >= 4) {
-        if (wk_copy_charset(argc, argv, &i, &charset, &is_unicode) == -1) goto err;
-        if (wk_copy_charset(argc, argv, &i, &upp_charset, &is_unicode) == -1) goto err;
-        if (wk_copy_charset(argc, argv, &i, &num_charset, &is_unicode) == -1) goto err;
-        if (wk_copy_charset(argc, argv, &i, &sym_charset, &is_unicode) == -1) goto err;
+        if (wk_copy_charset(argc, argv, &i, &charset[WK_CS_LOW].cset, &is_unicode) == -1) goto err;
+        if (wk_copy_charset(argc, argv, &i, &charset[WK_CS_UPP].cset, &is_unicode) == -1) goto err;
+        if (wk_copy_charset(argc, argv, &i, &charset[WK_CS_NUM].cset, &is_unicode) == -1) goto err;
+        if (wk_copy_charset(argc, argv, &i, &charset[WK_CS_SYM].cset, &is_unicode) == -1) goto err;
     }
 
     min = (size_t)atoi(argv[1]);
@@ -172,6 +284,114 @@ int main(int argc, char **argv) {
     }
 
     for (; i < argc; i += 2) {
+        /* print where the pipeline spends its time at the end */
+        if (strcmp(argv[i], "--stats") == 0) {
+            showstats = 1;
+            i--; /* decrease by 1 since --stats has no parameter value */
+            continue;
+        }
+        if (strcmp(argv[i], "--rules") == 0 || strcmp(argv[i], "--word-rules") == 0) {
+            if (i+1 < argc) {
+                if (argv[i][2] == 'r')
+                    rulesfile = argv[i+1];
+                else
+                    wordrules = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify a rule file for %s\n", argv[i]);
+                goto err;
+            }
+            continue;
+        }
+        /* forbidden substrings, pruned while the mask is enumerated */
+        if (strcmp(argv[i], "--exclude") == 0 || strcmp(argv[i], "--exclude-file") == 0) {
+            if (i+1 < argc) {
+                if (nxrules + nxfiles == WK_MAXEXCLUDE) {
+                    fprintf(stderr,"At most %d --exclude rules and files can be given\n", WK_MAXEXCLUDE);
+                    goto err;
+                }
+                if (argv[i][9] == '\0')
+                    xrules[nxrules++] = argv[i+1];
+                else
+                    xfiles[nxfiles++] = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify a rule for %s\n", argv[i]);
+                goto err;
+            }
+            continue;
+        }
+        /* more outputs of the same pass */
+        if (strcmp(argv[i], "--tee") == 0) {
+            if (i+1 < argc) {
+                if (ntees == WK_MAXTEES) {
+                    fprintf(stderr,"At most %d --tee outputs can be given\n", WK_MAXTEES);
+                    goto err;
+                }
+                tees[ntees++] = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify an output for --tee\n");
+                goto err;
+            }
+            continue;
+        }
+        /* one position changes from a candidate to the next, see gray.c */
+        if (strcmp(argv[i], "--gray") == 0 || strcmp(argv[i], "--delta") == 0) {
+            if (argv[i][2] == 'g' && gray == 0)
+                gray = 1;
+            else if (argv[i][2] == 'd')
+                gray = 2;
+            i--; /* decrease by 1 since --gray and --delta have no parameter value */
+            continue;
+        }
+        /* record format: text, nul, varint or fixed[:width] */
+        if (strcmp(argv[i], "--format") == 0) {
+            if (i+1 < argc) {
+                if (wk_format_parse(argv[i+1], &format, &width) == -1) goto err;
+            } else {
+                fprintf(stderr,"Please specify text, nul, varint or fixed[:width] for --format\n");
+                goto err;
+            }
+            continue;
+        }
+        /* candidates per lease and seconds before one is handed out again (bfc serve) */
+        if (strcmp(argv[i], "--lease-size") == 0 || strcmp(argv[i], "--lease-ttl") == 0) {
+            if (i+1 < argc) {
+                if (argv[i][8] == 's')
+                    leasesize = strtoull(argv[i+1], NULL, 10);
+                else
+                    leasettl = strtoul(argv[i+1], NULL, 10);
+                if ((argv[i][8] == 's' ? leasesize : leasettl) == 0) {
+                    fprintf(stderr,"%s must be at least 1\n", argv[i]);
+                    goto err;
+                }
+            } else {
+                fprintf(stderr,"Please specify a value for %s\n", argv[i]);
+                goto err;
+            }
+            continue;
+        }
+        /* compressed in independent frames with an index, see seek.c */
+        if (strcmp(argv[i], "--seekable") == 0) {
+            seekable = 1;
+            i--; /* decrease by 1 since --seekable has no parameter value */
+            continue;
+        }
+        /* measure the fastest threads and chunk size for this job */
+        if (strcmp(argv[i], "--autotune") == 0) {
+            autotune = 1;
+            i--; /* decrease by 1 since --autotune has no parameter value */
+            continue;
+        }
+        /* user defined charset, referenced from the pattern as ?1..?9 */
+        if (argv[i][0] == '-' && argv[i][1] >= '1' && argv[i][1] <= '9') {
+            if (i+1 < argc) {
+                n = WK_CS_USER + (argv[i][1] - '1');
+                if (wk_user_charset(argv[i+1], &charset[n], &is_unicode) == -1) goto err;
+            } else {
+                fprintf(stderr,"Please specify the characters of charset %c\n", argv[i][1]);
+                goto err;
+            }
+        }
+
         if (strncmp(argv[i], "-b", 2) == 0) {
             /* user wants to split files by size */
             if (i+1 < argc) {
@@ -207,6 +427,122 @@ int main(int argc, char **argv) {
                 goto err;
             }
         }
+        /* number of generator threads */
+        if (strncmp(argv[i], "-j", 2) == 0) {
+            if (i+1 < argc) {
+                nthreads = strtol(argv[i+1], NULL, 10);
+                jset = 1;
+                if (nthreads < 1 || nthreads > WK_MAXTHREADS) {
+                    fprintf(stderr,"The number of threads must be between 1 and %d\n", WK_MAXTHREADS);
+                    goto err;
+                }
+            } else {
+                fprintf(stderr,"Please specify the number of threads\n");
+                goto err;
+            }
+        }
+        /* pin the workers: spread, compact or a cpu list */
+        if (strncmp(argv[i], "-a", 2) == 0) {
+            if (i+1 < argc) {
+                placespec = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify spread, compact or a cpu list for -a\n");
+                goto err;
+            }
+        }
+        /* output buffers from the explicit huge page pool */
+        if (strncmp(argv[i], "-g", 2) == 0) {
+            place.huge = 1;
+            i--; /* decrease by 1 since -g has no parameter value */
+        }
+        /* word list of the combinator, may be repeated */
+        if (strncmp(argv[i], "-k", 2) == 0) {
+            if (i+1 < argc) {
+                if (nklist == WK_MAXLISTS) {
+                    fprintf(stderr,"At most %d word lists can be combined\n", WK_MAXLISTS);
+                    goto err;
+                }
+                klist[nklist++] = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify a word list to combine\n");
+                goto err;
+            }
+        }
+        if (strncmp(argv[i], "-K", 2) == 0) {
+            if (i+1 < argc) {
+                ksep = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify the separator of combined words\n");
+                goto err;
+            }
+        }
+        /* hash every candidate and print only those found in the file */
+        if (strncmp(argv[i], "-H", 2) == 0) {
+            if (i+1 < argc) {
+                hashspec = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify the hashes to look for as algo:file\n");
+                goto err;
+            }
+        }
+        /* markov order from a stats file */
+        if (strncmp(argv[i], "-M", 2) == 0) {
+            if (i+1 < argc) {
+                markov = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify a markov stats file\n");
+                goto err;
+            }
+        }
+        /* train markov stats, written to the -M file */
+        if (strncmp(argv[i], "-T", 2) == 0) {
+            if (i+1 < argc) {
+                trainfile = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify a word list to train from\n");
+                goto err;
+            }
+        }
+        if (strncmp(argv[i], "-v", 2) == 0) {
+            if (i+1 < argc) {
+                mklevel = (size_t)strtoul(argv[i+1], NULL, 10);
+                if (mklevel == 0) {
+                    fprintf(stderr,"The markov level must be at least 1\n");
+                    goto err;
+                }
+            } else {
+                fprintf(stderr,"Please specify the highest markov level\n");
+                goto err;
+            }
+        }
+        /* keyed pseudo-random order */
+        if (strncmp(argv[i], "-R", 2) == 0) {
+            if (i+1 < argc) {
+                shufkey = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify the key of the random order\n");
+                goto err;
+            }
+        }
+        /* k of n words, ordered (-A) or not (-C) */
+        if (strncmp(argv[i], "-A", 2) == 0 || strncmp(argv[i], "-C", 2) == 0) {
+            if (i+1 < argc) {
+                permmode = argv[i][1] == 'A' ? WK_PERM_ARRANGE : WK_PERM_COMBINE;
+                if (wk_parse_krange(argv[i+1], &kmin, &kmax) == -1) goto err;
+            } else {
+                fprintf(stderr,"Please specify how many words to pick as k or k1-k2\n");
+                goto err;
+            }
+        }
+        /* only generate candidates [first, last) */
+        if (strncmp(argv[i], "-x", 2) == 0) {
+            if (i+1 < argc) {
+                if (wk_parse_range(argv[i+1], &xfirst, &xlast) == -1) goto err;
+            } else {
+                fprintf(stderr,"Please specify the range of candidates as first:last\n");
+                goto err;
+            }
+        }
         /* user wants to invert output calculation */
         if (strncmp(argv[i], "-i", 2) == 0) {
             inverted = 1;
@@ -221,6 +557,15 @@ int main(int argc, char **argv) {
                 goto err;
             }
         }
+        /* file of masks to run one after another */
+        if (strncmp(argv[i], "-m", 2) == 0) {
+            if (i+1 < argc) {
+                maskfile = argv[i+1];
+            } else {
+                fprintf(stderr,"Please specify a file of masks\n");
+                goto err;
+            }
+        }
         /* outputfilename specified */
         if (strncmp(argv[i], "-o", 2) == 0) {
             flag4 = 1;
@@ -246,15 +591,28 @@ int main(int argc, char **argv) {
         /* user specified file of words to permute */
         if (strncmp(argv[i], "-q", 2) == 0) {
             if (i+1 < argc) {
-                wordarray = wk_readpermute(argv[i+1], &is_unicode);
-                if (wordarray == NULL) goto err;
-                qsort(wordarray, numofelements, sizeof(char *), wcstring_cmp);
-                flag = 1; 
+                wordfile = argv[i+1];
+                flag = 1;
             } else {
                 fprintf(stderr,"Please specify a filename for permute to read\n");
                 goto err;
             }
         }
+        /* hybrid mode, words combined with the mask given by -t */
+        if (strncmp(argv[i], "-y", 2) == 0) {
+            if (i+1 < argc) {
+                if (strcmp(argv[i+1], "wm") == 0) hybrid = WK_HYB_WM;
+                else if (strcmp(argv[i+1], "mw") == 0) hybrid = WK_HYB_MW;
+                else if (strcmp(argv[i+1], "both") == 0) hybrid = WK_HYB_BOTH;
+                else {
+                    fprintf(stderr,"-y must be followed by wm, mw or both\n");
+                    goto err;
+                }
+            } else {
+                fprintf(stderr,"Please specify the hybrid order wm, mw or both\n");
+                goto err;
+            }
+        }
         /* user wants to resume a previous session */
         if (strncmp(argv[i], "-r", 2) == 0) {
             resume = 1;
@@ -265,7 +623,6 @@ int main(int argc, char **argv) {
             if (i+1 < argc && argv[i+1]) {
                 startblock = wk_alloc_wide_string(argv[i+1], &is_unicode);
                 if (wcslen(startblock) != min) {
-                    free(startblock);
                     fprintf(stderr,"Warning: minimum length should be %d\n", (int)wcslen(startblock));
                     goto err;
                 }
@@ -278,12 +635,6 @@ int main(int argc, char **argv) {
         if (strncmp(argv[i], "-t", 2) == 0) {
             if (i+1 < argc) {
                 pattern = wk_alloc_wide_string(argv[i+1], &is_unicode);
-
-                if ((max > wcslen(pattern)) || (min < wcslen(pattern))) {
-                    fprintf(stderr,"The maximum and minimum length should be the same size as the pattern you specified. \n");
-                    fprintf(stderr,"min = %d  max = %d  strlen(%s)=%d\n",(int)min, (int)max, argv[i+1], (int)wcslen(pattern));
-                    goto err;
-                }
             } else {
                 fprintf(stderr,"Please specify a pattern\n");
                 goto err;
@@ -315,6 +666,134 @@ int main(int argc, char **argv) {
     } /* end parameter processing */
 
     /* parameter validation */
+    if (trainfile != NULL) {
+        if (markov == NULL) {
+            fprintf(stderr,"-T needs the stats file to write given with -M\n");
+            goto err;
+        }
+        if (wk_markov_train(trainfile, markov) == -1) goto err;
+        return 0;
+    }
+
+    if (permmode != -1 && (flag != 1 || hybrid != -1)) {
+        fprintf(stderr,"-A and -C need words given by -p or -q\n");
+        goto err;
+    }
+
+    if (shufkey != NULL && (maskfile != NULL || startblock != NULL || endstr != NULL)) {
+        fprintf(stderr,"-R can not be combined with -m, -s or -e\n");
+        goto err;
+    }
+
+    if (maskfile != NULL && (xfirst != 0 || xlast != UINT64_MAX)) {
+        fprintf(stderr,"-x can not be combined with -m\n");
+        goto err;
+    }
+    /* the checkpoint counts bytes of the plain file, a compressed one can't be cut back */
+    if (maskfile != NULL && resume && compressalgo != NULL) {
+        fprintf(stderr,"-r can not be combined with -z for -m\n");
+        goto err;
+    }
+
+    if (markov != NULL) {
+        if (flag != 0 || maskfile != NULL || nklist > 0 || inverted
+            || startblock != NULL || endstr != NULL) {
+            fprintf(stderr,"-M can not be combined with -i, -k, -m, -p, -q, -y, -s or -e\n");
+            goto err;
+        }
+    } else if (mklevel > 0) {
+        fprintf(stderr,"you must specify -M when using -v\n");
+        goto err;
+    }
+
+    if (rulesfile != NULL && hashspec != NULL) {
+        fprintf(stderr,"--rules can not be combined with -H\n");
+        goto err;
+    }
+    /* tees start empty and would only get the rest of a resumed run */
+    if (ntees > 0 && (servepath != NULL || autotune || resume)) {
+        fprintf(stderr,"--tee can not be combined with bfc serve, --autotune or -r\n");
+        goto err;
+    }
+    if (servepath != NULL || leasepath != NULL) {
+        if (maskfile != NULL || resume || (servepath != NULL && autotune)) {
+            fprintf(stderr,"bfc serve and bfc lease can not be combined with -m or -r, "
+                    "nor bfc serve with --autotune\n");
+            goto err;
+        }
+    } else if (leasesize != 0 || leasettl != 0) {
+        fprintf(stderr,"--lease-size and --lease-ttl are options of bfc serve\n");
+        goto err;
+    }
+    if (seekable) {
+        if (compressalgo == NULL || strcmp(compressalgo, "gzip") != 0 || format != WK_FMT_TEXT
+            || bytecount > 0 || linecount > 0 || maskfile != NULL) {
+            fprintf(stderr,"--seekable needs -z gzip and text output, and can not be combined "
+                    "with -b, -c or -m\n");
+            goto err;
+        }
+        if (resume && fpath == NULL) {
+            fprintf(stderr,"resume needs the output file given with -o\n");
+            goto err;
+        }
+    }
+    if (format != WK_FMT_TEXT && resume) {
+        fprintf(stderr,"-r can only resume text output\n");
+        goto err;
+    }
+    if (format == WK_FMT_FIXED && width == 0 && maskfile != NULL) {
+        fprintf(stderr,"--format fixed needs a width when used with -m\n");
+        goto err;
+    }
+    /* the generators end records in NUL, so no candidate can contain one */
+    if (format != WK_FMT_TEXT)
+        wk_eol = '\0';
+    if (wordrules != NULL && wordarray == NULL && wordfile == NULL) {
+        fprintf(stderr,"--word-rules needs words given by -p or -q\n");
+        goto err;
+    }
+
+    if (hybrid != -1) {
+        if ((wordarray == NULL && wordfile == NULL) || pattern == NULL) {
+            fprintf(stderr,"-y needs words given by -q or -p and a mask given by -t\n");
+            goto err;
+        }
+        flag = 2;
+    }
+
+    if (nklist > 0) {
+        if (pattern != NULL || wordarray != NULL || wordfile != NULL || maskfile != NULL
+            || startblock != NULL || endstr != NULL) {
+            fprintf(stderr,"-k can not be combined with -t, -p, -q, -m, -s or -e\n");
+            goto err;
+        }
+        flag = 3;
+    } else if (ksep != NULL) {
+        fprintf(stderr,"you must specify -k when using -K\n");
+        goto err;
+    }
+
+    if (nxrules + nxfiles > 0 && (flag == 1 || flag == 3 || maskfile != NULL || markov != NULL)) {
+        fprintf(stderr,"--exclude filters a mask and can not be combined with -m, -M, -p, -q or -k\n");
+        goto err;
+    }
+
+    if (gray && (flag != 0 || maskfile != NULL || markov != NULL || nxrules + nxfiles > 0
+                 || startblock != NULL || endstr != NULL)) {
+        fprintf(stderr,"--gray orders a mask and can not be combined with -m, -M, -p, -q, -y, -k, "
+                "-s, -e or --exclude\n");
+        goto err;
+    }
+    if (gray == 2 && (hashspec != NULL || rulesfile != NULL)) {
+        fprintf(stderr,"--delta records can not be combined with -H or --rules\n");
+        goto err;
+    }
+    /* split files are named from their records and must decode on their own */
+    if (gray == 2 && (bytecount > 0 || linecount > 0)) {
+        fprintf(stderr,"--delta records can not be combined with -b or -c\n");
+        goto err;
+    }
+
     if (literalstring != NULL && pattern == NULL) {
         fprintf(stderr,"you must specify -t when using -l\n");
         goto err;
@@ -327,13 +806,20 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (tempfilename != NULL) {
-        if ((bytecount > 0) && (strcmp(tempfilename, "START") != 0)) {
+    if (bytecount > 0 || linecount > 0) {
+        base = outputf ? strrchr(outputf, '/') : NULL;
+        base = base ? base + 1 : outputf;
+        if (base == NULL || strcmp(base, "START") != 0) {
             fprintf(stderr,"you must use -o START if you specify a count\n");
             goto err;
         }
     }
 
+    if (maskfile != NULL && (pattern != NULL || flag == 1 || startblock != NULL || endstr != NULL)) {
+        fprintf(stderr,"-m can not be combined with -t, -p, -q, -s or -e\n");
+        goto err;
+    }
+
     if (endstr != NULL) {
         if (max != wcslen(endstr)) {
             fprintf(stderr,"End string length must equal maximum string size\n");
@@ -341,26 +827,30 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (wk_check_start_end(charset, startblock, endstr) == -1) goto err;
-
     if (literalstring == NULL) {
-        if (wk_default_literalstring(max, &literalstring) == -1) goto err;
+        if (wk_default_literalstring(pattern ? wcslen(pattern) : max, &literalstring) == -1) goto err;
+    }
+
+    for (n = 0; n < WK_NCHARSETS; n++) {
+        if (wk_compile_charset(&charset[n]) == -1) goto err;
     }
+    if (wk_cindex_build(&options.cindex, charset) == -1) goto err;
 
-    options.low_charset = charset;
-    options.upp_charset = upp_charset;
-    options.num_charset = num_charset;
-    options.sym_charset = sym_charset;
-    options.clen = charset ? wcslen(charset) : 0;
-    options.ulen = upp_charset ? wcslen(upp_charset) : 0;
-    options.nlen = num_charset ? wcslen(num_charset) : 0;
-    options.slen = sym_charset ? wcslen(sym_charset) : 0;
     options.pattern = pattern;
-    options.plen = pattern ? wcslen(pattern) : 0;
     options.literalstring = literalstring;
     options.endstring = endstr;
     options.max = max;
 
+    if (pattern != NULL) {
+        if (wk_compile_pattern(&options) == -1) goto err;
+
+        if ((max != options.plen) || (min != options.plen)) {
+            fprintf(stderr,"The maximum and minimum length should be the same size as the pattern you specified. \n");
+            fprintf(stderr,"min = %d  max = %d  pattern length = %d\n",(int)min, (int)max, (int)options.plen);
+            goto err;
+        }
+    }
+
     if (pattern != NULL && startblock != NULL) {
         if (wk_check_member(startblock, &options) == 0) {
             fprintf(stderr,"startblock is not valid according to the pattern/literalstring\n");
@@ -375,11 +865,23 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (endstr && wk_too_many_duplicates(endstr, options)) {
+    if (endstr && wk_too_many_duplicates(endstr, &options)) {
         fprintf(stderr,"Error: End string set by -e will never occur (too many duplicate chars)\n");
         goto err;
     }
 
+    if (placespec != NULL) {
+        if (wk_placement_parse(placespec, &place) == -1) goto err;
+        wk_placement_report(&place, (int)nthreads);
+    }
+
+    if (maskfile != NULL) {
+        if (wk_readmasks(maskfile, &options, min, max, &jobs, &njobs, &is_unicode) == -1) goto err;
+
+        if ((ckpt = wk_arena_alloc(&setup, strlen(maskfile) + sizeof(".ckpt"), 1)) == NULL) goto err;
+        sprintf(ckpt, "%s.ckpt", maskfile);
+    }
+
     if (is_unicode) {
         char response[8];
         fprintf(stderr,
@@ -396,69 +898,254 @@ int main(int argc, char **argv) {
         }
     }
     /* start processing */
-    options.startstring = startblock;
-    options.min = min;
-    wk_fill_minmax_strings(&options);
-    wk_fill_pattern_info(&options);
-
     if (resume == 1) {
+        if (hashspec != NULL || rulesfile != NULL) {
+            fprintf(stderr,"you cannot resume when using -H or --rules\n");
+            goto err;
+        }
+
         if (startblock != NULL) {
             fprintf(stderr,"you cannot specify a startblock and resume\n");
             goto err;
         }
 
-        if (flag == 0) {
-            startblock = wk_resumesession(fpath, charset);
-            if (startblock == NULL) goto err; 
+        /* every mode but the plain mask resumes by index, one line per candidate */
+        byindex = maskfile == NULL && (flag != 0 || markov != NULL || shufkey != NULL || gray
+                                       || xfirst != 0 || xlast != UINT64_MAX);
+        /* the frame index of seekable output knows the candidates, see below */
+        if (seekable)
+            byindex = 0;
+
+        if (flag == 0 && maskfile == NULL && !byindex && !seekable) {
+            if (fpath == NULL) {
+                fprintf(stderr,"resume needs the output file given with -o\n");
+                goto err;
+            }
+            startblock = wk_resumesession(fpath);
+            if (startblock == NULL) goto err;
             min = wcslen(startblock);
+            skip = 1; /* the last line is already in the file */
         }
 
-        if (flag == 1) {
-            fprintf(stderr,"permute doesn't support resume\n");
-            goto err;
+        /* -d drops candidates, so lines no longer count them */
+        if (byindex && (flag == 0 || flag == 2)) {
+            for (n = 0; n < WK_NCHARSETS; n++) {
+                if (charset[n].duplicates != NPOS) {
+                    fprintf(stderr,"this mode can't resume when -d is used\n");
+                    goto err;
+                }
+            }
+        }
+
+        if (byindex) {
+            if (fpath == NULL) {
+                fprintf(stderr,"resume needs the output file given with -o\n");
+                goto err;
+            }
+            if (wk_resumeindex(fpath) == -1) goto err;
+            skip = my_thread.linecounter;
         }
     } else {
         if (fpath != NULL)
             (void)remove(fpath);
     }
 
-    return 0;
-err:
-    exit(EXIT_FAILURE);
-    return -1;
-}
-
-/* replacement for wcsdup, where not avail (it's POSIX) 
- * The return value needs to be released by calling free */
-static wchar_t *wk_dupwcs(const wchar_t *s) {
-    size_t n;
-    wchar_t *p = NULL;
-
-    if (s != NULL) {
-        n = (1 + wcslen(s)) * sizeof(wchar_t);
-        p = (wchar_t *)malloc(n);
-        if (p != NULL)
-            memcpy(p, s, n);
+    memset(&sink, 0, sizeof(sink));
+    sink.bytelimit = bytecount;
+    sink.linelimit = linecount;
+    sink.format = format;
+    sink.width = width;
+    sink.seekable = seekable;
+    if (resume && seekable) {
+        snprintf(seekpath, sizeof(seekpath), "%s%s", fpath, wk_compress_ext(compressalgo));
+        if (wk_seek_resume(&sink, seekpath, &next) == -1) goto err;
+        skip = next > xfirst ? next - xfirst : 0;
     }
-    return p;
-}
-
-/* Copy without duplicates 
- * This function only copies non-duplicate wide characters. */
-static void wk_copy_without_dupes(wchar_t *dest, wchar_t *src) {
-    size_t i;
-    size_t len = wcslen(src);
-
-    dest[0] = L'\0';
-
-    for (i = 0; i < len; i++) {
-        /* wcschr - search a wide character in a wide-character string */
-        if (wcschr(dest, src[i]) == NULL) {
-            /* Character not found. */
-            wcsncat(dest, &src[i], 1);
-        }
+    if (hashspec != NULL) {
+        if (wk_hash_filter(hashspec, &hfilter) == -1) goto err;
+        sink.filter = &hfilter;
     }
-}
+    if (rulesfile != NULL) {
+        if (wk_rules_filter(rulesfile, &rfilter) == -1) goto err;
+        sink.filter = &rfilter;
+    }
+    if (showstats) {
+        memset(&stats, 0, sizeof(stats));
+        sink.stats = &stats;
+    }
+
+    if (maskfile != NULL) {
+        if (autotune) {
+            fprintf(stderr,"--autotune can not be combined with -m\n");
+            goto err;
+        }
+        if (ntees > 0 && (sink.tee = wk_tee_open(tees, ntees)) == NULL) goto err;
+        if (wk_maskqueue(jobs, njobs, ckpt, (int)resume, &sink, fpath, outputf,
+                         compressalgo, (int)nthreads, &place) == -1) goto err;
+    } else {
+        memset(&seg, 0, sizeof(seg));
+        seg.src = &src;
+
+        if (flag == 1) {
+            if (wk_mode_words(wordfile, wordarray, wordrules, (int)nthreads, &words) == -1) goto err;
+            if (permmode == -1) {
+                permmode = WK_PERM_ARRANGE;
+                kmin = kmax = words.n;
+            }
+            if (wk_permute_source(&words, permmode, kmin, kmax, &psrc) == -1) goto err;
+            seg.src = &psrc;
+        } else if (flag == 3) {
+            for (n = 0; n < (int)nklist; n++) {
+                if (wk_words_mmap(klist[n], &lists[n]) == -1) goto err;
+            }
+            if (wk_combinator_source(lists, nklist, ksep, &src) == -1) goto err;
+        } else {
+            options.startstring = flag == 0 ? startblock : NULL;
+            options.min = min;
+            if (wk_fill_minmax_strings(&options) == -1 || wk_fill_pattern_info(&options) == -1) goto err;
+
+            if (wk_mask_compile(&options, (int)inverted, &mask) == -1) goto err;
+            wk_mask_source(&mask, &src);
+            if (nxrules + nxfiles > 0) {
+                if (wk_exclude_source(&mask, (int)inverted, xrules, nxrules, xfiles, nxfiles,
+                                      &xsrc) == -1) goto err;
+                seg.src = &xsrc;
+            }
+            if (gray) {
+                if (wk_gray_source(&mask, gray == 2, &gsrc) == -1) goto err;
+                seg.src = &gsrc;
+            }
+        }
+
+        if (flag == 2) {
+            if (wk_mode_words(wordfile, wordarray, wordrules, (int)nthreads, &words) == -1) goto err;
+            if (wk_hybrid_source(&words, seg.src, hybrid, &hsrc) == -1) goto err;
+            seg.src = &hsrc;
+        }
+        if (markov != NULL) {
+            if (wk_markov_source(&mask, markov, mklevel, &msrc) == -1) goto err;
+            seg.src = &msrc;
+        }
+        if (shufkey != NULL) {
+            if (wk_shuffle_source(seg.src, shufkey, &rsrc) == -1) goto err;
+            seg.src = &rsrc;
+        }
+        if (xlast > seg.src->total)
+            xlast = seg.src->total;
+        if (xfirst > xlast)
+            xfirst = xlast;
+        seg.first = skip < xlast - xfirst ? xfirst + skip : xlast;
+        seg.count = xlast - seg.first;
+
+        /* a consumer must generate the same candidates as its server numbers */
+        nkstrs = 0;
+        kstrs[nkstrs++] = shufkey;
+        kstrs[nkstrs++] = markov;
+        kstrs[nkstrs++] = ksep;
+        snprintf(kmode, sizeof(kmode), "%d/%d", hybrid, permmode);
+        kstrs[nkstrs++] = kmode;
+        for (n = 0; n < (int)nxrules; n++)
+            kstrs[nkstrs++] = xrules[n];
+        for (n = 0; n < (int)nxfiles; n++)
+            kstrs[nkstrs++] = xfiles[n];
+        snprintf(key, sizeof(key), "%lu/%lu-%lu/%llu/%lu/%c%c%c%c%c%c/%016llx", (unsigned long)flag,
+                 (unsigned long)min, (unsigned long)max, (unsigned long long)seg.src->total,
+                 (unsigned long)seg.src->maxrec,
+                 (flag == 0 || flag == 2) && mask.checkdups ? 'd' : '-',
+                 inverted ? 'i' : '-', markov != NULL ? 'M' : '-', shufkey != NULL ? 'R' : '-',
+                 nxrules + nxfiles > 0 ? 'X' : '-', "-GD"[gray],
+                 (unsigned long long)wk_job_hash(&options, flag == 1 || flag == 2 ? &words : lists,
+                                                 flag == 1 || flag == 2 ? 1 : flag == 3 ? nklist : 0,
+                                                 kstrs, nkstrs));
+        if (servepath != NULL) {
+            if (wk_serve(servepath, key, seg.first, seg.count, leasesize, (unsigned)leasettl) == -1)
+                goto err;
+            return 0;
+        }
+
+        /* wide enough for the longest record the source and filter can make */
+        if (format == WK_FMT_FIXED && sink.width == 0) {
+            sink.width = seg.src->maxrec - 1;
+            if (hashspec != NULL)
+                sink.width += hfilter.extra;
+            if (rulesfile != NULL)
+                sink.width = MAXSTRING*WK_MBMAX;
+        }
+
+        if (autotune || !jset) {
+            snprintf(shape, sizeof(shape), "%lu/%lu-%lu/%llu/%lu/%c%c%c%c%c%c%c%c/%s/%d", (unsigned long)flag,
+                     (unsigned long)min, (unsigned long)max, (unsigned long long)seg.src->total,
+                     (unsigned long)seg.src->maxrec,
+                     (flag == 0 || flag == 2) && mask.checkdups ? 'd' : '-',
+                     inverted ? 'i' : '-', markov != NULL ? 'M' : '-',
+                     shufkey != NULL ? 'R' : '-', hashspec != NULL ? 'H' : '-',
+                     rulesfile != NULL ? 'r' : '-', nxrules + nxfiles > 0 ? 'X' : '-', "-GD"[gray],
+                     compressalgo != NULL ? compressalgo : "none", format);
+            if (wk_autotune(&seg, shape, fpath, compressalgo, &sink, autotune,
+                            &nthreads) == -1) goto err;
+            if (autotune)
+                return 0;
+        }
+
+        if (ntees > 0 && (sink.tee = wk_tee_open(tees, ntees)) == NULL) goto err;
+        if (wk_sink_open(&sink, fpath, outputf, compressalgo, (int)resume) == -1) goto err;
+        if (!seekable) {
+            sink.bytes = my_thread.bytecounter;
+            sink.lines = my_thread.linecounter;
+        }
+        if (leasepath != NULL)
+            rc = wk_lease_loop(leasepath, key, &seg, seg.src == &src && flag == 0 ? &mask : NULL,
+                               &sink, (int)nthreads, &place);
+        else
+            rc = wk_run_range(&seg, seg.src == &src && flag == 0 ? &mask : NULL, &sink,
+                              (int)nthreads, &place);
+        if (wk_sink_close(&sink) == -1 || rc == -1) goto err;
+        if (flag == 1) {
+            wk_words_free(&words);
+        } else if (flag == 3) {
+            for (n = 0; n < (int)nklist; n++)
+                wk_words_free(&lists[n]);
+        } else {
+            wk_mask_free(&mask);
+        }
+    }
+    if (showstats)
+        wk_stats_report(&stats);
+    wk_arena_free(&setup);
+
+    return 0;
+err:
+    exit(EXIT_FAILURE);
+    return -1;
+}
+
+/* replacement for wcsdup, where not avail (it's POSIX) 
+ * The copy lives in the startup arena */
+static wchar_t *wk_dupwcs(const wchar_t *s) {
+    size_t n;
+    wchar_t *p = NULL;
+
+    if (s != NULL) {
+        n = wcslen(s);
+        p = wk_arena_wcs(&setup, n);
+        if (p != NULL)
+            wmemcpy(p, s, n);
+    }
+    return p;
+}
+
+/* Copy without duplicates 
+ * This function only copies non-duplicate wide characters. */
+static void wk_copy_without_dupes(wchar_t *dest, const wchar_t *src) {
+    size_t i, n = 0;
+
+    /* n never passes i, so dest may be src */
+    for (i = 0; src[i] != L'\0'; i++) {
+        if (wmemchr(dest, src[i], n) == NULL)
+            dest[n++] = src[i];
+    }
+    dest[n] = L'\0';
+}
 
 static size_t wk_force_wide_string(wchar_t *wout, const char *s, size_t n) {
     size_t i;
@@ -522,25 +1209,11 @@ static size_t wk_make_wide_string(wchar_t *wout,
     return stres;
 }
 
+/* dest holds strlen(src)+1 wide characters */
 static int wk_copy(wchar_t *dest, const char *src, int *is_unicode) {
-    size_t slen;
-    wchar_t *tpwc = NULL;
-
-    slen = strlen(src) + 1;
-
-    tpwc = (wchar_t*)malloc(slen * sizeof(wchar_t));
-
-    if (tpwc == NULL) {
-        fprintf(stderr,"[BFC] can't allocate memory for user charset\n");
-        goto err;
-    }
-    (void)wk_make_wide_string(tpwc, src, slen, is_unicode);
-    wk_copy_without_dupes(dest, tpwc);
-    free(tpwc);
-
+    (void)wk_make_wide_string(dest, src, strlen(src) + 1, is_unicode);
+    wk_copy_without_dupes(dest, dest);
     return 0;
-err:
-    return -1;
 }
 
 /*
@@ -597,6 +1270,46 @@ static int wk_parse_number(const char *s, size_t max, size_t *calc) {
     return 0;
 }
 
+/* -x first:last, candidates first..last-1 counted from 0, last may be left out */
+static int wk_parse_range(const char *s, uint64_t *first, uint64_t *last) {
+    char *endptr;
+
+    errno = 0;
+    *first = strtoull(s, &endptr, 10);
+    if (endptr == s || *endptr != ':' || errno != 0) {
+        fprintf(stderr,"-x must be followed by first:last\n");
+        return -1;
+    }
+    s = endptr + 1;
+    *last = UINT64_MAX;
+    if (*s != '\0') {
+        *last = strtoull(s, &endptr, 10);
+        if (endptr == s || *endptr != '\0' || errno != 0) {
+            fprintf(stderr,"-x must be followed by first:last\n");
+            return -1;
+        }
+    }
+    if (*last < *first) {
+        fprintf(stderr,"-x: last must not be less than first\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* -A/-C k or k1-k2 */
+static int wk_parse_krange(const char *s, size_t *kmin, size_t *kmax) {
+    char *endptr;
+
+    *kmin = *kmax = (size_t)strtoul(s, &endptr, 10);
+    if (*endptr == '-')
+        *kmax = (size_t)strtoul(endptr + 1, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || *kmin < 1 || *kmax < *kmin) {
+        fprintf(stderr,"-A and -C must be followed by k or k1-k2 with 1 <= k1 <= k2\n");
+        return -1;
+    }
+    return 0;
+}
+
 /* specify duplicates to skip */
 static int wk_dupskip(const char *s, options_type *op) {
     size_t dupvalue;
@@ -606,20 +1319,19 @@ static int wk_dupskip(const char *s, options_type *op) {
 
     dupvalue = (size_t)strtoul(s, &endptr, 10);
     if (endptr == s) {
-        fprintf(stderr,"-d must be followed by [n][@,%%^]\n");
+        fprintf(stderr,"-d must be followed by [n][@,%%^?1..?9]\n");
         return -1;
     }
 
     if ((*endptr) == '\0')
-        op->duplicates[0] = dupvalue;
+        op->charsets[WK_CS_LOW].duplicates = dupvalue;
     while (*endptr != '\0') {
-        switch (*endptr) {
-        case '@': options.duplicates[0] = dupvalue; break;
-        case ',': options.duplicates[1] = dupvalue; break;
-        case '%': options.duplicates[2] = dupvalue; break;
-        case '^': options.duplicates[3] = dupvalue; break;
-        default:
-            fprintf(stderr,"the type of duplicates must be one of [@,%%^]\n");
+        if (*endptr >= '1' && *endptr <= '9') {
+            op->charsets[WK_CS_USER + (*endptr - '1')].duplicates = dupvalue;
+        } else if (wk_class_of((wchar_t)*endptr) >= 0) {
+            op->charsets[wk_class_of((wchar_t)*endptr)].duplicates = dupvalue;
+        } else if (*endptr != '?') {
+            fprintf(stderr,"the type of duplicates must be one of [@,%%^] or ?1..?9\n");
             return -1;
         }
         endptr++;
@@ -633,11 +1345,9 @@ static wchar_t *wk_endstring(const char *s, int *is_unicode) {
 
     slen = strlen(s) + 1;
 
-    endstr = (wchar_t *)malloc(slen * sizeof(wchar_t));
-    if (endstr == NULL) {
-        fprintf(stderr,"Error: Can;t allocate mem for endstring\n");
+    endstr = wk_arena_wcs(&setup, slen - 1);
+    if (endstr == NULL)
         return NULL;
-    }
     (void)wk_make_wide_string(endstr, s, slen, is_unicode);
     return endstr;
 }
@@ -646,11 +1356,9 @@ static wchar_t *wk_alloc_wide_string(const char *s, int *is_unicode) {
     wchar_t *wstr = NULL;
     size_t len = s ? strlen(s)+1 : 1;
 
-    wstr = (wchar_t *)malloc(len * sizeof(wchar_t));
-    if (wstr == NULL) {
-        fprintf(stderr,"wk_alloc_wide_string: Can't allocate mem!\n");
+    wstr = wk_arena_wcs(&setup, len - 1);
+    if (wstr == NULL)
         exit(EXIT_FAILURE);
-    }
     (void)wk_make_wide_string(wstr, s ? s : "", len, is_unicode);
     return wstr;
 }
@@ -664,21 +1372,15 @@ static int wk_file(const char *s, char **fpath, char **tmpf, char **outputf) {
     hold = strrchr(s, '/');
     *outputf = (char*)s;
     if (hold == NULL) {
-        *fpath = calloc(6, sizeof(char));
-        if (*fpath == NULL) {
-            fprintf(stderr,"bfc: can't allocate memory for fpath1\n");
+        if ((*fpath = wk_arena_alloc(&setup, 6, 1)) == NULL)
             return -1;
-        }
         memcpy(*fpath, "START", 5);
         tmpf = outputf;
     } else {
         tp = strlen(s) - strlen(hold) + 1;
         tmpf = &s[tp];
-        *fpath = calloc(tp+6, sizeof(char));
-        if (*fpath == NULL) {
-            fprintf(stderr,"bfc: can't allocate memory for fpath2\n");
+        if ((*fpath = wk_arena_alloc(&setup, tp+6, 1)) == NULL)
             return -1;
-        }
         memcpy(*fpath, s, tp);
         strncat(*fpath, "START", 5);
     }
@@ -691,36 +1393,28 @@ static int wcstring_cmp(const void *a, const void *b) {
     return wcscmp(*ia, *ib);
 }
 
+/* the pointers and the single character words share one run of the arena */
 static int wk_wordarray(const char *s, wchar_t ***warray, char **argv, int i, int *is_unicode) {
-    wchar_t *tempwcs;
+    wchar_t *tempwcs, *words;
+    size_t n;
 
     if (numofelements == 1) {
         tempwcs = wk_alloc_wide_string(s, is_unicode);
         numofelements = wcslen(tempwcs);
 
-        *warray = calloc(numofelements, sizeof(wchar_t*));
-        if (*warray == NULL) {
-            fprintf(stderr,"can't allocate memory for wordarray3\n");
+        *warray = wk_arena_alloc(&setup, numofelements * (sizeof(wchar_t*) + 2 * sizeof(wchar_t)),
+                                 sizeof(wchar_t*));
+        if (*warray == NULL)
             return -1;
+        words = (wchar_t *)(*warray + numofelements);
+        for (n = 0; n < numofelements; n++) {
+            (*warray)[n] = &words[2*n];
+            words[2*n] = tempwcs[n];
         }
-
-        for (size_t i = 0; i < numofelements; i++) {
-            (*warray)[i] = calloc(2, sizeof(wchar_t));
-            if ((*warray)[i] == NULL) {
-                fprintf(stderr,"can't allocate memory for wordarray2\n");
-                return -1;
-            }
-            (*warray)[i][0] = tempwcs[i];
-            (*warray)[i][1] = '\0';
-        }
-        free(tempwcs);
     } else {
-        *warray = calloc(numofelements, sizeof(wchar_t*));
-        if (*warray == NULL) {
-            fprintf(stderr,"can't allocate memory for wordarray3\n");
+        *warray = wk_arena_alloc(&setup, numofelements * sizeof(wchar_t*), sizeof(wchar_t*));
+        if (*warray == NULL)
             return -1;
-        }
-        int n;
         for (n = 0; n < numofelements; n++, i++) {
             (*warray)[n] = wk_alloc_wide_string(argv[i+1], is_unicode);
         }
@@ -730,139 +1424,137 @@ static int wk_wordarray(const char *s, wchar_t ***warray, char **argv, int i, in
     return 0;
 }
 
-static wchar_t **wk_readpermute(const char *filename, int *is_unicode) {
-    FILE *fp;
-    wchar_t **warray = NULL;
-    char buf[512];
-    size_t i = 0;
-
-    errno = 0;
-    numofelements = 0;
-    memset(buf, 0, sizeof(buf));
-    if ((fp = fopen(filename, "r")) == NULL) {
-        fprintf(stderr,"readpermute: File %s could not be opened\n", filename);
-        fprintf(stderr,"The problem is = %s\n", strerror(errno));
-        return NULL;
-    } else {
-        while (fgets(buf, sizeof(buf), fp) != NULL) {
-            if (buf[0] != '\n')
-                numofelements++;
-        }
-        (void)fseek(fp, 0, SEEK_SET);
-
-        warray = calloc(numofelements, sizeof(wchar_t*));
-        if (warray == NULL) {
-            fprintf(stderr,"readpermute: can't allocate memory for wordarray1\n");
-            return NULL;
-        }
-        while (fgets(buf, (int)sizeof(buf), fp) != NULL) {
-            if (buf[0] != '\n' && buf[0] != '\0') {
-                buf[strlen(buf)-1] = '\0';
-                warray[i++] = wk_alloc_wide_string(buf, is_unicode);
-            }
-        }
-
-        if (fclose(fp) != 0) {
-            fprintf(stderr,"readpermute: fclose returned error number = %d\n", errno);
-            fprintf(stderr,"The problem is = %s\n", strerror(errno));
-        }
-        return warray;
-    }
-}
-
 static int wk_copy_charset(int argc, char **argv, int *i, wchar_t **c, int *is_unicode) {
+    wchar_t *tmp;
+
     if (argc > *i && *argv[*i] != '-') {
         if (*argv[*i] != '+') {
-            free(*c);
-            if(wk_copy(*c, argv[*i], is_unicode) == -1)
+            tmp = wk_arena_wcs(&setup, strlen(argv[*i]));
+            if (tmp == NULL || wk_copy(tmp, argv[*i], is_unicode) == -1)
                 return -1;
+            *c = tmp;
         }
         (*i)++;
     }
     return 0;
 }
 
-/* return 0 if string1 does not comply with options.pattern and options.literalstring */
-static int wk_check_member(const wchar_t *string1, const options_type *options) {
-    const wchar_t *cset;
-    size_t i;
+/* user charset given by -1 .. -9 */
+static int wk_user_charset(const char *s, struct wk_charset *cs, int *is_unicode) {
+    wchar_t *tmp;
 
-    for (i = 0; i < wcslen(string1); i++) {
-        cset = NULL;
-        switch (options->pattern[i]) {
-        case L'@':
-            if (options->literalstring[i] != L'@')
-                cset = options->low_charset;
-            break;
-        case L',':
-            if (options->literalstring[i] != L',')
-                cset = options->upp_charset;
-            break;
-        case L'%':
-            if (options->literalstring[i] != L'%')
-                cset = options->num_charset;
-            break;
-        case L'^':
-            if (options->literalstring[i] != L'^')
-                cset = options->sym_charset;
-            break;
-        default: /* constant part of pattern */
-            break;
-        }
+    tmp = wk_arena_wcs(&setup, strlen(s));
+    if (tmp == NULL || wk_copy(tmp, s, is_unicode) == -1)
+        return -1;
+    cs->cset = tmp;
+    return 0;
+}
 
-        if (cset == NULL) {
-            if (string1[i] != options->pattern[i])
-                return 0;
-            continue;
-        }
+/* map the builtin placeholders @ , % ^ to their charset */
+static int wk_class_of(wchar_t c) {
+    switch (c) {
+    case L'@': return WK_CS_LOW;
+    case L',': return WK_CS_UPP;
+    case L'%': return WK_CS_NUM;
+    case L'^': return WK_CS_SYM;
+    default:   return -1;
+    }
+}
 
-        while (*cset) {
-            if (string1[i] == *cset)
-                break;
-            else
-                cset++;
-        }
-        if (*cset == L'\0')
-            return 0;
+/* compute the length of a registry entry, wk_cindex_build indexes it */
+static int wk_compile_charset(struct wk_charset *cs) {
+    cs->clen = 0;
+    if (cs->cset == NULL)
+        return 0;
+
+    cs->clen = wcslen(cs->cset);
+    if (cs->clen == 0) {
+        fprintf(stderr,"Character set can not be empty\n");
+        return -1;
     }
-    return 1;
+    if (cs->clen > MAXCSET) {
+        fprintf(stderr,"Character set is too long, maximum is %d characters\n", MAXCSET);
+        return -1;
+    }
+    return 0;
 }
 
-static int wk_check_start_end(wchar_t *cset, wchar_t *start, wchar_t *end) {
-    size_t i;
+/* index of c in charset cls, NPOS if it is not a member */
+size_t wk_cset_index(const options_type *op, int cls, wchar_t c) {
+    size_t id = wk_cindex_id(&op->cindex, c);
 
-    if (start != NULL && end != NULL) {
-        for (i = 0; i < wcslen(start); i++) {
-            wchar_t startcharsrch = start[i];
-            wchar_t *startpos;
-            startpos = wcschr(cset, startcharsrch);
-            int startplace = startpos - cset;
+    if (id == NPOS || op->cindex.pos[id][cls] == 0)
+        return NPOS;
+    return (size_t)op->cindex.pos[id][cls] - 1;
+}
 
-            wchar_t endcharsrch = end[i];
-            wchar_t *endpos;
-            endpos = wcschr(cset, endcharsrch);
-            int endplace = endpos - cset;
+/*
+ * Compile options->pattern to one entry per output position.
+ * @ , % ^ and ?1..?9 select a charset from the registry, anything else
+ * (or a placeholder listed in the literal string) is a fixed character.
+ */
+static int wk_compile_pattern(options_type *op) {
+    size_t i, n, len;
+    int cls;
+
+    len = wcslen(op->pattern);
+    op->pclass = wk_arena_alloc(&setup, (len+1) * sizeof(int), sizeof(int));
+    op->pchars = wk_arena_wcs(&setup, len);
+    if (op->pclass == NULL || op->pchars == NULL)
+        return -1;
+
+    for (i = 0, n = 0; i < len; i++, n++) {
+        op->pclass[n] = -1;
+        op->pchars[n] = op->pattern[i];
+
+        if (op->literalstring[i] == op->pattern[i])
+            continue;
 
-            if (startplace > endplace) {
-                fprintf(stderr,"End string must be greater than start string\n");
+        if (op->pattern[i] == L'?' && op->pattern[i+1] >= L'1' && op->pattern[i+1] <= L'9') {
+            cls = WK_CS_USER + (int)(op->pattern[i+1] - L'1');
+            if (op->charsets[cls].cset == NULL) {
+                fprintf(stderr,"Pattern uses ?%lc but charset -%lc was not specified\n",
+                        (wint_t)op->pattern[i+1], (wint_t)op->pattern[i+1]);
                 return -1;
             }
+            op->pclass[n] = cls;
+            i++;
+        } else {
+            op->pclass[n] = wk_class_of(op->pattern[i]);
+        }
+    }
+    op->pchars[n] = L'\0';
+    op->plen = n;
+
+    return 0;
+}
 
-            if (startplace < endplace)
+/* return 0 if string1 does not comply with options.pattern and options.literalstring */
+static int wk_check_member(const wchar_t *string1, const options_type *options) {
+    size_t i, len;
+    int cls;
+
+    len = wcslen(string1);
+    for (i = 0; i < len && i < options->plen; i++) {
+        cls = options->pclass[i];
+
+        if (cls < 0) { /* constant part of pattern */
+            if (string1[i] != options->pchars[i])
                 return 0;
+            continue;
         }
+
+        if (wk_cset_index(options, cls, string1[i]) == NPOS)
+            return 0;
     }
-    return -1;
+    return 1;
 }
 
 static int wk_default_literalstring(size_t max, wchar_t **wstr) {
     size_t size;
 
-    *wstr = calloc(max+1, sizeof(wchar_t));
-    if (*wstr == NULL) {
-        fprintf(stderr,"can't allocate memory for literalstring\n");
+    if ((*wstr = wk_arena_wcs(&setup, max)) == NULL)
         return -1;
-    }
     
     for (size = 0; size < max; size++)
         (*wstr)[size] = L'-';
@@ -871,38 +1563,18 @@ static int wk_default_literalstring(size_t max, wchar_t **wstr) {
     return 0;
 }
 
-/* NOTE: similar to strpbrk but length limited and only searches for a single char */
-static size_t wk_find_index(const wchar_t *cset, size_t clen, wchar_t tofind) {
-    size_t i;
-
-    for (i = 0; i < clen; i++) {
-        if (cset[i] == tofind)
-            return i;
-    }
-    return NPOS;
-}
-
-static int wk_too_many_duplicates(const wchar_t *block, const options_type options) {
+static int wk_too_many_duplicates(const wchar_t *block, const options_type *options) {
     wchar_t cchar = L'\0';
-    size_t dupes_seen = 0;
+    size_t dupes_seen = 0, id;
 
     while (*block != L'\0') {
         if (*block == cchar) {
             /* check for overflow of duplicates */
             dupes_seen += 1;
 
-            if (dupes_seen > options.duplicates[0]) {
-                if (wk_find_index(options.low_charset, options.clen, cchar) != NPOS) return 1;
-            }
-            if (dupes_seen > options.duplicates[1]) {
-                if (wk_find_index(options.upp_charset, options.ulen, cchar) != NPOS) return 1;
-            }
-            if (dupes_seen > options.duplicates[2]) {
-                if (wk_find_index(options.num_charset, options.nlen, cchar) != NPOS) return 1;
-            }
-            if (dupes_seen > options.duplicates[3]) {
-                if (wk_find_index(options.sym_charset, options.slen, cchar) != NPOS) return 1;
-            }
+            id = wk_cindex_id(&options->cindex, cchar);
+            if (id != NPOS && dupes_seen > options->cindex.dlim[id])
+                return 1;
         } else {
             cchar = *block;
             dupes_seen = 1;
@@ -912,68 +1584,35 @@ static int wk_too_many_duplicates(const wchar_t *block, const options_type optio
     return 0;
 }
 
-static inline wchar_t *wk_strcalloc(size_t size) {
-    wchar_t *tmp = NULL;
-
-    tmp = calloc(size+1, sizeof(wchar_t));
-    if (tmp == NULL) {
-        fprintf(stderr,"wk string calloc function can't allocate memory\n");
-        return NULL;
-    }
-    tmp[size-1] = L'\0';
-
-    return tmp;
-}
-
 static int wk_fill_minmax_strings(options_type *options) {
     size_t i;
     wchar_t *last_min;                  /* last string of size min */
     wchar_t *first_max;                 /* first string of size max */
     wchar_t *min_string, *max_string;   /* first string of size min, last string of size max */
+    const struct wk_charset *cs;
 
-    if ((last_min = wk_strcalloc(options->min+1)) == NULL) return -1;
-    if ((first_max = wk_strcalloc(options->max+1)) == NULL) return -1;
-    if ((min_string = wk_strcalloc(options->min+1)) == NULL) return -1;
-    if ((max_string = wk_strcalloc(options->max+1)) == NULL) return -1;
+    /* the four strings side by side */
+    if ((last_min = wk_arena_wcs(&setup, 2*options->min + 2*options->max + 3)) == NULL) return -1;
+    min_string = last_min + options->min + 1;
+    first_max = min_string + options->min + 1;
+    max_string = first_max + options->max + 1;
 
     /* fill last_min and first_max */
     for (i = 0; i < options->max; i++) {
         if (options->pattern == NULL) {
+            cs = &options->charsets[WK_CS_LOW];
             if (i < options->min) {
-                last_min[i] = options->low_charset[options->clen-1];
-                min_string[i] = options->low_charset[0];
+                last_min[i] = cs->cset[cs->clen-1];
+                min_string[i] = cs->cset[0];
             }
-            first_max[i] = options->low_charset[0];
-            max_string[i] = options->low_charset[options->clen-1];
+            first_max[i] = cs->cset[0];
+            max_string[i] = cs->cset[cs->clen-1];
         } else { /* min == max */
-            min_string[i] = max_string[i] = last_min[i] = first_max[i] = options->pattern[i];
-            switch (options->pattern[i]) {
-            case L'@':
-                if (options->literalstring[i] != L'@') {
-                    max_string[i] = last_min[i] = options->low_charset[options->clen-1];
-                    min_string[i] = first_max[i] = options->low_charset[0];
-                }
-                break;
-            case L',':
-                if (options->literalstring[i] != L',') {
-                    max_string[i] = last_min[i] = options->upp_charset[options->clen-1];
-                    min_string[i] = first_max[i] = options->upp_charset[0];
-                }
-                break;
-            case L'%':
-                if (options->literalstring[i] != L',') {
-                    max_string[i] = last_min[i] = options->num_charset[options->clen-1];
-                    min_string[i] = first_max[i] = options->num_charset[0];
-                }
-                break;
-            case L'^':
-                if (options->literalstring[i] != L',') {
-                    max_string[i] = last_min[i] = options->sym_charset[options->clen-1];
-                    min_string[i] = first_max[i] = options->sym_charset[0];
-                }
-                break;
-            default:
-                break;
+            min_string[i] = max_string[i] = last_min[i] = first_max[i] = options->pchars[i];
+            if (options->pclass[i] >= 0) {
+                cs = &options->charsets[options->pclass[i]];
+                max_string[i] = last_min[i] = cs->cset[cs->clen-1];
+                min_string[i] = first_max[i] = cs->cset[0];
             }
         }
     }
@@ -997,169 +1636,556 @@ static int wk_fill_minmax_strings(options_type *options) {
     return 0;
 }
 
-static void wk_fill_pattern_info(options_type *options) {
+static int wk_fill_pattern_info(options_type *options) {
     struct pinfo *p;
-    wchar_t *cset;
-    size_t i, clen, index, si, ei;
-    int is_fixed;
-    size_t dupes;
-
-    options->pattern_info = calloc(options->max, sizeof(struct pinfo));
-    if (options->pattern_info == NULL) {
-        fprintf(stderr,"fill_pattern_info: can't allocate memory for pattern info\n");
-        exit(EXIT_FAILURE);
-    }
+    const struct wk_charset *cs;
+    size_t i, index, si, ei;
+    int cls, is_fixed;
+
+    options->pattern_info = wk_arena_alloc(&setup, options->max * sizeof(struct pinfo), WK_CACHELINE);
+    if (options->pattern_info == NULL)
+        return -1;
 
     for (i = 0; i < options->max; i++) {
-        cset = NULL;
-        clen = 0;
         index = 0;
         is_fixed = 1;
-        dupes = options->duplicates[0];
 
         if (options->pattern == NULL) {
-            cset = options->low_charset;
-            clen = options->clen;
+            cls = WK_CS_LOW;
+            is_fixed = 0;
+        } else if (options->pclass[i] >= 0) {
+            cls = options->pclass[i];
             is_fixed = 0;
         } else {
-            cset = NULL;
-            switch (options->pattern[i]) {
-            case L'@':
-                if (options->literalstring[i] != L'@') {
-                    cset = options->low_charset;
-                    clen = options->clen;
-                    is_fixed = 0;
-                    dupes = options->duplicates[0];
-                }
-                break;
-            case L',':
-                if (options->literalstring[i] != L',') {
-                    cset = options->upp_charset;
-                    clen = options->ulen;
-                    is_fixed = 0;
-                    dupes = options->duplicates[1];
-                }
-                break;
-            case L'%':
-                if (options->literalstring[i] != L'%') {
-                    cset = options->num_charset;
-                    clen = options->nlen;
-                    is_fixed = 0;
-                    dupes = options->duplicates[2];
-                }
-                break;
-            case L'^':
-                if (options->literalstring[i] != L'^') {
-                    cset = options->sym_charset;
-                    clen = options->slen;
-                    is_fixed = 0;
-                    dupes = options->duplicates[3];
-                }
-                break;
-            default: /* constant part of pattern */
-                break;
+            /* fixed character.  find its charset and index within. */
+            for (cls = 0; cls < WK_NCHARSETS; cls++) {
+                index = wk_cset_index(options, cls, options->pchars[i]);
+                if (index != NPOS)
+                    break;
+            }
+            if (cls == WK_NCHARSETS) {
+                cls = -1;
+                index = 0;
             }
         }
 
-        if (cset == NULL) {
-            /* fixed character.  find its charset and index within. */
-            cset = options->low_charset;
-            clen = options->clen;
-            dupes = options->duplicates[0];
+        p = &(options->pattern_info[i]);
+        p->cls = (int16_t)cls;
+        p->is_fixed = (int16_t)is_fixed;
 
-            if (options->pattern == NULL) {
-                fprintf(stderr,"fill_pattern_info: options->pattern is NULL!\n");
-                exit(EXIT_FAILURE);
-            }
+        if (cls < 0) {
+            p->cset = NULL;
+            p->clen = 0;
+            p->start_index = p->end_index = 0;
+            continue;
+        }
 
-            if ((index = wk_find_index(cset, clen, options->pattern[i])) == NPOS) {
-                cset = options->upp_charset;
-                clen = options->ulen;
-                dupes = options->duplicates[1];
-                if ((index = wk_find_index(cset, clen, options->pattern[i])) == NPOS) {
-                    cset = options->num_charset;
-                    clen = options->nlen;
-                    dupes = options->duplicates[2];
-                    if ((index = wk_find_index(cset, clen, options->pattern[i])) == NPOS) {
-                        cset = options->num_charset;
-                        clen = options->nlen;
-                        dupes = options->duplicates[3];
-                        if ((index = wk_find_index(cset, clen, options->pattern[i])) == NPOS) {
-                            cset = NULL;
-                            clen = 0;
-                            dupes = (size_t)-1;
-                            index = 0;
-                        }
-                    }
-                }
-            }
+        cs = &options->charsets[cls];
+        p->cset = cs->cset;
+        p->clen = (uint32_t)cs->clen;
 
+        if (is_fixed) {
             si = ei = index;
         } else {
             if (i < wcslen(options->min_string))
-                si = wk_find_index(cset, clen, options->min_string[i]);
+                si = wk_cset_index(options, cls, options->min_string[i]);
             else
                 si = 0;
-            
-            ei = wk_find_index(cset, clen, options->max_string[i]);
+
+            ei = wk_cset_index(options, cls, options->max_string[i]);
 
             if (si == NPOS || ei == NPOS) {
                 fprintf(stderr,"fill_pattern_info: Internal error: "\
                         "Can't find char at pos #%lu in cset\n",
                         (unsigned long)i+1);
-                exit(EXIT_FAILURE);
+                return -1;
             }
         }
-        
-        p = &(options->pattern_info[i]);
-        p->cset = cset;
-        p->clen = clen;
-        p->is_fixed = is_fixed;
-        p->start_index = si;
-        p->end_index = ei;
-        p->duplicates = dupes;
+        p->start_index = (uint32_t)si;
+        p->end_index = (uint32_t)ei;
     }
+    return 0;
 }
 
-static wchar_t *wk_resumesession(const char *fpath, const wchar_t *charset) {
-    FILE *fp;               /* ptr to START output file; will be renamed later */
-    char buff[512];         /* buffer to hold line from wordlist */
-    wchar_t *startblock;
-    size_t j, k;
+static wchar_t *wk_resumesession(const char *fpath) {
+    char buf[65536];
+    char buff[512];         /* the last complete line, resumed from */
+    unsigned long long off = 0, end = 0, last = 0;
+    size_t n, k;
+    ssize_t r;
+    int fd;
 
-    errno = 0;
-    memset(buff, 0, sizeof(buff));
+    if ((fd = open(fpath, O_RDWR)) == -1) {
+        fprintf(stderr,"resume: File START could not be opened\n");
+        return NULL;
+    }
+    while ((n = (size_t)read(fd, buf, sizeof(buf))) > 0 && n != NPOS) {
+        for (k = 0; k < n; k++) {
+            if (buf[k] == '\n') {
+                my_thread.linecounter++;
+                last = end;
+                end = off + k + 1;
+            }
+        }
+        off += n;
+    }
+    if (n == NPOS) {
+        fprintf(stderr,"resume: can't read %s: %s\n", fpath, strerror(errno));
+        goto err;
+    }
+    if (end == 0) {
+        fprintf(stderr,"resume: %s has no complete line to resume from\n", fpath);
+        goto err;
+    }
+
+    /* a line cut off by the crash is written again */
+    if (end != off && ftruncate(fd, (off_t)end) == -1) {
+        fprintf(stderr,"resume: can't truncate %s: %s\n", fpath, strerror(errno));
+        goto err;
+    }
+    if (end - 1 - last >= sizeof(buff)) {
+        fprintf(stderr,"resume: the last line of %s is too long\n", fpath);
+        goto err;
+    }
+    if ((r = pread(fd, buff, (size_t)(end - 1 - last), (off_t)last)) != (ssize_t)(end - 1 - last)) {
+        fprintf(stderr,"resume: can't read %s: %s\n", fpath, r == -1 ? strerror(errno) : "short read");
+        goto err;
+    }
+    buff[r] = '\0';
+    (void)close(fd);
+
+    my_thread.bytecounter = end;
+    fprintf(stderr, "Resuming from = %s\n", buff);
+    return wk_alloc_wide_string(buff, NULL);
+
+err:
+    (void)close(fd);
+    return NULL;
+}
+
+/* the words of -q or -p, mangled by --word-rules if given */
+static int wk_mode_words(const char *wordfile, wchar_t **wordarray, const char *wordrules,
+                         int nthreads, struct wk_words *w) {
+    struct wk_filter rules;
+    struct wk_words mangled;
+
+    if (wordfile != NULL) {
+        if (wk_words_sorted(wordfile, nthreads, w) == -1)
+            return -1;
+    } else if (wk_words_from_wcs(wordarray, numofelements, w) == -1) {
+        return -1;
+    }
+    if (wordrules == NULL)
+        return 0;
+
+    if (wk_rules_filter(wordrules, &rules) == -1 || wk_rules_words(&rules, w, &mangled) == -1)
+        return -1;
+    wk_words_free(w);
+    *w = mangled;
+    return 0;
+}
 
-    if ((fp = fopen(fpath, "r")) == NULL) {
+/*
+ * Resume by candidate index: count the complete lines of the output file
+ * and cut off a last line that was only partly written.
+ */
+static int wk_resumeindex(const char *fpath) {
+    char buf[65536];
+    unsigned long long off = 0, end = 0;
+    size_t n, k;
+    int fd;
+
+    if ((fd = open(fpath, O_RDONLY)) == -1) {
         fprintf(stderr,"resume: File START could not be opened\n");
-        exit(EXIT_FAILURE);
-    } else {
-        while (feof(fp) == 0) {
-            (void)fgets(buff, (int)sizeof(buff), fp);
-            ++my_thread.linecounter;
-            my_thread.bytecounter += (unsigned long long)strlen(buff);
+        return -1;
+    }
+    while ((n = (size_t)read(fd, buf, sizeof(buf))) > 0 && n != NPOS) {
+        for (k = 0; k < n; k++) {
+            if (buf[k] == '\n') {
+                my_thread.linecounter++;
+                end = off + k + 1;
+            }
         }
-        my_thread.linecounter--; /* -1 to get correct num */
-        my_thread.bytecounter -= (unsigned long long)strlen(buff);
+        off += n;
+    }
+    (void)close(fd);
+    if (n == NPOS) {
+        fprintf(stderr,"resume: can't read %s: %s\n", fpath, strerror(errno));
+        return -1;
+    }
 
-        if (fclose(fp) != 0) {
-            fprintf(stderr,"resume: fclose returned error number = %d\n", errno);
-            fprintf(stderr,"The problem is = %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
+    if (end != off && truncate(fpath, (off_t)end) == -1) {
+        fprintf(stderr,"resume: can't truncate %s: %s\n", fpath, strerror(errno));
+        return -1;
+    }
+    my_thread.bytecounter = end;
+    fprintf(stderr,"Resuming after %llu lines\n", (unsigned long long)my_thread.linecounter);
+    return 0;
+}
+
+/* split a line of a mask file on blanks, "double quotes" keep blanks in a token */
+static int wk_split_line(char *line, char **tok, int maxtok) {
+    char *p = line;
+    int n = 0;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            p++;
+        if (*p == '\0')
+            break;
+        if (n == maxtok)
+            return -1;
+
+        if (*p == '"') {
+            tok[n++] = ++p;
+            if ((p = strchr(p, '"')) == NULL)
+                return -1;
+            *p++ = '\0';
+        } else {
+            tok[n++] = p;
+            while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+                p++;
+            if (*p != '\0')
+                *p++ = '\0';
         }
+    }
+    return n;
+}
+
+/*
+ * Read a file of masks.  Every line holds optional -1..-9, -l and -d
+ * options followed by the mask, e.g.
+ *
+ *   -1 aeiou -d 1?1 ,?1?1@@%%
+ *
+ * Charsets not given on the line are taken from the command line.  Masks
+ * whose length is outside min..max are skipped, blank lines and lines
+ * starting with # are ignored.  Everything is compiled before the first
+ * candidate is written.
+ */
+static int wk_readmasks(const char *filename, const options_type *base, size_t min, size_t max,
+                        struct wk_maskjob **jobs, size_t *njobs, int *is_unicode) {
+    FILE *fp;
+    char buf[4096];
+    char *tok[MAXMASKTOKENS];
+    struct wk_maskjob *job, *tmp;
+    options_type *op;
+    size_t lineno = 0, index = 0, cap = 0, n;
+    int ntok, t, cls;
 
-        if (buff[0]) buff[strlen(buff)-1] = '\0';
+    errno = 0;
+    *jobs = NULL;
+    *njobs = 0;
 
-        startblock = wk_alloc_wide_string(buff, NULL);
-        fprintf(stderr, "Resuming from = %s\n", buff);
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr,"readmasks: File %s could not be opened\n", filename);
+        fprintf(stderr,"The problem is = %s\n", strerror(errno));
+        return -1;
+    }
 
-        for (j = 0; j < wcslen(startblock); j++) {
-            for (k = 0; k < wcslen(charset); k++) {
-                if (startblock[j] == charset[k])
-                    inc[j] = k;
+    while (fgets(buf, (int)sizeof(buf), fp) != NULL) {
+        lineno++;
+        ntok = wk_split_line(buf, tok, MAXMASKTOKENS);
+        if (ntok == -1) {
+            fprintf(stderr,"%s:%lu: malformed line\n", filename, (unsigned long)lineno);
+            goto err;
+        }
+        if (ntok == 0 || tok[0][0] == '#')
+            continue;
+        if (ntok % 2 == 0) {
+            fprintf(stderr,"%s:%lu: every option needs a value and the mask must come last\n",
+                    filename, (unsigned long)lineno);
+            goto err;
+        }
+
+        if (*njobs == cap) {
+            cap = cap ? cap * 2 : 16;
+            tmp = realloc(*jobs, cap * sizeof(struct wk_maskjob));
+            if (tmp == NULL) {
+                fprintf(stderr,"readmasks: can't allocate memory for masks\n");
+                goto err;
             }
+            *jobs = tmp;
         }
-        return startblock;
+
+        job = &(*jobs)[*njobs];
+        memset(job, 0, sizeof(*job));
+        job->op = *base;
+        job->lineno = lineno;
+        job->index = index++;
+        op = &job->op;
+        op->pattern = NULL;
+        op->literalstring = NULL;
+        op->startstring = NULL;
+        op->endstring = NULL;
+
+        for (t = 0; t < ntok - 1; t += 2) {
+            if (tok[t][0] == '-' && tok[t][1] >= '1' && tok[t][1] <= '9' && tok[t][2] == '\0') {
+                cls = WK_CS_USER + (tok[t][1] - '1');
+                if (wk_user_charset(tok[t+1], &op->charsets[cls], is_unicode) == -1) goto err;
+            } else if (strcmp(tok[t], "-l") == 0) {
+                op->literalstring = wk_alloc_wide_string(tok[t+1], is_unicode);
+            } else if (strcmp(tok[t], "-d") == 0) {
+                if (wk_dupskip(tok[t+1], op) == -1) goto err;
+            } else {
+                fprintf(stderr,"%s:%lu: unknown option %s\n", filename, (unsigned long)lineno, tok[t]);
+                goto err;
+            }
+        }
+
+        op->pattern = wk_alloc_wide_string(tok[ntok-1], is_unicode);
+        if (op->literalstring == NULL) {
+            if (wk_default_literalstring(wcslen(op->pattern), &op->literalstring) == -1) goto err;
+        } else if (wcslen(op->literalstring) != wcslen(op->pattern)) {
+            fprintf(stderr,"%s:%lu: Length of literal string should be the same length as pattern\n",
+                    filename, (unsigned long)lineno);
+            goto err;
+        }
+
+        for (n = 0; n < WK_NCHARSETS; n++) {
+            if (wk_compile_charset(&op->charsets[n]) == -1) goto err;
+        }
+        if (wk_cindex_build(&op->cindex, op->charsets) == -1) goto err;
+        if (wk_compile_pattern(op) == -1) {
+            fprintf(stderr,"%s:%lu: invalid mask\n", filename, (unsigned long)lineno);
+            goto err;
+        }
+
+        if (op->plen < min || op->plen > max || op->plen > MAXSTRING || op->plen == 0) {
+            fprintf(stderr,"%s:%lu: skipping mask of length %lu, outside %lu..%lu\n", filename,
+                    (unsigned long)lineno, (unsigned long)op->plen, (unsigned long)min,
+                    (unsigned long)(max < MAXSTRING ? max : MAXSTRING));
+            continue;
+        }
+
+        op->min = op->max = op->plen;
+        if (wk_fill_minmax_strings(op) == -1 || wk_fill_pattern_info(op) == -1) goto err;
+        (*njobs)++;
     }
-    return NULL;
-}
\ No newline at end of file
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr,"readmasks: fclose returned error number = %d\n", errno);
+        fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    }
+    if (*njobs == 0) {
+        fprintf(stderr,"%s: no mask of length %lu..%lu\n", filename, (unsigned long)min,
+                (unsigned long)max);
+        return -1;
+    }
+
+    /* the array doesn't move anymore, sources can point into it */
+    for (n = 0; n < *njobs; n++) {
+        job = &(*jobs)[n];
+        if (wk_mask_compile(&job->op, (int)inverted, &job->mask) == -1) {
+            fprintf(stderr,"%s:%lu: can't compile mask\n", filename, (unsigned long)job->lineno);
+            return -1;
+        }
+        wk_mask_source(&job->mask, &job->src);
+    }
+    return 0;
+err:
+    (void)fclose(fp);
+    return -1;
+}
+
+/* append "mask lines bytes" to the checkpoint once a mask is completely written */
+static int wk_mask_done(struct wk_segment *seg, struct wk_sink *sink) {
+    const struct wk_maskjob *job = seg->arg;
+    FILE *fp;
+
+    if ((fp = fopen(job->ckpt, "a")) == NULL) {
+        fprintf(stderr,"checkpoint: File %s could not be opened\n", job->ckpt);
+        fprintf(stderr,"The problem is = %s\n", strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "%lu %llu %llu\n", (unsigned long)job->index, sink->lines, sink->bytes);
+    if (fclose(fp) != 0) {
+        fprintf(stderr,"checkpoint: fclose returned error number = %d\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run the masks in file order over one worker pool and one sink.  On
+ * resume the masks listed in the checkpoint are skipped and the output
+ * file is cut back to the end of the last completed mask.
+ */
+static int wk_maskqueue(struct wk_maskjob *jobs, size_t njobs, const char *ckpt, int resume,
+                        struct wk_sink *sink, const char *fpath, const char *outputf,
+                        const char *compressalgo, int nthreads,
+                        const struct wk_placement *place) {
+    struct wk_segment *segs;
+    FILE *fp;
+    char buf[128];
+    struct stat st;
+    unsigned long done = 0, d;
+    unsigned long long lines = 0, bytes = 0, l, b;
+    unsigned long long fsize = ULLONG_MAX;
+    int have_done = 0, rc;
+    size_t j, nsegs = 0;
+
+    if (resume) {
+        /* a mask only counts as done if its output made it to the file */
+        if (fpath != NULL)
+            fsize = stat(fpath, &st) == 0 ? (unsigned long long)st.st_size : 0;
+
+        if ((fp = fopen(ckpt, "r")) != NULL) {
+            while (fgets(buf, (int)sizeof(buf), fp) != NULL) {
+                if (sscanf(buf, "%lu %llu %llu", &d, &l, &b) == 3 && b <= fsize) {
+                    done = d;
+                    lines = l;
+                    bytes = b;
+                    have_done = 1;
+                }
+            }
+            (void)fclose(fp);
+        }
+        if (have_done) {
+            fprintf(stderr, "Resuming after mask %lu\n", done + 1);
+            if (fpath != NULL && truncate(fpath, (off_t)bytes) != 0) {
+                fprintf(stderr,"resume: can't truncate %s: %s\n", fpath, strerror(errno));
+                return -1;
+            }
+        }
+    } else {
+        (void)remove(ckpt);
+    }
+
+    segs = calloc(njobs ? njobs : 1, sizeof(struct wk_segment));
+    if (segs == NULL) {
+        fprintf(stderr,"maskqueue: can't allocate memory for segments\n");
+        return -1;
+    }
+
+    for (j = 0; j < njobs; j++) {
+        if (have_done && jobs[j].index <= done)
+            continue;
+        jobs[j].ckpt = ckpt;
+        segs[nsegs].src = &jobs[j].src;
+        segs[nsegs].first = 0;
+        segs[nsegs].count = jobs[j].src.total;
+        segs[nsegs].done = wk_mask_done;
+        segs[nsegs].arg = &jobs[j];
+        nsegs++;
+    }
+
+    if (wk_sink_open(sink, fpath, outputf, compressalgo, have_done) == -1) {
+        free(segs);
+        return -1;
+    }
+    sink->lines = lines;
+    sink->bytes = bytes;
+
+    rc = wk_pool_run(segs, nsegs, sink, nthreads, place);
+    if (wk_sink_close(sink) == -1)
+        rc = -1;
+
+    free(segs);
+    return rc;
+}
+
+/* FNV-1a of n bytes at p, continuing from h */
+static uint64_t wk_fnv(uint64_t h, const void *p, size_t n) {
+    const unsigned char *c = p;
+
+    while (n-- > 0)
+        h = (h ^ *c++) * 0x100000001b3ULL;
+    return h;
+}
+
+/*
+ * Hash of what decides the candidates beyond their count: the charsets,
+ * pattern and literal string of a mask, the words of -p, -q or -k and
+ * the option strings of strs (NULL ones count as empty).
+ */
+static uint64_t wk_job_hash(const options_type *op, const struct wk_words *w, size_t nw,
+                            char *const *strs, size_t nstrs) {
+    const wchar_t *wcs[4] = { op->pattern, op->literalstring, op->startstring, op->endstring };
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i, k, len;
+
+    for (i = 0; i < WK_NCHARSETS; i++) {
+        len = op->charsets[i].cset != NULL ? wcslen(op->charsets[i].cset) : 0;
+        h = wk_fnv(h, &len, sizeof(len));
+        h = wk_fnv(h, op->charsets[i].cset, len * sizeof(wchar_t));
+        h = wk_fnv(h, &op->charsets[i].duplicates, sizeof(op->charsets[i].duplicates));
+    }
+    for (i = 0; i < 4; i++) {
+        len = wcs[i] != NULL ? wcslen(wcs[i]) : 0;
+        h = wk_fnv(h, &len, sizeof(len));
+        h = wk_fnv(h, wcs[i], len * sizeof(wchar_t));
+    }
+    for (i = 0; i < nw; i++) {
+        for (k = 0; k < w[i].n; k++) {
+            h = wk_fnv(h, &w[i].len[k], sizeof(w[i].len[k]));
+            h = wk_fnv(h, w[i].arena + w[i].off[k], w[i].len[k]);
+        }
+    }
+    for (i = 0; i < nstrs; i++) {
+        len = strs[i] != NULL ? strlen(strs[i]) : 0;
+        h = wk_fnv(h, &len, sizeof(len));
+        h = wk_fnv(h, strs[i], len);
+    }
+    return h;
+}
+
+/* generate seg, a plain mask is scheduled a length at a time so each gets chunks of its record size */
+static int wk_run_range(struct wk_segment *seg, const struct wk_mask *mask, struct wk_sink *sink,
+                        int nthreads, const struct wk_placement *place) {
+    struct wk_segment *lsegs;
+    size_t nlsegs;
+    int rc;
+
+    if (mask == NULL || mask->nspaces < 2)
+        return wk_pool_run(seg, 1, sink, nthreads, place);
+
+    lsegs = calloc(mask->nspaces, sizeof(struct wk_segment));
+    if (lsegs == NULL) {
+        fprintf(stderr,"bfc: can't allocate memory for segments\n");
+        return -1;
+    }
+    nlsegs = wk_mask_segments(mask, seg->src, seg->first, seg->count,
+                              seg->chunk ? seg->chunk * seg->src->maxrec : WK_CHUNKBYTES, lsegs);
+    rc = wk_pool_run(lsegs, nlsegs, sink, nthreads, place);
+    free(lsegs);
+    return rc;
+}
+
+/* bfc lease: generate the leases of the server at path until they are all done */
+static int wk_lease_loop(const char *path, const char *key, struct wk_segment *seg,
+                         const struct wk_mask *mask, struct wk_sink *sink, int nthreads,
+                         const struct wk_placement *place) {
+    struct wk_segment s = *seg;
+    struct wk_lease_keeper keeper;
+    struct wk_lease l;
+    int fd, rc, lost;
+
+    if ((fd = wk_lease_connect(path, key, seg->first, seg->count)) == -1)
+        return -1;
+    while ((rc = wk_lease_next(fd, &l)) == 1) {
+        s.first = l.first;
+        s.count = l.count;
+        if (wk_lease_keep(&keeper, fd, &l) == -1) {
+            rc = -1;
+            break;
+        }
+        rc = wk_run_range(&s, mask, sink, nthreads, place);
+        lost = wk_lease_release(&keeper) == -1;
+        if (rc == -1 || lost) {
+            rc = -1;
+            break;
+        }
+        /* a reader that went away leaves the lease to the other consumers */
+        if (sink->broken) {
+            rc = 0;
+            break;
+        }
+        if (wk_lease_complete(fd, &l) == -1) {
+            rc = -1;
+            break;
+        }
+    }
+    (void)close(fd);
+    return rc;
+}
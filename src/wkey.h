@@ -32,6 +32,20 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define MAXSTRING       128             /* largest output string */
+#define MAXCSET         256             /* longest character set */
+#define NPOS            ((size_t)-1)    /* invalid index for size_t's */
+#define WK_MBMAX        8               /* largest encoding of one character */
+#define WK_CHUNKBYTES   (1 << 20)       /* output generated by a worker per chunk */
+#define WK_MAXTHREADS   64
+#define WK_MAXCPUS      1024            /* cpus a placement can name */
+#define WK_MAXNODES     64
+#define WK_CACHELINE    64
+#define WK_ARENA_BLOCK  (64 << 10)      /* bytes the startup arena grows by */
 
 struct thread_data{
     unsigned long long finalfilesize;   /* total size of output */
@@ -42,36 +56,266 @@ struct thread_data{
     unsigned long long linecounter;     /* counts number of lines in output resets to 0 */
 };
 
-/* pattern info */
-struct pinfo {
-    wchar_t *cset;                      /* character set pattern[i] is member of */
+#define WK_NCHARSETS    13              /* @ , % ^ plus the user charsets ?1..?9 */
+#define WK_CS_LOW       0               /* @ */
+#define WK_CS_UPP       1               /* , */
+#define WK_CS_NUM       2               /* % */
+#define WK_CS_SYM       3               /* ^ */
+#define WK_CS_USER      4               /* ?1 */
+#define WK_NUSERSETS    (WK_NCHARSETS - WK_CS_USER)
+#define WK_CIX_PAGES    256             /* pages of 256 chars covering the BMP */
+
+/* character set registry entry */
+struct wk_charset {
+    wchar_t *cset;                      /* NULL if the set is not defined */
     size_t clen;
-    int is_fixed;                       /* whether pattern[i] is a fixed value */
-    size_t start_index, end_index;      /* index into cset for the start and end strings */
-    size_t duplicates;
+    size_t duplicates;                  /* allowed number of duplicates */
+};
+
+/* every char of the registry to a dense id, see cindex.c */
+struct wk_cindex {
+    uint16_t *page[WK_CIX_PAGES];       /* BMP, page[c>>8][c&255] is id+1, 0 if absent */
+    size_t nbuckets, nslots;            /* chars above the BMP */
+    uint32_t *disp;                     /* hash seed of every bucket */
+    wchar_t *key;                       /* char of every slot */
+    uint16_t *sid;                      /* its id+1, 0 for a free slot */
+    size_t nids;
+    uint16_t (*pos)[WK_NCHARSETS];      /* index+1 of an id in every charset, 0 if absent */
+    size_t *dlim;                       /* smallest duplicate limit of the charsets holding an id */
+};
+
+/* allocations that live until wk_arena_free, see arena.c */
+struct wk_ablock;
+struct wk_arena {
+    struct wk_ablock *blocks;           /* newest first */
+    char *next, *end;                   /* free part of the newest block */
+};
+
+/* pattern info, two positions to a cache line */
+struct pinfo {
+    const wchar_t *cset;                /* character set pattern[i] is member of */
+    uint32_t clen;
+    int16_t cls;                        /* index of cset in the charset registry, -1 if none */
+    int16_t is_fixed;                   /* whether pattern[i] is a fixed value */
+    uint32_t start_index, end_index;    /* index into cset for the start and end strings */
+    uint64_t pad;                       /* to 32 bytes */
 };
 
-/* program options */
+/*
+ * program options, the compiled pattern first and the charsets behind it.
+ * Every string and array it points to lives in the startup arena.
+ */
 typedef struct opts_struct {
-    wchar_t *low_charset;
-    wchar_t *upp_charset;
-    wchar_t *num_charset;
-    wchar_t *sym_charset;
-    size_t clen, ulen, nlen, slen;
+    size_t plen;                /* number of positions in the compiled pattern */
+    size_t min, max;
+    struct pinfo *pattern_info; /* information generated from pattern, cache line aligned */
+    int *pclass;                /* charset of each position, -1 for a fixed character */
+    wchar_t *pchars;            /* fixed character of each position */
     wchar_t *pattern;
-    size_t plen;
     wchar_t *literalstring;
     wchar_t *startstring;
     wchar_t *endstring;
-    size_t duplicates[4];       /* allowed number of duplicates for each charset */
-    size_t min, max;
     wchar_t *last_min;          /* last string of length min */
     wchar_t *first_max;         /* first string of length max */
     wchar_t *min_string;
     wchar_t *max_string;        /* either startstring/endstring or calculated using the pattern */
-    struct pinfo *pattern_info; /* information generated from pattern */
+    struct wk_charset charsets[WK_NCHARSETS];
+    struct wk_cindex cindex;    /* built once the charsets are compiled */
 } options_type;
 
+/* one output position, every choice pre-encoded for output */
+struct wk_epos {
+    size_t radix;                       /* number of choices, 1 for a fixed character */
+    const wchar_t *wcs;                 /* the choices */
+    char (*enc)[WK_MBMAX];              /* multibyte encoding of each choice */
+    unsigned char *elen;                /* length of each encoding */
+    size_t *dlim;                       /* allowed duplicates of each choice */
+};
+
+struct wk_space;
+
+/* writes n candidates of a space from digit on, see kernel.c */
+typedef size_t (*wk_kernel_fn)(const struct wk_space *sp, size_t *digit, uint64_t n,
+                               char *buf, size_t *nrec);
+
+#define WK_KERNEL_MIN   4               /* lengths with a specialized kernel */
+#define WK_KERNEL_MAX   16
+
+/* all candidates of one length */
+struct wk_space {
+    size_t len;
+    struct wk_epos *pos;
+    size_t *order;                      /* positions from the fastest changing to the slowest */
+    uint64_t first, count;              /* candidates [first, first+count) are generated */
+    int single;                         /* every choice encodes to a single byte */
+    wk_kernel_fn kernel;                /* for single byte lengths with a kernel, else NULL */
+};
+
+/* compiled mask, one space per length min..max */
+struct wk_mask {
+    size_t nspaces;
+    struct wk_space *spaces;
+    size_t maxrec;                      /* largest record in bytes */
+    int checkdups;                      /* some charset limits duplicates */
+};
+
+/* words stored back to back in one arena, already encoded for output */
+struct wk_words {
+    char *arena;                        /* malloc'd, or a mapped word list */
+    size_t mapsize;                     /* size of the mapping, 0 if arena is malloc'd */
+    size_t *off;                        /* word i starts at arena[off[i]] */
+    uint32_t *len;                      /* and is len[i] bytes long */
+    size_t n;
+    size_t maxlen;                      /* longest word in bytes */
+};
+
+#define WK_MAXLISTS     8               /* word lists of the combinator (-k) */
+#define WK_MAXEXCLUDE   32              /* --exclude rules and --exclude-file files */
+
+#define WK_PERM_ARRANGE 0               /* ordered picks of k words, all n for -p/-q */
+#define WK_PERM_COMBINE 1               /* unordered picks of k words (-C) */
+
+#define WK_FMT_TEXT     0               /* records end in a newline */
+#define WK_FMT_NUL      1               /* records end in a NUL byte */
+#define WK_FMT_VARINT   2               /* LEB128 length, then the record */
+#define WK_FMT_FIXED    3               /* NUL padded to a fixed width, after a header */
+#define WK_FIX_MAGIC    "BFCFIX01"
+#define WK_FIX_HEADER   16              /* magic, then width and header size as uint32 LE */
+
+#define WK_HYB_WM       0               /* word followed by the mask (-y wm) */
+#define WK_HYB_MW       1               /* mask followed by the word (-y mw) */
+#define WK_HYB_BOTH     2               /* both of the above (-y both) */
+
+/* candidate source, candidates are numbered 0..total-1 in output order */
+struct wk_source {
+    uint64_t total;
+    size_t maxrec;                      /* largest record in bytes, including the delimiter */
+    /* write candidates [first, first+n) to buf, returns bytes written and records in *nrec,
+     * or NPOS after printing why it failed */
+    size_t (*fill)(struct wk_source *src, uint64_t first, uint64_t n, char *buf, size_t *nrec);
+    void *priv;
+};
+
+/* stage between the generators and the sink, runs in the worker threads */
+struct wk_filter {
+    size_t mult;                        /* a record becomes at most mult times its size */
+    size_t extra;                       /* plus this many bytes */
+    /* rewrite the *nrec records of in to out, returns bytes written and updates *nrec */
+    size_t (*run)(const struct wk_filter *f, const char *in, size_t len, char *out, size_t *nrec);
+    void *priv;
+};
+
+/* counters of one pool worker, a cache line apart from the others */
+struct wk_wstats {
+    uint64_t chunks;
+    uint64_t cands;                     /* candidate indexes generated */
+    uint64_t rejected;                  /* of those, skipped by the -d duplicate rule */
+    uint64_t filtered;                  /* lines dropped by the sink filter */
+    uint64_t records, bytes;            /* written */
+    uint64_t stalls;                    /* chunks that waited for an earlier one to be written */
+    uint64_t gen_ns, filter_ns, encode_ns, compress_ns, wait_ns, write_ns;
+} __attribute__((aligned(64)));
+
+struct wk_stats {
+    struct wk_wstats w[WK_MAXTHREADS];
+    int nthreads;
+    uint64_t start_ns, end_ns;
+};
+
+/*
+ * Static tracepoints for perf and bpftrace, provider bfc.  They are nops
+ * unless attached, and compile to nothing without <sys/sdt.h> or with
+ * -DWK_NO_USDT.
+ */
+#if !defined(WK_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WK_USDT 1
+#endif
+#endif
+#ifdef WK_USDT
+#define WK_PROBE2(name, a, b)           DTRACE_PROBE2(bfc, name, a, b)
+#define WK_PROBE4(name, a, b, c, d)     DTRACE_PROBE4(bfc, name, a, b, c, d)
+#else
+#define WK_PROBE2(name, a, b)           do { } while (0)
+#define WK_PROBE4(name, a, b, c, d)     do { } while (0)
+#endif
+
+/* one frame of seekable output, see seek.c */
+struct wk_frame {
+    uint64_t first, ncand;              /* candidates it covers */
+    uint64_t nrec;                      /* lines in it */
+    uint64_t off;                       /* where its gzip member starts */
+};
+
+#define WK_MAXTEES      8               /* extra outputs of --tee */
+
+struct wk_tee;
+
+/* output file or stdout */
+struct wk_sink {
+    int fd;
+    FILE *pipe;                         /* compression program, NULL if none */
+    const char *fpath;                  /* file being written, NULL for stdout */
+    const char *outputf;                /* name the file gets once it is complete */
+    const char *compressalgo;
+    unsigned long long bytelimit;       /* split output every bytelimit bytes (-b) */
+    unsigned long long linelimit;       /* split output every linelimit lines (-c) */
+    unsigned long long bytes, lines;    /* written so far */
+    unsigned long long fbytes, flines;  /* written to the current file */
+    char first[MAXSTRING*WK_MBMAX+1];   /* first line of the current file */
+    char last[MAXSTRING*WK_MBMAX+1];    /* last line of the current file */
+    int broken;                         /* reader went away */
+    const struct wk_filter *filter;     /* applied to every chunk before it is written, or NULL */
+    struct wk_stats *stats;             /* --stats counters, or NULL */
+    int format;                         /* WK_FMT_* (--format) */
+    size_t width;                       /* record width of WK_FMT_FIXED */
+    int seekable;                       /* gzip frames compressed by the workers (--seekable) */
+    struct wk_frame *frames;            /* written so far, for the index */
+    size_t nframes, cframes;
+    struct wk_tee *tee;                 /* --tee outputs fed the same records, or NULL */
+};
+
+#define WK_LEASE_LINE   512             /* longest request or reply of bfc serve */
+#define WK_LEASE_SIZE   (1ULL << 24)    /* default candidates per lease */
+#define WK_LEASE_TTL    600             /* default seconds before a lease is handed out again */
+
+/* range of the job handed to a consumer by bfc serve */
+struct wk_lease {
+    uint64_t block;
+    uint64_t first, count;
+    unsigned ttl;
+};
+
+/* renews a lease every ttl/2 seconds while its range is generated */
+struct wk_lease_keeper {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    struct wk_lease lease;
+    int stop;
+    int lost;                           /* a renewal failed, the lease may be handed out again */
+};
+
+/* where the pool workers run (-a) and what backs their buffers (-g) */
+struct wk_placement {
+    int ncpus;                          /* 0 leaves the workers unpinned */
+    int cpu[WK_MAXCPUS];                /* worker t runs on cpu[t % ncpus] */
+    int huge;                           /* buffers from the explicit huge page pool */
+};
+
+/* range of a source handed to the worker pool */
+struct wk_segment {
+    struct wk_source *src;
+    uint64_t first, count;
+    uint64_t chunk;                     /* candidates per chunk, 0 to size it from the record size */
+    size_t maxrec;                      /* largest record of the segment, 0 for src->maxrec */
+    /* called in output order once every chunk of the segment has been written */
+    int (*done)(struct wk_segment *seg, struct wk_sink *sink);
+    void *arg;
+};
+
 typedef struct wkey {
     pthread_t threads;
     FILE *fp;
@@ -79,6 +323,137 @@ typedef struct wkey {
 } wkey;
 
 void wk_init_option(options_type *op);
+size_t wk_cset_index(const options_type *op, int cls, wchar_t c);
 // void wk_start(int argc, char **argv);
 
+/* arena.c */
+void *wk_arena_alloc(struct wk_arena *a, size_t size, size_t align);
+wchar_t *wk_arena_wcs(struct wk_arena *a, size_t n);
+void wk_arena_free(struct wk_arena *a);
+
+/* mask.c */
+size_t wk_encode_char(wchar_t wc, char *out);
+int wk_mask_compile(const options_type *op, int inverted, struct wk_mask *mask);
+int wk_space_dupes(const struct wk_space *sp, const size_t *digit);
+void wk_mask_source(struct wk_mask *mask, struct wk_source *src);
+size_t wk_mask_segments(const struct wk_mask *mask, struct wk_source *src, uint64_t first,
+                        uint64_t count, size_t chunkbytes, struct wk_segment *segs);
+void wk_mask_free(struct wk_mask *mask);
+
+/* kernel.c */
+wk_kernel_fn wk_kernel_for(size_t len);
+
+/* cindex.c */
+int wk_cindex_build(struct wk_cindex *ix, const struct wk_charset *cs);
+size_t wk_cindex_id(const struct wk_cindex *ix, wchar_t c);
+void wk_cindex_free(struct wk_cindex *ix);
+
+/* words.c */
+int wk_words_from_wcs(wchar_t **warray, size_t n, struct wk_words *w);
+int wk_words_mmap(const char *filename, struct wk_words *w);
+void wk_words_free(struct wk_words *w);
+
+/* extsort.c */
+int wk_words_sorted(const char *filename, int nthreads, struct wk_words *w);
+int wk_cache_dir(char *dir, size_t size);
+
+/* combinator.c */
+int wk_combinator_source(const struct wk_words *lists, size_t nlists, const char *sep,
+                         struct wk_source *src);
+
+/* markov.c */
+int wk_markov_train(const char *wordlist, const char *statsfile);
+int wk_markov_source(const struct wk_mask *mask, const char *spec, size_t maxlevel,
+                     struct wk_source *src);
+
+/* permute.c */
+int wk_permute_source(const struct wk_words *words, int mode, size_t kmin, size_t kmax,
+                      struct wk_source *src);
+
+/* exclude.c */
+int wk_exclude_source(const struct wk_mask *mask, int inverted, char **rules, size_t nrules,
+                      char **files, size_t nfiles, struct wk_source *src);
+
+/* gray.c */
+int wk_gray_source(const struct wk_mask *mask, int delta, struct wk_source *src);
+
+/* shuffle.c */
+int wk_shuffle_source(struct wk_source *inner, const char *key, struct wk_source *src);
+
+/* hash.c */
+int wk_hash_filter(const char *spec, struct wk_filter *filter);
+
+/* hybrid.c */
+int wk_hybrid_source(const struct wk_words *words, struct wk_source *msrc, int order,
+                     struct wk_source *src);
+
+/* pool.c */
+int wk_pool_run(struct wk_segment *segs, size_t nsegs, struct wk_sink *sink, int nthreads,
+                const struct wk_placement *place);
+
+/* rules.c */
+int wk_rules_filter(const char *filename, struct wk_filter *filter);
+int wk_rules_words(const struct wk_filter *filter, const struct wk_words *in, struct wk_words *out);
+
+/* stats.c */
+uint64_t wk_now_ns(void);
+void wk_stats_report(const struct wk_stats *st);
+
+/* autotune.c */
+int wk_autotune(struct wk_segment *seg, const char *shape, const char *fpath,
+                const char *compressalgo, const struct wk_sink *tmpl,
+                int calibrate, long *nthreads);
+
+/* numa.c */
+int wk_placement_parse(const char *spec, struct wk_placement *pl);
+int wk_placement_bind(const struct wk_placement *pl, int t);
+void wk_placement_report(const struct wk_placement *pl, int nthreads);
+void *wk_buf_alloc(const struct wk_placement *pl, size_t size, size_t *mapped);
+void wk_buf_free(void *p, size_t mapped);
+
+/* serve.c */
+int wk_serve(const char *path, const char *key, uint64_t first, uint64_t count,
+             uint64_t size, unsigned ttl);
+
+/* lease.c */
+int wk_lease_connect(const char *path, const char *key, uint64_t first, uint64_t count);
+int wk_lease_next(int fd, struct wk_lease *l);
+int wk_lease_renew(int fd, const struct wk_lease *l);
+int wk_lease_complete(int fd, const struct wk_lease *l);
+int wk_lease_keep(struct wk_lease_keeper *k, int fd, const struct wk_lease *l);
+int wk_lease_release(struct wk_lease_keeper *k);
+
+/* seek.c */
+struct wk_framer;
+struct wk_framer *wk_framer_new(void);
+void wk_framer_free(struct wk_framer *fr);
+size_t wk_frame_bound(size_t len);
+size_t wk_frame_pack(struct wk_framer *fr, const char *in, size_t len, uint64_t first,
+                     uint64_t ncand, size_t nrec, char *out);
+size_t wk_seek_index(const struct wk_frame *f, size_t n, uint64_t off, char **buf);
+int wk_seek_load(int fd, struct wk_frame **frames, size_t *nframes, uint64_t *end);
+int wk_seek_resume(struct wk_sink *sink, const char *path, uint64_t *next);
+int wk_seek_extract(const char *path, uint64_t first, uint64_t count);
+int wk_seek_verify(const char *path);
+
+/* tee.c */
+struct wk_tee *wk_tee_open(char **specs, size_t n);
+int wk_tee_write(struct wk_tee *tee, const char *buf, size_t len, size_t nrec);
+int wk_tee_close(struct wk_tee *tee);
+int wk_ring_read(const char *target);
+
+/* sink.c */
+extern char wk_eol;
+int wk_format_parse(const char *spec, int *format, size_t *width);
+size_t wk_sink_encbound(const struct wk_sink *sink, size_t len, size_t nrec);
+size_t wk_sink_encode(const struct wk_sink *sink, const char *in, size_t len, char *out);
+int wk_sink_open(struct wk_sink *sink, const char *fpath, const char *outputf,
+                 const char *compressalgo, int append);
+int wk_sink_write(struct wk_sink *sink, const char *buf, size_t len, size_t nrec);
+int wk_sink_frame(struct wk_sink *sink, const char *frame, size_t flen, const char *buf,
+                  size_t len, const struct wk_frame *f);
+int wk_sink_close(struct wk_sink *sink);
+const char *wk_compress_ext(const char *algo);
+void wk_compress_cmd(const char *algo, const char *path, char *cmd, size_t size);
+
 #endif
\ No newline at end of file
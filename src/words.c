@@ -0,0 +1,141 @@
+/*
+ * Copyright 2024-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "wkey.h"
+
+/*
+ * Encode every word for output once and store them back to back, so
+ * the generators only copy bytes and never convert wide chars.
+ */
+int wk_words_from_wcs(wchar_t **warray, size_t n, struct wk_words *w) {
+    size_t i, k, len, size = 0;
+    char *p;
+
+    memset(w, 0, sizeof(*w));
+    for (i = 0; i < n; i++)
+        size += wcslen(warray[i]) * WK_MBMAX;
+
+    w->arena = malloc(size ? size : 1);
+    w->off = calloc(n+1, sizeof(size_t));
+    w->len = calloc(n+1, sizeof(uint32_t));
+    if (w->arena == NULL || w->off == NULL || w->len == NULL) {
+        fprintf(stderr,"words: can't allocate memory for %lu words\n", (unsigned long)n);
+        wk_words_free(w);
+        return -1;
+    }
+
+    p = w->arena;
+    for (i = 0; i < n; i++) {
+        w->off[i] = (size_t)(p - w->arena);
+        for (k = 0; warray[i][k] != L'\0'; k++)
+            p += wk_encode_char(warray[i][k], p);
+        len = (size_t)(p - w->arena) - w->off[i];
+        w->len[i] = (uint32_t)len;
+        if (len > w->maxlen)
+            w->maxlen = len;
+    }
+    w->off[n] = (size_t)(p - w->arena);
+    w->n = n;
+    return 0;
+}
+
+/*
+ * Map a word list read-only and index its lines in place, the words are
+ * used as they are in the file.  Empty lines are skipped and a trailing
+ * '\r' is dropped.
+ */
+int wk_words_mmap(const char *filename, struct wk_words *w) {
+    struct stat st;
+    const char *p, *end, *nl;
+    size_t n, len;
+    int fd;
+
+    memset(w, 0, sizeof(*w));
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        fprintf(stderr,"words: can't open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr,"words: %s is empty or can't be read\n", filename);
+        (void)close(fd);
+        return -1;
+    }
+
+    w->mapsize = (size_t)st.st_size;
+    w->arena = mmap(NULL, w->mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (w->arena == MAP_FAILED) {
+        fprintf(stderr,"words: can't map %s: %s\n", filename, strerror(errno));
+        w->arena = NULL;
+        w->mapsize = 0;
+        return -1;
+    }
+    (void)madvise(w->arena, w->mapsize, MADV_WILLNEED);
+
+    /* count first so the index is allocated once */
+    end = w->arena + w->mapsize;
+    for (n = 0, p = w->arena; p < end; p = nl + 1) {
+        if ((nl = memchr(p, '\n', (size_t)(end - p))) == NULL)
+            nl = end;
+        n++;
+    }
+
+    w->off = calloc(n+1, sizeof(size_t));
+    w->len = calloc(n+1, sizeof(uint32_t));
+    if (w->off == NULL || w->len == NULL) {
+        fprintf(stderr,"words: can't allocate memory for the index of %s\n", filename);
+        wk_words_free(w);
+        return -1;
+    }
+
+    for (p = w->arena; p < end; p = nl + 1) {
+        if ((nl = memchr(p, '\n', (size_t)(end - p))) == NULL)
+            nl = end;
+        len = (size_t)(nl - p);
+        if (len > 0 && p[len-1] == '\r')
+            len--;
+        if (len == 0)
+            continue;
+        if (len > MAXSTRING*WK_MBMAX) {
+            fprintf(stderr,"words: line %lu of %s is longer than %d bytes\n",
+                    (unsigned long)w->n+1, filename, MAXSTRING*WK_MBMAX);
+            wk_words_free(w);
+            return -1;
+        }
+        w->off[w->n] = (size_t)(p - w->arena);
+        w->len[w->n] = (uint32_t)len;
+        if (len > w->maxlen)
+            w->maxlen = len;
+        w->n++;
+    }
+    w->off[w->n] = w->mapsize;
+
+    if (w->n == 0) {
+        fprintf(stderr,"words: %s has no words\n", filename);
+        wk_words_free(w);
+        return -1;
+    }
+    return 0;
+}
+
+void wk_words_free(struct wk_words *w) {
+    if (w->mapsize)
+        (void)munmap(w->arena, w->mapsize);
+    else
+        free(w->arena);
+    free(w->off);
+    free(w->len);
+    memset(w, 0, sizeof(*w));
+}